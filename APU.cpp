@@ -1,21 +1,58 @@
 #include <stdio.h>
+#include <string.h>
 #include "APU.h"
 #include "Bus.h"
 #include "Audio.h"
+#include "Scheduler.h"
 
-APU::APU(Bus *pBus) : Peripheral(pBus, 0x4000, 0x4013)
+APU::APU(CPU_6502 *pCPU) : Peripheral(&pCPU->bus, 0x4000, 0x4013), blipBuffer(APU_MAX_SAMPLES)
 {
     // APU has two more registers to map
-    pBus->attachPeripheral(0x4015, 0x4015, this);
-    pBus->attachPeripheral(0x4017, 0x4017, this);
+    pCPU->bus.attachPeripheral(0x4015, 0x4015, this);
+    pCPU->bus.attachPeripheral(0x4017, 0x4017, this);
 
-    cpuBus = pBus;
+    this->pCPU = pCPU;
+    cpuBus = &pCPU->bus;
+    pScheduler = NULL;
+    dmcEventTime = NO_DMC_EVENT;
 
     status.entireRegister = 0;
     frameCounterStep = 0;
-    apuCyclesBeforeNextFrameCounterStep = (int)APU_CYCLES_PER_QUARTER_FRAME;
+    cyclesBeforeNextFrameCounterStep = CPU_CYCLES_PER_QUARTER_FRAME;
     mutePulse1 = false;
     mutePulse2 = false;
+
+    memset(&pulse1, 0, sizeof(pulse1));
+    memset(&pulse2, 0, sizeof(pulse2));
+    memset(&triangle, 0, sizeof(triangle));
+    memset(&noise, 0, sizeof(noise));
+    memset(&dmc, 0, sizeof(dmc));
+    noise.shiftRegister = 1;
+    dmc.timer = DMC_RATE_TABLE[0];
+    dmc.bitsRemaining = 8;
+    dmc.silence = true;
+
+    // The mixer formulas from the NESdev wiki, worked out once for every combination of levels. 95.52 / (8128 / n + 100)
+    // is rearranged to 9552 * n / (100 * (8128 + 100 * n)) so it can be done exactly in integers, rounded to nearest.
+    for (int i = 0; i < PULSE_MIX_ENTRIES; ++i)
+    {
+        uint64_t numerator = 9552ULL * i * MIXER_FULL_SCALE;
+        uint64_t denominator = 100ULL * (8128 + 100 * i);
+        pulseMixTable[i] = (uint16_t)((numerator + denominator / 2) / denominator);
+    }
+
+    // Likewise 163.67 / (24329 / n + 100)
+    for (int i = 0; i < TND_MIX_ENTRIES; ++i)
+    {
+        uint64_t numerator = 16367ULL * i * MIXER_FULL_SCALE;
+        uint64_t denominator = 100ULL * (24329 + 100 * i);
+        tndMixTable[i] = (uint16_t)((numerator + denominator / 2) / denominator);
+    }
+
+    blipBuffer.SetRates(CPU_CYCLES_PER_SECOND, SAMPLES_PER_SECOND);
+    outputAmplitude = 0;
+    frameStartClock = pCPU->clocks;
+    currentTime = 0;
 }
 
 APU::~APU()
@@ -24,11 +61,25 @@ APU::~APU()
 
 uint8_t APU::read(uint16_t addr)
 {
+    // The length counters have to be up to date
+    CatchUp();
+
     switch (addr)
     {
         case APU_REG_STATUS:
-            return status.entireRegister;
-            break;
+        {
+            // Reads back which channels are still playing rather than which are enabled
+            APU_STATUS value;
+            value.entireRegister = 0;
+            value.pulse1_Enabled = pulse1.pulseLengthCounter != 0;
+            value.pulse2_Enabled = pulse2.pulseLengthCounter != 0;
+            value.triangleEnabled = triangle.lengthCounter != 0;
+            value.noiseEnabled = noise.lengthCounter != 0;
+            value.dmcEnabled = dmc.bytesRemaining != 0;
+            value.frameInterrupt = status.frameInterrupt;
+            value.dmcInterrupt = status.dmcInterrupt;
+            return value.entireRegister;
+        }
 
         default:
             printf("APU::read() called with unknown address, 0x%X\n", addr);
@@ -40,6 +91,8 @@ uint8_t APU::read(uint16_t addr)
 
 void APU::write(uint16_t addr, uint8_t data)
 {
+    // Everything up to now plays with the old register values
+    CatchUp();
 
     switch (addr)
     {
@@ -49,6 +102,19 @@ void APU::write(uint16_t addr, uint8_t data)
                 pulse1.pulseLengthCounter = 0;
             if (!status.pulse2_Enabled)
                 pulse2.pulseLengthCounter = 0;
+            if (!status.triangleEnabled)
+                triangle.lengthCounter = 0;
+            if (!status.noiseEnabled)
+                noise.lengthCounter = 0;
+
+            // Disabling the DMC lets the rest of the sample buffer play out, enabling it starts the sample over if
+            // it had finished
+            if (!status.dmcEnabled)
+                dmc.bytesRemaining = 0;
+            else if (dmc.bytesRemaining == 0)
+                RestartDMC_Sample();
+
+            pCPU->irqSources &= ~IRQ_DMC;
             //printf("APU status updated: 0x%X\n", data);
             break;
 
@@ -61,12 +127,12 @@ void APU::write(uint16_t addr, uint8_t data)
             break;
         case APU_REG_PULSE1_2:
             pulse1.reg2_TimerLower8 = data;
-            pulse1.timer = pulse1.reg2_TimerLower8 | ((uint16_t)pulse1.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+            pulse1.timer = PulsePeriod(&pulse1);
             break;
         case APU_REG_PULSE1_3:
             pulse1.reg3_CounterReset_TimerHigh3.entireRegister = data;
 
-            pulse1.timer = pulse1.reg2_TimerLower8 | ((uint16_t)pulse1.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+            pulse1.timer = PulsePeriod(&pulse1);
             //printf("C: 0x%X - ", pulse1.reg3_CounterReset_TimerHigh3.pulseLengthCounterLoad);
             pulse1.pulseLengthCounter = LENGTH_LOOKUP_TABLE[pulse1.reg3_CounterReset_TimerHigh3.pulseLengthCounterLoad];
             //printf("%d\n", pulse1.pulseLengthCounter);
@@ -83,141 +149,380 @@ void APU::write(uint16_t addr, uint8_t data)
             break;
         case APU_REG_PULSE2_2:
             pulse2.reg2_TimerLower8 = data;
-            pulse2.timer = pulse2.reg2_TimerLower8 | ((uint16_t)pulse2.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+            pulse2.timer = PulsePeriod(&pulse2);
             break;
         case APU_REG_PULSE2_3:
             pulse2.reg3_CounterReset_TimerHigh3.entireRegister = data;
 
-            pulse2.timer = pulse2.reg2_TimerLower8 | ((uint16_t)pulse2.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+            pulse2.timer = PulsePeriod(&pulse2);
             pulse2.pulseLengthCounter = LENGTH_LOOKUP_TABLE[pulse2.reg3_CounterReset_TimerHigh3.pulseLengthCounterLoad];
             pulse2.dutyCyclePosition = 0;
             pulse2.envelope.startFlag = true;
             break;
 
         case APU_REG_TRIANGLE_0:
+            triangle.reg0.entireRegister = data;
             break;
         case APU_REG_TRIANGLE_2_TIMER_LOW:
+            triangle.reg2_TimerLower8 = data;
             break;
         case APU_REG_TRIANGLE_3:
+            triangle.reg3_CounterReset_TimerHigh3.entireRegister = data;
+            if (status.triangleEnabled)
+                triangle.lengthCounter = LENGTH_LOOKUP_TABLE[triangle.reg3_CounterReset_TimerHigh3.pulseLengthCounterLoad];
+            triangle.linearCounterReload = true;
             break;
 
         case APU_REG_NOISE_0:
+            noise.reg0.entireRegister = data;
             break;
         case APU_REG_NOISE_2_LOOP_AND_PERIOD:
+            noise.reg2.entireRegister = data;
             break;
         case APU_REG_NOISE_3_LENGTH_CTR_LOAD:
-            // TODO: Set envelope start flag
+            if (status.noiseEnabled)
+                noise.lengthCounter = LENGTH_LOOKUP_TABLE[data >> 3];
+            noise.envelope.startFlag = true;
             break;
 
+        case APU_REG_DMC_0:
+            dmc.reg0.entireRegister = data;
+            if (!dmc.reg0.irqEnabled)
+            {
+                status.dmcInterrupt = false;
+                pCPU->irqSources &= ~IRQ_DMC;
+            }
+            break;
         case APU_REG_DMC_1:
+            dmc.outputLevel = data & 0x7F;
+            break;
+        case APU_REG_DMC_2:
+            dmc.reg2_SampleAddress = data;
+            break;
+        case APU_REG_DMC_3:
+            dmc.reg3_SampleLength = data;
+            break;
+
+        case APU_REG_TRIANGLE_1_UNUSED:
+        case APU_REG_NOISE_1_UNUSED:
             break;
 
         default:
             printf("APU::write() called with unknown address, 0x%X\n", addr);
             break;
     }
+
+    // The write can change the output right away, and when the DMC fetches next
+    UpdateOutput(currentTime);
+    ScheduleDMC();
 }
 
-// Emulates the APU and sends samples to our audio subsystem in Audio.c
-// timeDuration - how many seconds of audio we should generate
-void APU::ProcessAudio(double timeDuration)
+// Runs the APU up to the CPU
+void APU::CatchUp()
 {
-    // Process each audio channel and output the sample to the audio hardware
+    for (;;)
+    {
+        uint64_t cycles = pCPU->clocks - frameStartClock;
 
-    // determine how many audio samples we'll be sending
-    int sampleCount = (int)(timeDuration * SAMPLES_PER_SECOND) + 1;
-    double *pSampleBuffer = new double[sampleCount];
-    int currentSample = 0;
+        // Frames end long before the buffer fills, unless something keeps the CPU from reaching the end of one
+        int maxCycles = blipBuffer.MaxFrameClocks();
+        if (cycles <= (uint64_t)maxCycles)
+        {
+            Run((int)cycles);
+            return;
+        }
 
-    uint16_t pulse1_TimerReset = pulse1.reg2_TimerLower8 | ((uint16_t)pulse1.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
-    bool pulse1_Enabled = status.pulse1_Enabled && pulse1_TimerReset >= 8;
-    double pulse1_Output = 0;
+        Run(maxCycles);
+        FinishFrame();
+    }
+}
 
-    uint16_t pulse2_TimerReset = pulse2.reg2_TimerLower8 | ((uint16_t)pulse2.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
-    bool pulse2_Enabled = status.pulse2_Enabled && pulse2_TimerReset >= 8;
-    double pulse2_Output = 0;
-    
-    // Keep generating samples until we've generated the requested duration
-    // TODO: Keep track of any differences
-    double apuCycles = 0.0;
-    while (timeDuration >= 0.0)
+// Catches up and sends the frame's samples to our audio subsystem in Audio.c
+void APU::EndFrame()
+{
+    CatchUp();
+    FinishFrame();
+}
+
+// Runs the channels up to each frame counter step, which can change their volume
+void APU::Run(int endTime)
+{
+    while (endTime - currentTime >= cyclesBeforeNextFrameCounterStep)
     {
-        while (apuCycles <= APU_CYCLES_PER_SAMPLE && timeDuration >= 0.0)
-        {
-            // Process pulse1 channel
-            if (pulse1_Enabled && pulse1.pulseLengthCounter != 0 )
-            {
-                --pulse1.timer;
+        int stepTime = currentTime + cyclesBeforeNextFrameCounterStep;
+        RunChannels(currentTime, stepTime);
+        currentTime = stepTime;
 
-                if (pulse1.timer == 0xFFFF)
-                {
-                    // Reset internal timer
-                    pulse1.timer = pulse1_TimerReset;
-                    ++pulse1.timer;
+        ClockFrameCounter();
+        UpdateOutput(currentTime);
+    }
 
-                    // Advance position in duty cycle
-                    pulse1.dutyCyclePosition = (pulse1.dutyCyclePosition + 1) & 7;  // 0 - 7
+    RunChannels(currentTime, endTime);
+    cyclesBeforeNextFrameCounterStep -= endTime - currentTime;
+    currentTime = endTime;
+}
 
-                    pulse1_Output = DUTY_CYCLE_WAVEFORM[pulse1.reg0.dutyCycle][pulse1.dutyCyclePosition];
-                }
-            }
+void APU::FinishFrame()
+{
+    blipBuffer.EndFrame(currentTime);
+    frameStartClock += currentTime;
+    currentTime = 0;
 
-            // Process pulse2 channel
-            if (pulse2_Enabled && pulse2.pulseLengthCounter != 0)
-            {
-                --pulse2.timer;
+    // The buffer never holds more than APU_MAX_SAMPLES, so they all fit
+    int sampleCount = blipBuffer.ReadSamples(outputSamples, APU_MAX_SAMPLES);
+    SendAudioData(outputSamples, sampleCount);
 
-                if (pulse2.timer == 0xFFFF)
-                {
-                    // Reset internal timer
-                    pulse2.timer = pulse2_TimerReset;
-                    ++pulse2.timer;
+    // Makes a few more or fewer samples next frame to keep the output's buffer at the same fill level
+    blipBuffer.SetRates(CPU_CYCLES_PER_SECOND, SAMPLES_PER_SECOND + GetAudioRateAdjustment());
+}
 
-                    // Advance position in duty cycle
-                    pulse2.dutyCyclePosition = (pulse2.dutyCyclePosition + 1) & 7;  // 0 - 7
+// Runs the channels from one timer step to the next instead of cycle by cycle. A channel's timer is the number of
+// cycles until its next step. Channels that can't be heard don't step at all, so their timers wait where they are.
+void APU::RunChannels(int time, int endTime)
+{
+    for (;;)
+    {
+        bool pulse1_Active = PulseActive(&pulse1);
+        bool pulse2_Active = PulseActive(&pulse2);
+        bool triangleActive = TriangleActive();
+        bool noiseActive = noise.lengthCounter != 0;
+        bool dmcActive = DMC_Active();
+
+        int cycles = endTime - time;
+        if (pulse1_Active && pulse1.timer < cycles)
+            cycles = pulse1.timer;
+        if (pulse2_Active && pulse2.timer < cycles)
+            cycles = pulse2.timer;
+        if (triangleActive && triangle.timer < cycles)
+            cycles = triangle.timer;
+        if (noiseActive && noise.timer < cycles)
+            cycles = noise.timer;
+        if (dmcActive && dmc.timer < cycles)
+            cycles = dmc.timer;
+
+        time += cycles;
+        if (pulse1_Active)
+            pulse1.timer -= cycles;
+        if (pulse2_Active)
+            pulse2.timer -= cycles;
+        if (triangleActive)
+            triangle.timer -= cycles;
+        if (noiseActive)
+            noise.timer -= cycles;
+        if (dmcActive)
+            dmc.timer -= cycles;
+
+        if (time == endTime)
+            break;
 
-                    pulse2_Output = DUTY_CYCLE_WAVEFORM[pulse2.reg0.dutyCycle][pulse2.dutyCyclePosition];
-                }
-            }
+        if (pulse1_Active && pulse1.timer == 0)
+            StepPulse(&pulse1);
+        if (pulse2_Active && pulse2.timer == 0)
+            StepPulse(&pulse2);
+        if (triangleActive && triangle.timer == 0)
+            StepTriangle();
+        if (noiseActive && noise.timer == 0)
+            StepNoise();
+        if (dmcActive && dmc.timer == 0)
+            StepDMC();
+
+        UpdateOutput(time);
+    }
+}
+
+// Advances the position in the duty cycle, every (timer + 1) APU cycles
+void APU::StepPulse(APU_PULSE_CHANNEL *pChannel)
+{
+    pChannel->timer = PulsePeriod(pChannel);
+
+    pChannel->dutyCyclePosition = (pChannel->dutyCyclePosition + 1) & 7;  // 0 - 7
+}
+
+// The pulse timers count APU cycles, two CPU cycles each
+int APU::PulsePeriod(APU_PULSE_CHANNEL *pChannel)
+{
+    uint16_t timerReset = pChannel->reg2_TimerLower8 | ((uint16_t)pChannel->reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+    return (timerReset + 1) * 2;
+}
+
+// Advances the position in the triangle, every (timer + 1) CPU cycles
+void APU::StepTriangle()
+{
+    uint16_t timerReset = triangle.reg2_TimerLower8 | ((uint16_t)triangle.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+    triangle.timer = timerReset + 1;
+
+    triangle.sequencePosition = (triangle.sequencePosition + 1) & 31;   // 0 - 31
+}
+
+// Clocks the linear feedback shift register
+void APU::StepNoise()
+{
+    noise.timer = NOISE_PERIOD_TABLE[noise.reg2.periodIndex];
+
+    int otherBit = noise.reg2.loopNoise ? 6 : 1;
+    uint16_t feedback = (noise.shiftRegister ^ (noise.shiftRegister >> otherBit)) & 1;
+    noise.shiftRegister = (noise.shiftRegister >> 1) | (feedback << 14);
+}
+
+// Moves the output level up or down by 2 for each bit of the sample
+void APU::StepDMC()
+{
+    dmc.timer = DMC_RATE_TABLE[dmc.reg0.rateIndex];
 
-            timeDuration -= SECONDS_PER_APU_CYCLE;
-            apuCycles += 1.0;
-            --apuCyclesBeforeNextFrameCounterStep;
-            if (apuCyclesBeforeNextFrameCounterStep == 0)
-                ClockFrameCounter();
+    if (!dmc.silence)
+    {
+        if (dmc.shiftRegister & 1)
+        {
+            if (dmc.outputLevel <= 125)
+                dmc.outputLevel += 2;
         }
-        
-        if (timeDuration > 0.0)
+        else if (dmc.outputLevel >= 2)
+            dmc.outputLevel -= 2;
+    }
+
+    dmc.shiftRegister >>= 1;
+
+    // Start on the next byte, if the memory reader got it in time
+    if (--dmc.bitsRemaining == 0)
+    {
+        dmc.bitsRemaining = 8;
+        dmc.silence = !dmc.sampleBufferFull;
+        if (dmc.sampleBufferFull)
         {
-            pSampleBuffer[currentSample] = 0;
+            dmc.shiftRegister = dmc.sampleBuffer;
+            dmc.sampleBufferFull = false;
+            FetchDMC_Sample();
+        }
+    }
+}
 
-            // mix the channels and add the current sample to the output buffer
-            if (!mutePulse1)
-            {
-                if (pulse1.reg0.constantVolume)
-                    pSampleBuffer[currentSample] = pulse1_Output * PULSE_VOLUME_STEP * pulse1.reg0.volumeEnvelopeDividerPeriod;
-                else
-                    pSampleBuffer[currentSample] = pulse1_Output * PULSE_VOLUME_STEP * pulse1.envelope.decayLevel;
-            }
+// Periods under 8 are silenced, they'd be ultrasonic
+bool APU::PulseActive(APU_PULSE_CHANNEL *pChannel)
+{
+    uint16_t timerReset = pChannel->reg2_TimerLower8 | ((uint16_t)pChannel->reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+    return pChannel->pulseLengthCounter != 0 && timerReset >= 8;
+}
 
-            if (!mutePulse2)
-            {
-                if (pulse2.reg0.constantVolume)
-                    pSampleBuffer[currentSample] += pulse2_Output * PULSE_VOLUME_STEP * pulse2.reg0.volumeEnvelopeDividerPeriod;
-                else
-                    pSampleBuffer[currentSample] += pulse2_Output * PULSE_VOLUME_STEP * pulse2.envelope.decayLevel;
-            }
+// The triangle stops where it is when either counter runs out. Periods under 2 are stopped too, they're ultrasonic
+// and would step every cycle.
+bool APU::TriangleActive()
+{
+    uint16_t timerReset = triangle.reg2_TimerLower8 | ((uint16_t)triangle.reg3_CounterReset_TimerHigh3.timerHigh3_Bits << 8);
+    return triangle.lengthCounter != 0 && triangle.linearCounter != 0 && timerReset >= 2;
+}
+
+// The DMC only has something to do while there's sample data left to play
+bool APU::DMC_Active()
+{
+    return !dmc.silence || dmc.sampleBufferFull || dmc.bytesRemaining != 0;
+}
+
+// The volume the channel is putting out right now, 0 - 15
+int APU::PulseLevel(APU_PULSE_CHANNEL *pChannel)
+{
+    if (!PulseActive(pChannel))
+        return 0;
 
+    if (!DUTY_CYCLE_WAVEFORM[pChannel->reg0.dutyCycle][pChannel->dutyCyclePosition])
+        return 0;
 
-            ++currentSample;
-        }
+    if (pChannel->reg0.constantVolume)
+        return pChannel->reg0.volumeEnvelopeDividerPeriod;
+
+    return pChannel->envelope.decayLevel;
+}
+
+int APU::NoiseLevel()
+{
+    if (noise.lengthCounter == 0 || (noise.shiftRegister & 1))
+        return 0;
+
+    if (noise.reg0.constantVolume)
+        return noise.reg0.volumeEnvelopeDividerPeriod;
+
+    return noise.envelope.decayLevel;
+}
 
-        apuCycles -= APU_CYCLES_PER_SAMPLE;
+// Mixes the channels and adds a step to the buffer if the output changed
+void APU::UpdateOutput(int time)
+{
+    int pulseLevel = 0;
+    if (!mutePulse1)
+        pulseLevel += PulseLevel(&pulse1);
+    if (!mutePulse2)
+        pulseLevel += PulseLevel(&pulse2);
+
+    // The triangle holds its level when it stops
+    int tndLevel = 3 * TRIANGLE_SEQUENCE[triangle.sequencePosition] + 2 * NoiseLevel() + dmc.outputLevel;
+
+    int amplitude = pulseMixTable[pulseLevel] + tndMixTable[tndLevel];
+    if (amplitude != outputAmplitude)
+    {
+        blipBuffer.AddDelta(time, amplitude - outputAmplitude);
+        outputAmplitude = amplitude;
     }
+}
+
+// Fills the sample buffer from the CPU bus, stalling the CPU while it does
+void APU::FetchDMC_Sample()
+{
+    if (dmc.sampleBufferFull || dmc.bytesRemaining == 0)
+        return;
+
+    dmc.sampleBuffer = cpuBus->read(dmc.currentAddress);
+    dmc.sampleBufferFull = true;
+    pCPU->Stall(DMC_FETCH_CYCLES);
+
+    // Wraps around to $8000
+    dmc.currentAddress = (dmc.currentAddress == 0xFFFF) ? 0x8000 : dmc.currentAddress + 1;
+
+    if (--dmc.bytesRemaining == 0)
+    {
+        if (dmc.reg0.loop)
+            RestartDMC_Sample();
+        else if (dmc.reg0.irqEnabled)
+        {
+            status.dmcInterrupt = true;
+            pCPU->irqSources |= IRQ_DMC;
+        }
+    }
+}
 
-    SendAudioData(pSampleBuffer, currentSample);
+// Fetches happen on the step that empties the sample buffer. A fetch that's already scheduled sooner stays, when it
+// comes it catches up and schedules the next one from there.
+void APU::ScheduleDMC()
+{
+    if (!pScheduler || !dmc.sampleBufferFull || dmc.bytesRemaining == 0)
+        return;
+
+    int rate = DMC_RATE_TABLE[dmc.reg0.rateIndex];
+    uint64_t fetchClock = frameStartClock + currentTime + dmc.timer + (dmc.bitsRemaining - 1) * rate;
+
+    // Catching up to a step's cycle stops just short of taking it, so the event is the cycle after
+    uint64_t time = (fetchClock + 1) * 3;
+    if (dmcEventTime != NO_DMC_EVENT && dmcEventTime <= time)
+        return;
+
+    dmcEventTime = time;
+    pScheduler->Schedule(time, EVENT_DMC_FETCH);
+}
+
+void APU::HandleDMC_Event(uint64_t time)
+{
+    // Replaced by one scheduled sooner
+    if (time != dmcEventTime)
+        return;
 
-    delete pSampleBuffer;
+    dmcEventTime = NO_DMC_EVENT;
+    CatchUp();
+    ScheduleDMC();
+}
+
+void APU::RestartDMC_Sample()
+{
+    dmc.currentAddress = 0xC000 + dmc.reg2_SampleAddress * 64;
+    dmc.bytesRemaining = dmc.reg3_SampleLength * 16 + 1;
+    FetchDMC_Sample();
 }
 
 void APU::ClockFrameCounter()
@@ -226,15 +531,19 @@ void APU::ClockFrameCounter()
     {
         case 0:
         case 2:
-            ClockPulseEnvelope(&pulse1);
-            ClockPulseEnvelope(&pulse2);
+            ClockEnvelope(&pulse1.envelope, pulse1.reg0);
+            ClockEnvelope(&pulse2.envelope, pulse2.reg0);
+            ClockEnvelope(&noise.envelope, noise.reg0);
+            ClockLinearCounter();
             break;
 
         case 1:
         case 3:
             // Clock envelope and triangle counters
-            ClockPulseEnvelope(&pulse1);
-            ClockPulseEnvelope(&pulse2);
+            ClockEnvelope(&pulse1.envelope, pulse1.reg0);
+            ClockEnvelope(&pulse2.envelope, pulse2.reg0);
+            ClockEnvelope(&noise.envelope, noise.reg0);
+            ClockLinearCounter();
 
             // Clock length and sweep units
             if (!pulse1.reg0.dontCountDown)
@@ -249,6 +558,12 @@ void APU::ClockFrameCounter()
                     --pulse2.pulseLengthCounter;
             }
 
+            if (!triangle.reg0.control && triangle.lengthCounter != 0)
+                --triangle.lengthCounter;
+
+            if (!noise.reg0.dontCountDown && noise.lengthCounter != 0)
+                --noise.lengthCounter;
+
             ClockSweep(&pulse1, true);
             ClockSweep(&pulse2, false);
 
@@ -257,40 +572,53 @@ void APU::ClockFrameCounter()
     
     frameCounterStep = (frameCounterStep + 1) & 3; // 0 - 3
 
-    apuCyclesBeforeNextFrameCounterStep = (int)APU_CYCLES_PER_QUARTER_FRAME;
+    cyclesBeforeNextFrameCounterStep = CPU_CYCLES_PER_QUARTER_FRAME;
+}
+
+void APU::ClockLinearCounter()
+{
+    if (triangle.linearCounterReload)
+        triangle.linearCounter = triangle.reg0.linearCounterLoad;
+    else if (triangle.linearCounter != 0)
+        --triangle.linearCounter;
+
+    // The control flag keeps the counter reloading
+    if (!triangle.reg0.control)
+        triangle.linearCounterReload = false;
 }
 
-void APU::ClockPulseEnvelope(APU_PULSE_CHANNEL * pChannel)
+// Shared by the pulses and noise, which have the same control bits
+void APU::ClockEnvelope(APU_CHANNEL_ENVELOPE *pEnvelope, APU_PULSE_REG_0 control)
 {
     // Clock envelope counters
-    if (pChannel->envelope.startFlag)
+    if (pEnvelope->startFlag)
     {
-        pChannel->envelope.startFlag = false;
-        pChannel->envelope.decayLevel = 15;
-        pChannel->envelope.divider = pChannel->reg0.volumeEnvelopeDividerPeriod;
+        pEnvelope->startFlag = false;
+        pEnvelope->decayLevel = 15;
+        pEnvelope->divider = control.volumeEnvelopeDividerPeriod;
     }
     else
     {
         // envelope start flag is clear; clock the envelope divider
-        if (pChannel->envelope.divider == 0)
+        if (pEnvelope->divider == 0)
         {
-            pChannel->envelope.divider = pChannel->reg0.volumeEnvelopeDividerPeriod;
+            pEnvelope->divider = control.volumeEnvelopeDividerPeriod;
 
             // clock the decay level
-            if (pChannel->envelope.decayLevel != 0)
+            if (pEnvelope->decayLevel != 0)
             {
-                --pChannel->envelope.decayLevel;
+                --pEnvelope->decayLevel;
             }
             else
             {
-                if (pChannel->reg0.dontCountDown)   // check envelope loop flag
-                    pChannel->envelope.decayLevel = 15;
+                if (control.dontCountDown)   // check envelope loop flag
+                    pEnvelope->decayLevel = 15;
             }
         }
         else
         {
-            // pChannel->envelope.divider is non-zero
-            --pChannel->envelope.divider;
+            // pEnvelope->divider is non-zero
+            --pEnvelope->divider;
         }
     }
 }
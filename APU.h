@@ -1,7 +1,11 @@
 #pragma once
 #include <stdint.h>
 #include "peripheral.h"
+#include "CPU_6502.h"
 #include "Audio.h"
+#include "BlipBuffer.h"
+
+class Scheduler;
 
 // PULSE 1 channel has 4 registers
 #define APU_REG_PULSE1_0    0x4000
@@ -98,11 +102,93 @@ typedef struct APU_PULSE_CHANNEL
 #define APU_REG_NOISE_2_LOOP_AND_PERIOD 0x400E /* L--- PPPP  -  Loop noise (L), noise period (P) */
 #define APU_REG_NOISE_3_LENGTH_CTR_LOAD 0x400F /* LLLL L---  -  Length counter load (L) */
 
-// DMC is mostly unimplemented
-#define APU_REG_DMC_0                   0x4010
-#define APU_REG_DMC_1                   0x4011
-#define APU_REG_DMC_2                   0x4012
-#define APU_REG_DMC_3                   0x4013
+// CRRR RRRR	Length counter halt / linear counter control (C), linear counter load (R)
+typedef union APU_TRIANGLE_REG_0
+{
+    struct
+    {
+        uint8_t linearCounterLoad : 7;
+        bool control : 1;
+    };
+    uint8_t entireRegister;
+}APU_TRIANGLE_REG_0;
+
+typedef struct APU_TRIANGLE_CHANNEL
+{
+    APU_TRIANGLE_REG_0                  reg0;
+    uint8_t                             reg2_TimerLower8;
+    APU_PULSE_REG3_COUNTER_TIMER_HIGH_3 reg3_CounterReset_TimerHigh3;   // laid out like the pulse's
+
+    uint16_t timer;
+    uint8_t lengthCounter;
+    uint8_t linearCounter;
+    bool linearCounterReload;
+    uint8_t sequencePosition;       // 0 - 31
+}APU_TRIANGLE_CHANNEL;
+
+// L--- PPPP	Loop noise (L), noise period (P)
+typedef union APU_NOISE_REG_2
+{
+    struct
+    {
+        uint8_t periodIndex : 4;
+        uint8_t unused : 3;
+        bool loopNoise : 1;     // AKA mode, a shorter sequence that sounds more like a tone
+    };
+    uint8_t entireRegister;
+}APU_NOISE_REG_2;
+
+typedef struct APU_NOISE_CHANNEL
+{
+    APU_PULSE_REG_0 reg0;           // --LC VVVV, the same as the pulse's without the duty cycle
+    APU_NOISE_REG_2 reg2;
+
+    uint16_t timer;
+    uint8_t lengthCounter;
+    APU_CHANNEL_ENVELOPE envelope;
+    uint16_t shiftRegister;         // 15 bits
+}APU_NOISE_CHANNEL;
+
+// DMC has 4 registers
+#define APU_REG_DMC_0                   0x4010 /* IL-- RRRR  -  IRQ enable (I), loop (L), rate index (R) */
+#define APU_REG_DMC_1                   0x4011 /* -DDD DDDD  -  Direct load of the output level (D) */
+#define APU_REG_DMC_2                   0x4012 /* AAAA AAAA  -  Sample address, $C000 + A * 64 */
+#define APU_REG_DMC_3                   0x4013 /* LLLL LLLL  -  Sample length, L * 16 + 1 bytes */
+
+typedef union APU_DMC_REG_0
+{
+    struct
+    {
+        uint8_t rateIndex : 4;
+        uint8_t unused : 2;
+        bool loop : 1;
+        bool irqEnabled : 1;
+    };
+    uint8_t entireRegister;
+}APU_DMC_REG_0;
+
+typedef struct APU_DMC_CHANNEL
+{
+    APU_DMC_REG_0 reg0;
+    uint8_t reg2_SampleAddress;
+    uint8_t reg3_SampleLength;
+
+    uint16_t timer;
+
+    // Memory reader
+    uint16_t currentAddress;
+    uint16_t bytesRemaining;
+    uint8_t sampleBuffer;
+    bool sampleBufferFull;
+
+    // Output unit
+    uint8_t shiftRegister;
+    uint8_t bitsRemaining;
+    bool silence;
+    uint8_t outputLevel;            // 0 - 127
+}APU_DMC_CHANNEL;
+
+#define DMC_FETCH_CYCLES    4   /* CPU cycles the CPU is stalled for while the DMC reads a sample byte */
 
 // Status and frame counter registers
 #define APU_REG_STATUS          0x4015
@@ -129,50 +215,108 @@ typedef union APU_STATUS
 
 #define APU_STATUS_WRITE_BITS 0x1F
 
-/*const bool DUTY_CYCLE_WAVEFORM[4][8] = { { false, true, false, false,   false, false, false, false },   // 12.5%
-                                         { false, true, true, false,   false, false, false, false },    // 25%
-                                         { false, true, true, true,   true, false, false, false },      // 50%
-                                         { true, false, false, true,   true, true, true, true } };      // 25% negated*/
+const uint8_t DUTY_CYCLE_WAVEFORM[4][8] = { { 0, 1, 0, 0, 0, 0, 0, 0 },      // 12.5%
+                                            { 0, 1, 1, 0, 0, 0, 0, 0 },      // 25%
+                                            { 0, 1, 1, 1, 1, 0, 0, 0 },      // 50%
+                                            { 1, 0, 0, 1, 1, 1, 1, 1 } };    // 25% negated
+
+const uint8_t TRIANGLE_SEQUENCE[32] = { 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+                                         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 };
 
-const double DUTY_CYCLE_WAVEFORM[4][8] = { { -1,  1, -1, -1, -1, -1, -1, -1 },      // 12.5%
-                                           { -1,  1,  1, -1, -1, -1, -1, -1 },      // 25%
-                                           { -1,  1,  1,  1,  1, -1, -1, -1 },      // 50%
-                                           {  1, -1, -1,  1,  1,  1,  1,  1 } };    // 25% negated
+// Timer periods in CPU cycles
+const uint16_t NOISE_PERIOD_TABLE[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+const uint16_t DMC_RATE_TABLE[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
 
 const uint8_t LENGTH_LOOKUP_TABLE[0x20] = { 10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
                                             12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30 };
 
-const double APU_CYCLES_PER_SECOND = 894886.5;
-const double SECONDS_PER_APU_CYCLE = 1.0 / APU_CYCLES_PER_SECOND;
-const double APU_CYCLES_PER_SAMPLE = APU_CYCLES_PER_SECOND / SAMPLES_PER_SECOND;
-const double SECONDS_PER_LINE = 1.0 / 60.0 / 262.0;
+// Time is kept in whole CPU cycles and everything derived from it is integer math, so the same input gives the same
+// samples on any compiler
+#define CPU_CYCLES_PER_SECOND   1789773     /* 21.477272 MHz / 12, rounded */
+
+const int CPU_CYCLES_PER_QUARTER_FRAME = CPU_CYCLES_PER_SECOND / 240; // Approximate
 
-const double APU_CYCLES_PER_QUARTER_FRAME = APU_CYCLES_PER_SECOND / 240.0; // Approximate
-const double PULSE_VOLUME_STEP = 1.0 / 30.0;
+// The mixer's output for every channel at full volume, the largest 16 bit sample so even a jump from silence to
+// everything at once doesn't clip
+#define MIXER_FULL_SCALE    32767
+#define PULSE_MIX_ENTRIES   31      /* pulse 1 + pulse 2, 0 - 30 */
+#define TND_MIX_ENTRIES     203     /* 3 * triangle + 2 * noise + DMC, 0 - 202 */
+
+// Samples the band-limited buffer has room for, a quarter of a second
+#define APU_MAX_SAMPLES     (SAMPLES_PER_SECOND / 4)
+
+#define NO_DMC_EVENT        0xFFFFFFFFFFFFFFFFULL
 
 class APU :
     public Peripheral
 {
 public:
-    APU(Bus *pBus);
+    APU(CPU_6502 *pCPU);
     ~APU();
 
     uint8_t read(uint16_t addr);
     void write(uint16_t addr, uint8_t data);
 
-    void ProcessAudio(double elapsedTime);
+    // The APU is clocked by the CPU, and only runs when something needs it to: before a register access and at the
+    // end of each frame. Times are in CPU cycles, which the triangle, noise and DMC timers count in.
+    void CatchUp();
+    void EndFrame();
+    void Run(int endTime);
+    void FinishFrame();
     void ClockFrameCounter();
 
-    void ClockPulseEnvelope(APU_PULSE_CHANNEL *pChannel);
+    // Band-limited synthesis, see BlipBuffer.h. Times are CPU cycles since the start of the audio frame.
+    void RunChannels(int time, int endTime);
+    void StepPulse(APU_PULSE_CHANNEL *pChannel);
+    int  PulsePeriod(APU_PULSE_CHANNEL *pChannel);
+    void StepTriangle();
+    void StepNoise();
+    void StepDMC();
+    bool PulseActive(APU_PULSE_CHANNEL *pChannel);
+    bool TriangleActive();
+    bool DMC_Active();
+    int  PulseLevel(APU_PULSE_CHANNEL *pChannel);
+    int  NoiseLevel();
+    void UpdateOutput(int time);
+
+    // DMC fetches (and the IRQ after the last one) change the CPU's clocks and read from whatever bank is mapped, so
+    // they're run by an EVENT_DMC_FETCH on their own cycle rather than at the next catch-up
+    void ScheduleDMC();
+    void HandleDMC_Event(uint64_t time);
+
+    // The DMC's memory reader, which steals cycles from the CPU
+    void FetchDMC_Sample();
+    void RestartDMC_Sample();
+
+    void ClockEnvelope(APU_CHANNEL_ENVELOPE *pEnvelope, APU_PULSE_REG_0 control);
+    void ClockLinearCounter();
     void ClockSweep(APU_PULSE_CHANNEL *pChannel, bool channel1);
 
+    CPU_6502 *pCPU;
     Bus *cpuBus;
+    Scheduler *pScheduler;  // set by the Scheduler, without one DMC fetches happen on catch-up
+    uint64_t dmcEventTime;  // bus clock of the DMC's next event, or NO_DMC_EVENT if none is scheduled
     APU_STATUS status;
     APU_PULSE_CHANNEL pulse1;
     APU_PULSE_CHANNEL pulse2;
+    APU_TRIANGLE_CHANNEL triangle;
+    APU_NOISE_CHANNEL noise;
+    APU_DMC_CHANNEL dmc;
     int frameCounterStep; // 0 - 3
-    int apuCyclesBeforeNextFrameCounterStep;
+    int cyclesBeforeNextFrameCounterStep;
     bool mutePulse1;
     bool mutePulse2;
+
+    // The NES mixes the channels nonlinearly, pulses in one group and the rest in another, in fixed point from 0 to
+    // MIXER_FULL_SCALE
+    uint16_t pulseMixTable[PULSE_MIX_ENTRIES];
+    uint16_t tndMixTable[TND_MIX_ENTRIES];
+
+    BlipBuffer blipBuffer;
+    int outputAmplitude;        // the mixed output the last delta took the buffer to
+    uint64_t frameStartClock;   // CPU clock the audio frame started on
+    int currentTime;            // CPU cycles the audio frame has been run for
+
+    int16_t outputSamples[APU_MAX_SAMPLES];   // a frame's samples on their way to the audio output
 };
 
@@ -1,6 +1,41 @@
 #include <stdio.h>
 #include "Audio.h"
 
+static AUDIO_SAMPLE_TYPE ringBuffer[AUDIO_RING_SIZE];
+static SDL_atomic_t ringWritten;    // samples ever written, only changed by SendAudioData()
+static SDL_atomic_t ringRead;       // samples ever played, only changed by the callback
+static SDL_atomic_t underruns;
+
+static SDL_bool audioOpen = SDL_FALSE;
+static SDL_bool playing = SDL_FALSE;
+
+// Runs on SDL's audio thread
+static void SDLCALL AudioCallback(void *pUserData, Uint8 *pStream, int length)
+{
+    AUDIO_SAMPLE_TYPE *pOut = (AUDIO_SAMPLE_TYPE *)pStream;
+    int wanted = length / BYTES_PER_SAMPLE;
+
+    unsigned int readIndex = (unsigned int)SDL_AtomicGet(&ringRead);
+    unsigned int available = (unsigned int)SDL_AtomicGet(&ringWritten) - readIndex;
+    int count = available < (unsigned int)wanted ? (int)available : wanted;
+
+    for (int i = 0; i < count; ++i)
+        pOut[i] = ringBuffer[(readIndex + i) & (AUDIO_RING_SIZE - 1)];
+
+    // Ran dry, hold the last sample so it doesn't click
+    if (count < wanted)
+    {
+        AUDIO_SAMPLE_TYPE last = ringBuffer[(readIndex + count - 1) & (AUDIO_RING_SIZE - 1)];
+        for (int i = count; i < wanted; ++i)
+            pOut[i] = last;
+
+        SDL_AtomicAdd(&underruns, 1);
+    }
+
+    // Hands the space back to the writer
+    SDL_AtomicSet(&ringRead, (int)(readIndex + count));
+}
+
 void InitAudio()
 {
     SDL_AudioSpec AudioSettings = { 0 };
@@ -9,9 +44,13 @@ void InitAudio()
     AudioSettings.format = AUDIO_FORMAT;
     AudioSettings.channels = CHANNELS;
     AudioSettings.samples = AUDIO_BUFFER_SIZE / BYTES_PER_SAMPLE;
-    //AudioSettings.callback = &SDLAudioCallback;
+    AudioSettings.callback = &AudioCallback;
 
-    SDL_OpenAudio(&AudioSettings, 0);
+    if (SDL_OpenAudio(&AudioSettings, 0) < 0)
+    {
+        printf("Couldn't open audio: %s\n", SDL_GetError());
+        return;
+    }
 
     if (AudioSettings.format != AUDIO_FORMAT)
     {
@@ -20,24 +59,76 @@ void InitAudio()
         return;
     }
 
-    // Un-pause SDL audio (i.e. play sounds)
-    SDL_PauseAudio(0);
+    // Playing starts once SendAudioData() has buffered enough
+    audioOpen = SDL_TRUE;
 }
 
-float volume = 0.05;
-void SendAudioData(double *pInBuffer, int sampleCount)
+int volume = 77;     // out of 1 << AUDIO_VOLUME_BITS, about 0.3
+void SendAudioData(int16_t *pInBuffer, int sampleCount)
 {
-    //printf("%d %d\n", (int)pInBuffer[0], (int)pInBuffer[1]);
-    uint32_t bufferSize = BYTES_PER_SAMPLE * sampleCount;
-    
-    AUDIO_SAMPLE_TYPE *pOutBuffer = malloc(bufferSize);
+    // Without a device nothing would ever take them out of the ring
+    if (!audioOpen)
+        return;
+
+    unsigned int writeIndex = (unsigned int)SDL_AtomicGet(&ringWritten);
+    unsigned int space = AUDIO_RING_SIZE - (writeIndex - (unsigned int)SDL_AtomicGet(&ringRead));
+
+    // Nothing's playing them fast enough, drop what doesn't fit
+    if ((unsigned int)sampleCount > space)
+        sampleCount = (int)space;
 
-    // Convert the sample values to the proper output format
+    // Scale to the output volume, which is below 1 so it can't clip
     for (int i = 0; i < sampleCount; ++i)
-        pOutBuffer[i] = DoubleToSigned16(pInBuffer[i] * volume);
+        ringBuffer[(writeIndex + i) & (AUDIO_RING_SIZE - 1)] = (AUDIO_SAMPLE_TYPE)((pInBuffer[i] * volume) >> AUDIO_VOLUME_BITS);
+
+    // Publishes the samples to the callback
+    SDL_AtomicSet(&ringWritten, (int)(writeIndex + sampleCount));
+
+    // Un-pause SDL audio (i.e. play sounds) once a late frame or two won't run it dry
+    if (!playing && GetAudioFillLevel() >= AUDIO_TARGET_FILL)
+    {
+        playing = SDL_TRUE;
+        SDL_PauseAudio(0);
+    }
+}
+
+// Holds playback while nothing is being emulated, so the callback doesn't run dry and count underruns the whole time.
+// It starts again once SendAudioData() has buffered enough.
+void PauseAudio()
+{
+    if (playing)
+    {
+        playing = SDL_FALSE;
+        SDL_PauseAudio(1);
+    }
+}
+
+int IsAudioPlaying()
+{
+    return playing;
+}
+
+int GetAudioFillLevel()
+{
+    return (int)((unsigned int)SDL_AtomicGet(&ringWritten) - (unsigned int)SDL_AtomicGet(&ringRead));
+}
+
+int GetAudioUnderruns()
+{
+    return SDL_AtomicGet(&underruns);
+}
 
-    // send samples to the audio hardware
-    SDL_QueueAudio(1, pOutBuffer, bufferSize);
+int GetAudioRateAdjustment()
+{
+    // Without anything playing the samples there's no fill level to hold, and the rate stays exact
+    if (!playing)
+        return 0;
 
-    free(pOutBuffer);
-}
\ No newline at end of file
+    int error = AUDIO_TARGET_FILL - GetAudioFillLevel();
+    if (error > AUDIO_TARGET_FILL)
+        error = AUDIO_TARGET_FILL;
+    else if (error < -AUDIO_TARGET_FILL)
+        error = -AUDIO_TARGET_FILL;
+
+    return error * AUDIO_MAX_RATE_ADJUST / AUDIO_TARGET_FILL;
+}
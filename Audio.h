@@ -15,27 +15,32 @@ extern "C" {
 const SDL_AudioFormat AUDIO_FORMAT = AUDIO_S16;
 const int BYTES_PER_SAMPLE = sizeof(AUDIO_SAMPLE_TYPE) * CHANNELS;
 
-const double SECONDS_PER_SAMPLE = 1.0 / SAMPLES_PER_SECOND;
-//const double SECONDS_PER_LINE = 0.0f;   // TODOTODOTODO
-//double elapsedTime = 0.0;
+#define AUDIO_VOLUME_BITS       8   /* the volume is a fraction out of 1 << AUDIO_VOLUME_BITS */
+
+/*
+Samples go from the emulator to SDL's audio callback through a ring buffer with one writer and one reader, so
+neither side ever waits on the other or allocates. The fill level is held around AUDIO_TARGET_FILL by bending the
+emulator's sample rate slightly (see GetAudioRateAdjustment()), which keeps the latency steady without the audio
+drifting away from the video.
+*/
+#define AUDIO_RING_SIZE         8192                        /* samples, must be a power of 2 */
+#define AUDIO_TARGET_FILL       (SAMPLES_PER_SECOND / 20)   /* 50 ms */
+#define AUDIO_MAX_RATE_ADJUST   (SAMPLES_PER_SECOND / 200)  /* 0.5%, too little to hear as a change in pitch */
 
+void InitAudio();
 
-// outputs at max volume
-inline int16_t DoubleToSigned16(double amplitude)
-{
-    // Clip audio between -1 and 1
-    if (amplitude <= -1.0)
-        return INT16_MIN;
-
-    if (amplitude >= 1.0)
-        return INT16_MAX;
+void SendAudioData(int16_t *pInBuffer, int sampleCount);
+void PauseAudio();
 
-    return (int16_t)(amplitude * INT16_MAX);
-}
+// False until the device has opened and enough samples are buffered, and again while paused
+int IsAudioPlaying();
 
-void InitAudio();
+// Samples waiting to be played, and how many times the callback has run out of them
+int GetAudioFillLevel();
+int GetAudioUnderruns();
 
-void SendAudioData(double *pInBuffer, int sampleCount);
+// How many samples a second more (or fewer) than SAMPLES_PER_SECOND to generate to get back to the target fill level
+int GetAudioRateAdjustment();
 
 
 #ifdef __cplusplus
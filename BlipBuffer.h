@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+
+#define BLIP_PHASE_BITS     5   /* steps are placed to 1/32 of a sample */
+#define BLIP_PHASES         (1 << BLIP_PHASE_BITS)
+#define BLIP_KERNEL_WIDTH   16  /* samples each step is spread over */
+#define BLIP_KERNEL_BITS    12  /* each phase of the kernel adds up to 1 << BLIP_KERNEL_BITS */
+#define BLIP_TIME_BITS      20  /* fraction bits of a time in samples */
+#define BLIP_BASS_SHIFT     9   /* how fast the DC offset is taken out, higher is lower */
+
+/*
+Band-limited synthesis. Instead of generating a waveform a clock at a time and picking samples out of it (which
+aliases), the channels only report how much their output changes and on which clock. Each change is added to the
+buffer as a band-limited step, spread over BLIP_KERNEL_WIDTH samples with the sub-sample phase it happened at, and
+reading the samples adds the steps back up. The cost goes with the number of changes rather than the clock rate.
+
+Times are clocks since the start of the current frame. EndFrame() makes the frame's samples available and starts the
+next frame, and the fraction of a sample left over carries into it.
+*/
+class BlipBuffer
+{
+public:
+    BlipBuffer(int maxSamples);
+    ~BlipBuffer();
+
+    void SetRates(uint32_t clockRate, uint32_t sampleRate);
+
+    // Most clocks a frame can be before its samples won't fit
+    int MaxFrameClocks();
+
+    void AddDelta(uint32_t time, int delta);
+    void EndFrame(uint32_t clocks);
+
+    int SamplesAvailable() { return samplesAvailable; }
+    int ReadSamples(int16_t *pOut, int maxCount);
+
+protected:
+    uint64_t factor;        // samples per clock, with BLIP_TIME_BITS of fraction
+    uint64_t offset;        // where the frame starts, in samples after the available ones with BLIP_TIME_BITS of fraction
+    int integrator;
+
+    int32_t *pBuffer;
+    int bufferSize;
+    int samplesAvailable;
+};
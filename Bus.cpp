@@ -1,4 +1,5 @@
 #include <cstdlib>
+#include <string.h>
 #include "stdafx.h"
 #include "Bus.h"
 #include "peripheral.h"
@@ -10,7 +11,12 @@ Bus::Bus()
 {
     numPeripherals = 0;
     isCPU_Bus = true;
-    patchRead = false;
+    readPatched = false;
+    pDecodeCache = NULL;
+    pCodePageVersions = NULL;
+
+    // Nothing is mapped yet, so every page goes through the slow path (which reports the unmapped access)
+    memset(pages, 0, sizeof(pages));
 }
 
 
@@ -18,7 +24,8 @@ Bus::~Bus()
 {
 }
 
-uint8_t Bus::read(uint16_t addr)
+// Handles reads that can't be resolved by the page table
+uint8_t Bus::readSlow(uint16_t addr)
 {
 #ifdef SYSTEM_SIMPLE
     // 0xfe is a random byte
@@ -27,7 +34,7 @@ uint8_t Bus::read(uint16_t addr)
 #endif
 
     // See if we're overriding an address
-    if (patchRead && addr == patchedAddress)
+    if (readPatched && addr == patchedAddress)
         return patchedData;
 
     for (int i = 0; i < numPeripherals; ++i)
@@ -43,11 +50,67 @@ uint8_t Bus::read(uint16_t addr)
 
 void Bus::write(uint16_t addr, uint8_t data)
 {
+    if (debugOutput)
+        write<true>(addr, data);
+    else
+        write<false>(addr, data);
+}
+
+template<bool trace>
+void Bus::write(uint16_t addr, uint8_t data)
+{
+    const BUS_PAGE &page = pages[addr >> 8];
+
+    // Any instruction this byte belongs to has to be decoded again (handles self-modifying code and code in RAM).
+    // Writes to ROM are mapper registers, which only change code by switching banks, and that goes through mapPages().
+    if (pDecodeCache && (page.pWrite || !page.pRead))
+    {
+        uint16_t codeAddr = addr;
+#ifdef SYSTEM_NES
+        // Code is only cached from the first copy of the work RAM, see IsCacheable() in CPU_6502_Interpreter.cpp
+        if (codeAddr < 0x2000)
+            codeAddr &= 0x7FF;
+#endif
+        // Most writes are to data, like the zero page and the stack, that code has never been cached from
+        if (pages[codeAddr >> 8].hasCode)
+        {
+            pDecodeCache[codeAddr].length = 0;
+            pDecodeCache[(uint16_t)(codeAddr - 1)].length = 0;
+            pDecodeCache[(uint16_t)(codeAddr - 2)].length = 0;
+
+            // Translated blocks from this page are stale now
+            ++pCodePageVersions[codeAddr >> 8];
+        }
+    }
+
+    if (page.pWrite)
+    {
+        page.pWrite[addr & 0xFF] = data;
+
+        if (trace)
+            printf("mem[0x%X] = 0x%X\n", addr, data);
+
+        return;
+    }
+
+    if (page.pPeripheral)
+    {
+        if (trace)
+            page.pPeripheral->writeTraced(addr, data);
+        else
+            page.pPeripheral->write(addr, data);
+
+        return;
+    }
+
     for (int i = 0; i < numPeripherals; ++i)
     {
         if (addr >= peripherals[i].startAddr && addr <= peripherals[i].endAddr)
         {
-            peripherals[i].pPeripheral->write(addr, data);
+            if (trace)
+                peripherals[i].pPeripheral->writeTraced(addr, data);
+            else
+                peripherals[i].pPeripheral->write(addr, data);
 
             return;
         }
@@ -56,6 +119,9 @@ void Bus::write(uint16_t addr, uint8_t data)
     printf("Error: %s write attempt to unmapped memory 0x%X\n", (isCPU_Bus ? "CPU" : "PPU"), addr);
 }
 
+template void Bus::write<true>(uint16_t addr, uint8_t data);
+template void Bus::write<false>(uint16_t addr, uint8_t data);
+
 void Bus::attachPeripheral(uint16_t startAddr, uint16_t endAddr, Peripheral * pPer)
 {
     if (numPeripherals == MAX_PERIPHERALS)
@@ -66,5 +132,120 @@ void Bus::attachPeripheral(uint16_t startAddr, uint16_t endAddr, Peripheral * pP
 
     peripherals[numPeripherals].startAddr = startAddr;
     peripherals[numPeripherals].endAddr = endAddr;
+    peripherals[numPeripherals].pMemory = NULL;
+    peripherals[numPeripherals].memoryMask = 0;
     peripherals[numPeripherals++].pPeripheral = pPer;
+
+    UpdatePages(startAddr, endAddr);
+}
+
+void Bus::mapMemory(Peripheral *pPer, uint8_t *pMemory, uint16_t memoryMask)
+{
+    for (int i = 0; i < numPeripherals; ++i)
+    {
+        if (peripherals[i].pPeripheral != pPer)
+            continue;
+
+        peripherals[i].pMemory = pMemory;
+        peripherals[i].memoryMask = memoryMask;
+        UpdatePages(peripherals[i].startAddr, peripherals[i].endAddr);
+    }
+}
+
+void Bus::patchRead(uint16_t address, uint8_t data)
+{
+    readPatched = true;
+    patchedAddress = address;
+    patchedData = data;
+
+    UpdatePages(address, address);
+}
+
+void Bus::mapPages(uint16_t startAddr, uint16_t endAddr, const uint8_t *pRead, uint8_t *pWrite)
+{
+    for (int pageNumber = startAddr >> 8; pageNumber <= endAddr >> 8; ++pageNumber)
+    {
+        int offset = (pageNumber - (startAddr >> 8)) << 8;
+
+        pages[pageNumber].pRead = pRead ? pRead + offset : NULL;
+        pages[pageNumber].pWrite = pWrite ? pWrite + offset : NULL;
+    }
+
+    // Patched reads still have to go through readSlow()
+    if (readPatched && patchedAddress >= startAddr && patchedAddress <= endAddr)
+        pages[patchedAddress >> 8].pRead = NULL;
+
+    invalidateCode(startAddr, endAddr);
+}
+
+void Bus::invalidateCode(uint16_t startAddr, uint16_t endAddr)
+{
+    if (!pDecodeCache)
+        return;
+
+    // Instructions decoded from these pages are checked against the page versions, so bank switches don't have to
+    // touch every one of them. Only the ones that start up to two bytes before startAddr and run into it are cleared.
+    pDecodeCache[(uint16_t)(startAddr - 1)].length = 0;
+    pDecodeCache[(uint16_t)(startAddr - 2)].length = 0;
+
+    for (int pageNumber = startAddr >> 8; pageNumber <= endAddr >> 8; ++pageNumber)
+        ++pCodePageVersions[pageNumber];
+}
+
+// Works out how every page from startAddr to endAddr should be accessed.
+// Peripherals attached first take priority, just like the search in readSlow().
+void Bus::UpdatePages(uint16_t startAddr, uint16_t endAddr)
+{
+    for (int pageNumber = startAddr >> 8; pageNumber <= endAddr >> 8; ++pageNumber)
+    {
+        BUS_PAGE *pPage = &pages[pageNumber];
+        pPage->pRead = NULL;
+        pPage->pWrite = NULL;
+        pPage->pPeripheral = NULL;
+
+        uint16_t pageStart = (uint16_t)(pageNumber << 8);
+        uint16_t pageEnd = pageStart | 0xFF;
+
+        // Find the first peripheral that handles any part of the page
+        MEM_MAP_ENTRY *pFirst = NULL;
+        bool split = false;
+        for (int i = 0; i < numPeripherals; ++i)
+        {
+            MEM_MAP_ENTRY *pEntry = &peripherals[i];
+            if (pEntry->endAddr < pageStart || pEntry->startAddr > pageEnd)
+                continue;
+
+            // A peripheral that only covers part of the page means more than one peripheral (or nothing) handles it
+            if (pEntry->startAddr > pageStart || pEntry->endAddr < pageEnd)
+            {
+                split = true;
+                break;
+            }
+
+            pFirst = pEntry;
+            break;
+        }
+
+        if (split || !pFirst)
+            continue;
+
+        // Memory that's mirrored more often than every 256 bytes can't be accessed a page at a time
+        if (!pFirst->pMemory || (pFirst->memoryMask & 0xFF) != 0xFF)
+        {
+            pPage->pPeripheral = pFirst->pPeripheral;
+            continue;
+        }
+
+        uint8_t *pMemory = &pFirst->pMemory[pageStart & pFirst->memoryMask];
+        pPage->pWrite = pMemory;
+
+        // Reads of patched addresses and random bytes have to go through readSlow()
+        if (readPatched && (patchedAddress >> 8) == pageNumber)
+            continue;
+#ifdef SYSTEM_SIMPLE
+        if (pageNumber == 0)
+            continue;
+#endif
+        pPage->pRead = pMemory;
+    }
 }
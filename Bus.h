@@ -1,17 +1,41 @@
 #pragma once
 #include <cstdint>
-
-class Peripheral;
+#include "peripheral.h"
 
 typedef struct MEM_MAP_ENTRY
 {
     uint16_t startAddr;
     uint16_t endAddr;
     Peripheral *pPeripheral;
+    uint8_t *pMemory;       // host memory behind the peripheral, if it's plain memory (see Bus::mapMemory())
+    uint16_t memoryMask;    // address bits used to index pMemory
 }MEM_MAP_ENTRY;
 
 #define MAX_PERIPHERALS 8
 
+#define BUS_PAGES       256
+
+// Resolves one 256-byte page of the address space.
+// Plain memory is read and written straight through pRead and pWrite, a page that belongs to a single I/O peripheral
+// goes to pPeripheral, and anything else (pages shared by several peripherals, patched reads) goes through the
+// slow path that searches peripherals[].
+typedef struct BUS_PAGE
+{
+    const uint8_t *pRead;       // host memory for the page, or NULL if reads can't go straight to memory
+    uint8_t *pWrite;            // host memory for the page, or NULL if writes can't go straight to memory
+    Peripheral *pPeripheral;    // the only peripheral on the page, or NULL
+    bool hasCode;               // the CPU has cached instructions from the page, so writes have to invalidate them
+}BUS_PAGE;
+
+// An instruction decoded by the CPU's interpreter core, cached by address (see CPU_6502_Interpreter.cpp)
+typedef struct DECODED_INSTRUCTION
+{
+    uint16_t operand;
+    uint8_t opcode;
+    uint8_t length;         // size of the instruction in bytes, 0 if the address hasn't been decoded yet
+    uint32_t pageVersion;   // CPU_6502::codePageVersions of the page it was decoded from, stale if that's changed
+}DECODED_INSTRUCTION;
+
 class CPU_6502;
 class Bus
 {
@@ -19,20 +43,62 @@ public:
     Bus();
     ~Bus();
 
-    uint8_t read(uint16_t addr);
+    uint8_t read(uint16_t addr)
+    {
+        const BUS_PAGE &page = pages[addr >> 8];
+        if (page.pRead)
+            return page.pRead[addr & 0xFF];
+        if (page.pPeripheral)
+            return page.pPeripheral->read(addr);
+        return readSlow(addr);
+    }
+
+    void write(uint16_t addr, uint8_t data);
+
+    // Writes with trace output compiled in or out. Code that's templated on tracing calls these directly,
+    // write() has to check debugOutput to pick one.
+    template<bool trace>
     void write(uint16_t addr, uint8_t data);
     void attachPeripheral(uint16_t startAddr, uint16_t endAddr, Peripheral *pPer);
 
+    // Lets reads and writes of a peripheral that's plain memory go straight to pMemory[addr & memoryMask]
+    void mapMemory(Peripheral *pPer, uint8_t *pMemory, uint16_t memoryMask);
+
+    // Host memory a whole page can be read from at once, or NULL if the page has to be read a byte at a time
+    const uint8_t *readablePage(uint8_t pageNumber) { return pages[pageNumber].pRead; }
+
+    // Makes every read of address return data (for cheats)
+    void patchRead(uint16_t address, uint8_t data);
+
+    // Points the pages from startAddr to endAddr straight at host memory (used for bank switching).
+    // NULL sends reads or writes to the peripheral that owns the pages. Lasts until the pages are attached again.
+    void mapPages(uint16_t startAddr, uint16_t endAddr, const uint8_t *pRead, uint8_t *pWrite);
+
+    // Throws out anything the CPU decoded from startAddr to endAddr
+    void invalidateCode(uint16_t startAddr, uint16_t endAddr);
+
+    // Called by the CPU when it caches an instruction that has a byte on the page of addr
+    void markCode(uint16_t addr) { pages[addr >> 8].hasCode = true; }
+
     //CPU_6502 *pCPU;
     bool isCPU_Bus;
 
     // patched data read
-    bool patchRead;
+    bool readPatched;
     uint16_t patchedAddress;
     uint8_t patchedData;
 
+    // instructions decoded by the CPU, which must be invalidated when the code is written to
+    DECODED_INSTRUCTION *pDecodeCache;
+    uint32_t *pCodePageVersions;
+
 protected:
+    uint8_t readSlow(uint16_t addr);
+    void UpdatePages(uint16_t startAddr, uint16_t endAddr);
+
     int numPeripherals;
     MEM_MAP_ENTRY peripherals[MAX_PERIPHERALS];
+
+    BUS_PAGE pages[BUS_PAGES];
 };
 
@@ -1,5 +1,6 @@
 #include "CPU_6502.h"
 #include <stdio.h>
+#include <string.h>
 
 CPU_6502::CPU_6502()
 {
@@ -10,6 +11,29 @@ CPU_6502::CPU_6502()
 
     running = true;
     nmi = false;
+    irqSources = 0;
+    writeCycle = 0;
+    stallCycles = 0;
+
+    clocks = 0;
+    busClocksAvailable = 0;
+    runDeadline = 0;
+    deadlineMoved = false;
+
+    core = CPU_CORE_BLOCKS;
+
+    // Every address can hold a decoded instruction, writes on the bus will invalidate them
+    decodeCache = new DECODED_INSTRUCTION[0x10000];
+    bus.pDecodeCache = decodeCache;
+
+    blockCache = new TRANSLATED_BLOCK[BLOCK_CACHE_SIZE];
+    memset(codePageVersions, 0, sizeof(codePageVersions));
+    bus.pCodePageVersions = codePageVersions;
+
+    InvalidateDecodeCache();
+
+    skipIdleLoops = true;
+    memset(&lastLoop, 0, sizeof(lastLoop));
 
     //bus.pCPU = this;
 }
@@ -17,6 +41,17 @@ CPU_6502::CPU_6502()
 
 CPU_6502::~CPU_6502()
 {
+    bus.pDecodeCache = NULL;
+    bus.pCodePageVersions = NULL;
+    delete[] blockCache;
+    delete[] decodeCache;
+}
+
+// Must be called when memory is changed without going through the bus (loading ROMs, snapshots, etc)
+void CPU_6502::InvalidateDecodeCache()
+{
+    memset(decodeCache, 0, sizeof(DECODED_INSTRUCTION) * 0x10000);
+    memset(blockCache, 0, sizeof(TRANSLATED_BLOCK) * BLOCK_CACHE_SIZE);
 }
 
 void CPU_6502::Reset()
@@ -25,8 +60,12 @@ void CPU_6502::Reset()
     a = x = y = 0;
     SP = 0xFD;
 
-    clocks = 0;
+    // clocks keeps counting, the rest of the system is still scheduled by it
     busClocksAvailable = 0;
+    stallCycles = 0;
+
+    // Memory was probably loaded directly since the last time we ran
+    InvalidateDecodeCache();
 
     /* "All registers are initialized by software except Decimal and Interrupt disable mode
     select bits of the Processor Status Register(P) */
@@ -37,24 +76,34 @@ void CPU_6502::Reset()
     PC += bus.read(0xFFFC);
 }
 
+bool CPU_6502::Step()
+{
+    if (debugOutput)
+        return Step<true>();
+
+    return Step<false>();
+}
+
+// Instantiated with and without trace output, so the untraced version doesn't test debugOutput
+template<bool trace>
 bool CPU_6502::Step()
 {
     // Check for NMI
     if (nmi)
     {
-        if(debugOutput)
+        if (trace)
             printf("Handling NMI\n");
             //printf("PC - 0x%X\n", PC);
 
         // Push return value onto stack, high byte then low byte
-        bus.write(0x100 + SP, PC >> 8);
+        bus.write<trace>(0x100 + SP, PC >> 8);
         --SP;
-        bus.write(0x100 + SP, (uint8_t)(PC & 0xFF));
+        bus.write<trace>(0x100 + SP, (uint8_t)(PC & 0xFF));
         --SP;
 
         // Push processor status onto stack
         // Set bit 5 but leave bit 4 clear (See https://wiki.nesdev.com/w/index.php/Status_flags#The_B_flag)
-        bus.write(0x100 + SP, flags.allFlags & 0x10);
+        bus.write<trace>(0x100 + SP, flags.allFlags & 0x10);
         --SP;
 
         // Load PC from $FFFA-$FFFB
@@ -68,11 +117,35 @@ bool CPU_6502::Step()
         return true;
     }
 
+    // Check for IRQ
+    if (irqSources && !flags.irqDisable)
+    {
+        if (trace)
+            printf("Handling IRQ\n");
+
+        bus.write<trace>(0x100 + SP, PC >> 8);
+        --SP;
+        bus.write<trace>(0x100 + SP, (uint8_t)(PC & 0xFF));
+        --SP;
+
+        // Set bit 5 but leave bit 4 clear
+        bus.write<trace>(0x100 + SP, (flags.allFlags & ~0x10) | 0x20);
+        --SP;
+        flags.irqDisable = true;
+
+        // Load PC from $FFFE-$FFFF
+        PC = bus.read(0xFFFE);
+        PC |= (uint16_t)(bus.read(0xFFFF)) << 8;
+
+        clocks += 7;
+        return true;
+    }
+
     // get the current opcode
     // TODO: Does crossing a page boundary have any effect on timing here?
     opcode = bus.read(PC++);
 
-    if(debugOutput)
+    if (trace)
         printf("opcode: 0x%X - %s ", opcode, mnemonics[opcode]);
     
     // see how many bytes are in the operand
@@ -92,18 +165,21 @@ bool CPU_6502::Step()
         else if (operandBytes != 1)
             printf("Invalid operand size for opcode 0x%X!\n", opcode);
         
-        if (debugOutput)
+        if (trace)
             printf(" 0x%X\n", operand);
     }
     else
     {
-        if (debugOutput)
+        if (trace)
             printf("\n");
     }
 
     
-    // Call the function associated with this opcode
-    ((*this).*(opcodes[opcode]))(); 
+    // Call the function associated with this opcode, handlers that write memory have a traced version
+    if (trace)
+        ((*this).*(tracedOpcodes[opcode]))();
+    else
+        ((*this).*(opcodes[opcode]))();
     // (The horror! It may be better to ditch OOP and go with globals for everything CPU related in the future)
 
     // return false if this is an unhandled opcode
@@ -119,27 +195,74 @@ void CPU_6502::TriggerNMI()
 }
 
 bool CPU_6502::Run(int busClocks)
+{
+    if (core != CPU_CORE_LEGACY)
+        return RunInterpreter(busClocks);
+
+    // Trace output is picked once per batch, not once per instruction
+    if (debugOutput)
+        return RunLegacy<true>(busClocks);
+
+    return RunLegacy<false>(busClocks);
+}
+
+bool CPU_6502::RunUntil(uint64_t deadline)
+{
+    uint64_t now = BusClock();
+    if (deadline <= now)
+        return true;
+
+    // Overshoot from the last run is already counted in clocks
+    busClocksAvailable = 0;
+    runDeadline = deadline;
+    deadlineMoved = false;
+    return Run((int)(deadline - now));
+}
+
+template<bool trace>
+bool CPU_6502::RunLegacy(int busClocks)
 {
     busClocksAvailable += busClocks;
 
-    unsigned int prevCPU_Clocks = clocks;
-    unsigned int ranClocks;
+    uint64_t prevCPU_Clocks = clocks;
+    int ranClocks;
     bool retVal = true;
 
     while (running && busClocksAvailable > 0)
     {
-        // Execute the next cpu instruction
-        retVal &= Step();
+        // Execute the next cpu instruction, unless the CPU is halted
+        if (stallCycles)
+            RunStall(busClocksAvailable);
+        else
+            retVal &= Step<trace>();
 
         // Update clock counts
-        ranClocks = clocks - prevCPU_Clocks;
+        ranClocks = (int)(clocks - prevCPU_Clocks);
         prevCPU_Clocks = clocks;
         busClocksAvailable -= 3 * ranClocks;
+
+        // Something scheduled an event before the deadline
+        if (deadlineMoved)
+        {
+            deadlineMoved = false;
+            busClocksAvailable = (int)((int64_t)runDeadline - (int64_t)BusClock());
+        }
     }
 
     return retVal;
 }
 
+// Counts off as much of a halt as fits in busClocks
+void CPU_6502::RunStall(int busClocks)
+{
+    int cycles = (busClocks + 2) / 3;
+    if (cycles > stallCycles)
+        cycles = stallCycles;
+
+    stallCycles -= cycles;
+    clocks += cycles;
+}
+
 // operations
 void CPU_6502::UnhandledOpcode()
 {
@@ -256,6 +379,7 @@ void CPU_6502::ORA_zp()
 }
 
 // 06: ASL zp - shift memory value in zp to the left one bit  - 5, 2
+template<bool trace>
 void CPU_6502::ASL_zp()
 {
     uint8_t value = bus.read(operand);
@@ -267,12 +391,13 @@ void CPU_6502::ASL_zp()
     flags.negative = IS_NEGATIVE(value);
     flags.zero = value == 0;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     clocks += 5;
 }
 
 // 08: PHP i - Push processor status flags onto stack - 3, 1
+template<bool trace>
 void CPU_6502::PHP()
 {
     uint8_t flagValues = flags.allFlags;
@@ -280,7 +405,7 @@ void CPU_6502::PHP()
     // Set bits 4 and 5 (See https://wiki.nesdev.com/w/index.php/Status_flags#The_B_flag)
     flagValues |= 0x30;
 
-    bus.write(0x100 + SP, flagValues);
+    bus.write<trace>(0x100 + SP, flagValues);
     --SP;
 
     clocks += 3;
@@ -316,8 +441,11 @@ void CPU_6502::ORA_a()
 }
 
 // 0E: ASL a - shift absolute memory value to the left one bit  - 6, 3
+template<bool trace>
 void CPU_6502::ASL_a()
 {
+    writeCycle = 5;
+
     uint8_t value = bus.read(operand);
 
     flags.carry = IS_NEGATIVE(value);
@@ -327,7 +455,7 @@ void CPU_6502::ASL_a()
     flags.negative = IS_NEGATIVE(value);
     flags.zero = IS_NEGATIVE(value);
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     clocks += 6;
 }
@@ -375,6 +503,7 @@ void CPU_6502::ORA_zp_x()
 }
 
 // 16: ASL zp,x - shift memory value in zp offset by x to the left one bit  - 6, 2
+template<bool trace>
 void CPU_6502::ASL_zp_x()
 {
     // handle zero-page wraparound
@@ -389,7 +518,7 @@ void CPU_6502::ASL_zp_x()
     flags.negative = IS_NEGATIVE(value);
     flags.zero = IS_NEGATIVE(value);
 
-    bus.write(address, value);
+    bus.write<trace>(address, value);
 
     clocks += 6;
 }
@@ -427,8 +556,11 @@ void CPU_6502::ORA_a_x()
 }
 
 // 1E: ASL a,x - shift absolute memory offset by x value to the left one bit  - 7, 3
+template<bool trace>
 void CPU_6502::ASL_a_x()
 {
+    writeCycle = 6;
+
     uint8_t value = bus.read(operand + x);
 
     flags.carry = IS_NEGATIVE(value);
@@ -438,21 +570,22 @@ void CPU_6502::ASL_a_x()
     flags.negative = IS_NEGATIVE(value);
     flags.zero = IS_NEGATIVE(value);
 
-    bus.write(operand + x, value);
+    bus.write<trace>(operand + x, value);
 
     clocks += 7;
 }
 
 // 20: JSR a - pushes PC - 1 then jumps to absolute address - 6, 3
+template<bool trace>
 void CPU_6502::JSR()
 {
     --PC;
     // push high byte of PC - 1
-    bus.write(0x100 + SP, (PC >> 8));
+    bus.write<trace>(0x100 + SP, (PC >> 8));
     SP--;
 
     // push low byte of PC - 1
-    bus.write(0x100 + SP, (PC & 0xFF));
+    bus.write<trace>(0x100 + SP, (PC & 0xFF));
     SP--;
 
     PC = operand;
@@ -503,6 +636,7 @@ void CPU_6502::AND_zp()
 }
 
 // 26: ROL zp - rotate value in zero page memory one bit to the left - 5, 2
+template<bool trace>
 void CPU_6502::ROL_zp()
 {
     uint8_t oldValue = bus.read(operand);
@@ -515,7 +649,7 @@ void CPU_6502::ROL_zp()
     flags.negative = IS_NEGATIVE(newValue);
     flags.zero = (newValue == 0);
 
-    bus.write(operand, newValue);
+    bus.write<trace>(operand, newValue);
 
     clocks += 5;
 }
@@ -590,8 +724,11 @@ void CPU_6502::AND_a()
 }
 
 // 2E: ROL a - rotate value in memory one bit to the left - 6, 3
+template<bool trace>
 void CPU_6502::ROL_a()
 {
+    writeCycle = 5;
+
     uint8_t value = bus.read(operand);
     uint8_t newValue = value << 1;
 
@@ -605,7 +742,7 @@ void CPU_6502::ROL_a()
     flags.negative = IS_NEGATIVE(value);
     flags.zero = (value == 0);
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     clocks += 6;
 }
@@ -664,6 +801,7 @@ void CPU_6502::AND_zp_x()
 }
 
 // 36: ROL zp,x - rotate value in zero page memory offset by x one bit to the left - 6, 2
+template<bool trace>
 void CPU_6502::ROL_zp_x()
 {
     // handle zero page wrap-around
@@ -679,7 +817,7 @@ void CPU_6502::ROL_zp_x()
     flags.negative = IS_NEGATIVE(newValue);
     flags.zero = (newValue == 0);
 
-    bus.write(address, newValue);
+    bus.write<trace>(address, newValue);
 
     clocks += 6;
 }
@@ -720,8 +858,11 @@ void CPU_6502::AND_a_x()
 }
 
 // 3E: ROL a,x - rotate value in absolute memory offset by x one bit to the left - 7, 3
+template<bool trace>
 void CPU_6502::ROL_a_x()
 {
+    writeCycle = 6;
+
     uint16_t address = operand + x;
 
     uint8_t value = bus.read(address);
@@ -737,7 +878,7 @@ void CPU_6502::ROL_a_x()
     flags.negative = IS_NEGATIVE(value);
     flags.zero = (value == 0);
 
-    bus.write(address, value);
+    bus.write<trace>(address, value);
 
     clocks += 7;
 }
@@ -786,6 +927,7 @@ void CPU_6502::EOR_zp()
 }
 
 // 46: LSR zp - read a byte from zp, shift it one bit to the right and put it back - 5, 2
+template<bool trace>
 void CPU_6502::LSR_zp()
 {
     uint8_t value = bus.read(operand);
@@ -794,7 +936,7 @@ void CPU_6502::LSR_zp()
 
     value >>= 1;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     flags.zero = value == 0;
     flags.negative = IS_NEGATIVE(value);
@@ -803,9 +945,10 @@ void CPU_6502::LSR_zp()
 }
 
 // 48: PHA s - push a to stack - 3, 1
+template<bool trace>
 void CPU_6502::PHA()
 {
-    bus.write(0x100 + SP, a);
+    bus.write<trace>(0x100 + SP, a);
     --SP;
 
     clocks += 3;
@@ -847,15 +990,18 @@ void CPU_6502::EOR_a()
 }
 
 // 4E: LSR a - read a byte from abs memory, shift it one bit to the right and put it back - 6, 3
+template<bool trace>
 void CPU_6502::LSR_a()
 {
+    writeCycle = 5;
+
     uint8_t value = bus.read(operand);
 
     flags.carry = ((value & 1) == 1);
 
     value >>= 1;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     clocks += 6;
 }
@@ -906,6 +1052,7 @@ void CPU_6502::EOR_zp_x()
 }
 
 // 56: LSR zp,x - read a byte from zp offset by x, shift it one bit to the right and put it back - 6, 2
+template<bool trace>
 void CPU_6502::LSR_zp_x()
 {
     // handle zero-page wraparound
@@ -917,7 +1064,7 @@ void CPU_6502::LSR_zp_x()
 
     value >>= 1;
 
-    bus.write(address, value);
+    bus.write<trace>(address, value);
 
     clocks += 6;
 }
@@ -950,15 +1097,18 @@ void CPU_6502::EOR_a_x()
 }
 
 // 5E: LSR a,x - read a byte from memory offset by x, shift it one bit to the right and put it back - 7, 3
+template<bool trace>
 void CPU_6502::LSR_a_x()
 {
+    writeCycle = 6;
+
     uint8_t value = bus.read(operand + x);
 
     flags.carry = ((value & 1) == 1);
 
     value >>= 1;
 
-    bus.write(operand + x, value);
+    bus.write<trace>(operand + x, value);
 
     clocks += 7;
 }
@@ -1001,6 +1151,7 @@ void CPU_6502::ADC_zp()
 }
 
 // 66: ROR zp - Move value stored in zp one bit to the right - 5, 2
+template<bool trace>
 void CPU_6502::ROR_zp()
 {
     uint8_t oldValue = bus.read(operand);
@@ -1014,7 +1165,7 @@ void CPU_6502::ROR_zp()
     flags.zero = (newValue == 0);
     flags.negative = IS_NEGATIVE(newValue);
 
-    bus.write(operand, newValue);
+    bus.write<trace>(operand, newValue);
 
     clocks += 5;
 }
@@ -1081,8 +1232,11 @@ void CPU_6502::ADC_a()
 }
 
 // 6E: ROR a - Move value stored in absolute memory one bit to the right - 6, 3
+template<bool trace>
 void CPU_6502::ROR_a()
 {
+    writeCycle = 5;
+
     uint8_t value = bus.read(operand);
 
     uint8_t oldValue = value;
@@ -1096,7 +1250,7 @@ void CPU_6502::ROR_a()
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     clocks += 6;
 }
@@ -1148,6 +1302,7 @@ void CPU_6502::ADC_zp_x()
 }
 
 // 76: ROR zp,x - Move value stored in zero page of memory offset by x one bit to the right - 6, 2
+template<bool trace>
 void CPU_6502::ROR_zp_x()
 {
     // Handle zero-page wrap-around
@@ -1166,7 +1321,7 @@ void CPU_6502::ROR_zp_x()
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
 
-    bus.write(address, value);
+    bus.write<trace>(address, value);
 
     clocks += 6;
 }
@@ -1203,8 +1358,11 @@ void CPU_6502::ADC_a_x()
 }
 
 // 7E: ROR a,x - Move value stored in absolute memory offset by x one bit to the right - 7, 3
+template<bool trace>
 void CPU_6502::ROR_a_x()
 {
+    writeCycle = 6;
+
     uint8_t value = bus.read(operand + x);
 
     uint8_t oldValue = value;
@@ -1218,14 +1376,17 @@ void CPU_6502::ROR_a_x()
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
 
-    bus.write(operand + x, value);
+    bus.write<trace>(operand + x, value);
 
     clocks += 7;
 }
 
 // 81: STA (zp, x) - store a into a zp indexed indirect address - 6, 2
+template<bool trace>
 void CPU_6502::STA_zp_x_ind()
 {
+    writeCycle = 5;
+
     uint16_t addr1 = (operand + x) & 0xFF;
     printf("addr1: 0x%X\n", addr1);
 
@@ -1234,29 +1395,32 @@ void CPU_6502::STA_zp_x_ind()
 
     printf("address: 0x%X\n", address);
 
-    bus.write(address, a);
+    bus.write<trace>(address, a);
 
     clocks += 6;
 }
 
 // 84: STY zp - store y to a value in zp memory - 3, 2
+template<bool trace>
 void CPU_6502::STY_zp()
 {
-    bus.write(operand, y);
+    bus.write<trace>(operand, y);
     clocks += 3;
 }
 
 // 85: STA zp (store accumulator to zp memory, 0 - 0xff)
+template<bool trace>
 void CPU_6502::STA_zp()
 {
-    bus.write(operand, a);
+    bus.write<trace>(operand, a);
     clocks += 3;
 }
 
 // 86: STX zp - store x in a zp memory location - 3, 2
+template<bool trace>
 void CPU_6502::STX_zp()
 {
-    bus.write(operand, x);
+    bus.write<trace>(operand, x);
     clocks += 3;
 }
 
@@ -1283,25 +1447,31 @@ void CPU_6502::TXA()
 }
 
 // 8C: STY a (store y to absolute memory address) - 4, 3
+template<bool trace>
 void CPU_6502::STY_a()
 {
-    bus.write(operand, y);
+    writeCycle = 3;
+    bus.write<trace>(operand, y);
 
     clocks += 4;
 }
 
 // 8D: STA a (store a to absolute memory address) - 4, 3
+template<bool trace>
 void CPU_6502::STA_a()
 {
-    bus.write(operand, a);
+    writeCycle = 3;
+    bus.write<trace>(operand, a);
 
     clocks += 4;
 }
 
 // 8E: STX a (store x to absolute memory address) - 4, 3
+template<bool trace>
 void CPU_6502::STX_a()
 {
-    bus.write(operand, x);
+    writeCycle = 3;
+    bus.write<trace>(operand, x);
 
     clocks += 4;
 }
@@ -1324,43 +1494,49 @@ void CPU_6502::BCC_r()
 }
 
 // 91: STA(zp), y - store a to indirectly indexed memory - 6, 2
+template<bool trace>
 void CPU_6502::STA_zp_ind_y()
 {
+    writeCycle = 5;
+
     uint16_t address = bus.read(operand);
     //address += (uint16_t)(bus.read((operand + 1) & 0xFF)) << 8;
     address += (uint16_t)(bus.read(operand + 1)) << 8;
     address += y;
 
-    bus.write(address, a);
+    bus.write<trace>(address, a);
 
     clocks += 6;
 }
 
 // 94: STY zp,x - store y to a value in zp memory offset by x - 4, 2
+template<bool trace>
 void CPU_6502::STY_zp_x()
 {
     // Handle zero page wrap-around
     uint8_t address = (uint8_t)(operand + x);
 
-    bus.write(address, y);
+    bus.write<trace>(address, y);
 
     clocks += 4;
 }
 
 // 95: STA zp,x (store a to zp memory offset by x) - 4, 2
+template<bool trace>
 void CPU_6502::STA_zp_x()
 {
-    bus.write((operand + x) & 0xFF, a);
+    bus.write<trace>((operand + x) & 0xFF, a);
 
     clocks += 4;
 }
 
 // 96: STX zp,y - store x in a zp address offset by y - 4, 2
+template<bool trace>
 void CPU_6502::STX_zp_y()
 {
     uint8_t address = (operand + y) & 0xFF;
 
-    bus.write(address, x);
+    bus.write<trace>(address, x);
 
     clocks += 4;
 }
@@ -1377,17 +1553,21 @@ void CPU_6502::TYA()
 }
 
 // 99: STA a,y - Store a to absolute address + y offset - 5, 3
+template<bool trace>
 void CPU_6502::STA_a_y()
 {
-    bus.write(operand + y, a);
+    writeCycle = 4;
+    bus.write<trace>(operand + y, a);
 
     clocks += 5;
 }
 
 // 9D: STA a,x - store a to an address offset by x - 5, 3
+template<bool trace>
 void CPU_6502::STA_a_x()
 {
-    bus.write(operand + x, a);
+    writeCycle = 4;
+    bus.write<trace>(operand + x, a);
 
     clocks += 5;
 }
@@ -1746,13 +1926,14 @@ void CPU_6502::CMP_zp()
 }
 
 // C6: DEC zp - decrement a value in zp memory - 5, 2
+template<bool trace>
 void CPU_6502::DEC_zp()
 {
     uint8_t value = bus.read(operand);
 
     --value;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     flags.negative = IS_NEGATIVE(value);
     flags.zero = (value == 0);
@@ -1816,13 +1997,16 @@ void CPU_6502::CMP_a()
 }
 
 // CE: DEC a - decrement a value in memory - 6, 3
+template<bool trace>
 void CPU_6502::DEC_a()
 {
+    writeCycle = 5;
+
     uint8_t value = bus.read(operand);
 
     --value;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     flags.negative = IS_NEGATIVE(value);
     flags.zero = (value == 0);
@@ -1885,6 +2069,7 @@ void CPU_6502::CMP_zp_x()
 }
 
 // D6: DEC zp, x - decrement a value in zp memory offset by x - 6, 2
+template<bool trace>
 void CPU_6502::DEC_zp_x()
 {
     // handle zero-page wraparound
@@ -1894,7 +2079,7 @@ void CPU_6502::DEC_zp_x()
 
     --value;
 
-    bus.write(address, value);
+    bus.write<trace>(address, value);
 
     flags.negative = IS_NEGATIVE(value);
     flags.zero = (value == 0);
@@ -1940,13 +2125,16 @@ void CPU_6502::CMP_a_x()
 }
 
 // DE: DEC a, x - decrement a value in abs memory offset by x - 7, 3
+template<bool trace>
 void CPU_6502::DEC_a_x()
 {
+    writeCycle = 6;
+
     uint8_t value = bus.read(operand + x);
 
     --value;
 
-    bus.write(operand + x, value);
+    bus.write<trace>(operand + x, value);
 
     flags.negative = IS_NEGATIVE(value);
     flags.zero = (value == 0);
@@ -1999,13 +2187,14 @@ void CPU_6502::SBC_zp()
 }
 
 // E6: INC zp - increment a value in zp memory - 5, 2
+template<bool trace>
 void CPU_6502::INC_zp()
 {
     uint8_t value = bus.read(operand);
 
     value++;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
@@ -2056,13 +2245,16 @@ void CPU_6502::SBC_a()
 }
 
 // EE: INC a - increment a value in abs memory - 6, 3
+template<bool trace>
 void CPU_6502::INC_a()
 {
+    writeCycle = 5;
+
     uint8_t value = bus.read(operand);
 
     value++;
 
-    bus.write(operand, value);
+    bus.write<trace>(operand, value);
 
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
@@ -2117,6 +2309,7 @@ void CPU_6502::SBC_zp_x()
 }
 
 // F6: INC zp,x - increment a value in zp memory offset by x - 6, 2
+template<bool trace>
 void CPU_6502::INC_zp_x()
 {
     // handle zero-page wraparound
@@ -2126,7 +2319,7 @@ void CPU_6502::INC_zp_x()
 
     value++;
 
-    bus.write(address, value);
+    bus.write<trace>(address, value);
 
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
@@ -2155,13 +2348,16 @@ void CPU_6502::SBC_a_x()
 }
 
 // FE: INC a,x - increment a value in memory offset by x - 7, 3
+template<bool trace>
 void CPU_6502::INC_a_x()
 {
+    writeCycle = 6;
+
     uint8_t value = bus.read(operand + x);
 
     value++;
 
-    bus.write(operand + x, value);
+    bus.write<trace>(operand + x, value);
 
     flags.zero = (value == 0);
     flags.negative = IS_NEGATIVE(value);
@@ -2181,6 +2377,7 @@ void CPU_6502::SetupOpcodes()
     for (int i = 0; i < 256; ++i)
     {
         opcodes[i] = &CPU_6502::UnhandledOpcode;
+        tracedOpcodes[i] = &CPU_6502::UnhandledOpcode;
         mnemonics[i] = UNHANDLED;
         opcodeBytes[i] = 1;
     }
@@ -2195,10 +2392,10 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x05, &CPU_6502::ORA_zp, MN_ORA_ZP, 2);
 
     // 06: ASL zp - shift memory value in zp to the left one bit  - 5, 2
-    SetupOpCode(0x06, &CPU_6502::ASL_zp, MN_ASL_ZP, 2);
+    SetupOpCode(0x06, &CPU_6502::ASL_zp<false>, &CPU_6502::ASL_zp<true>, MN_ASL_ZP, 2);
     
     // 08: PHP i - Push processor status flags onto stack - 3, 1
-    SetupOpCode(0x08, &CPU_6502::PHP, MN_PHP, 1);
+    SetupOpCode(0x08, &CPU_6502::PHP<false>, &CPU_6502::PHP<true>, MN_PHP, 1);
 
     // 09: ORA # - inclusive OR between a nd immediate value - 2, 2
     SetupOpCode(0x09, &CPU_6502::ORA_imm, MN_ORA_IMM, 2);
@@ -2210,7 +2407,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x0A, &CPU_6502::ASL, MN_ASL, 1);
 
     // 0E: ASL a - shift absolute memory value to the left one bit  - 6, 3
-    SetupOpCode(0x0E, &CPU_6502::ASL_a, MN_ASL_ABS, 3);
+    SetupOpCode(0x0E, &CPU_6502::ASL_a<false>, &CPU_6502::ASL_a<true>, MN_ASL_ABS, 3);
     
     // 10: BPL r - branch relative if negative flag is clear - 2, 2
     SetupOpCode(0x10, &CPU_6502::BPL_r, MN_BPL, 2);
@@ -2222,13 +2419,13 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x15, &CPU_6502::ORA_zp_x, MN_ORA_ZP_X, 2);
 
     // 16: ASL zp,x - shift memory value in zp offset by x to the left one bit  - 6, 2
-    SetupOpCode(0x16, &CPU_6502::ASL_zp_x, MN_ASL_ZP_X, 2);
+    SetupOpCode(0x16, &CPU_6502::ASL_zp_x<false>, &CPU_6502::ASL_zp_x<true>, MN_ASL_ZP_X, 2);
 
     // 18: CLC i - clear carry - 2, 1
     SetupOpCode(0x18, &CPU_6502::CLC, MN_CLC, 1);
 
     // 1E: ASL a,x - shift absolute memory offset by x value to the left one bit  - 7, 3
-    SetupOpCode(0x1E, &CPU_6502::ASL_a_x, MN_ASL_ABS_X, 3);
+    SetupOpCode(0x1E, &CPU_6502::ASL_a_x<false>, &CPU_6502::ASL_a_x<true>, MN_ASL_ABS_X, 3);
    
     // 19: ORA a,y - Inclusive OR between a and a value stored in memory offset by y - 4, 3
     SetupOpCode(0x19, &CPU_6502::ORA_a_y, MN_ORA_ABS_Y, 3);
@@ -2240,7 +2437,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x21, &CPU_6502::AND_zp_x_ind, MN_AND_ZP_X_IND, 2);
 
     // 20: JSR a - pushes PC - 1 then jumps to absolute address - 6, 3
-    SetupOpCode(0x20, &CPU_6502::JSR, MN_JSR_ABS, 3);
+    SetupOpCode(0x20, &CPU_6502::JSR<false>, &CPU_6502::JSR<true>, MN_JSR_ABS, 3);
 
     // 24: BIT zp - Perform a bit test with a value in zp memory - 3, 2
     SetupOpCode(0x24, &CPU_6502::BIT_zp, MN_BIT_ZP, 2);
@@ -2249,7 +2446,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x25, &CPU_6502::AND_zp, MN_AND_ZP, 2);
 
     // 26: ROL zp - rotate value in zero page memory one bit to the left - 5, 2
-    SetupOpCode(0x26, &CPU_6502::ROL_zp, MN_ROL_ZP, 2);
+    SetupOpCode(0x26, &CPU_6502::ROL_zp<false>, &CPU_6502::ROL_zp<true>, MN_ROL_ZP, 2);
 
     // 28: PLP i - pull processor status flags from stack - 4, 1
     SetupOpCode(0x28, &CPU_6502::PLP, MN_PLP, 1);
@@ -2267,7 +2464,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x2D, &CPU_6502::AND_a, MN_AND_ABS, 3);
 
     // 2E: ROL a - rotate value in memory one bit to the left - 6, 3
-    SetupOpCode(0x2E, &CPU_6502::ROL_a, MN_ROL_ABS, 3);
+    SetupOpCode(0x2E, &CPU_6502::ROL_a<false>, &CPU_6502::ROL_a<true>, MN_ROL_ABS, 3);
 
     // 30: BMI r - branch relative if negative flag is set - 2, 2
     SetupOpCode(0x30, &CPU_6502::BMI_r, MN_BMI, 2);
@@ -2279,7 +2476,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x35, &CPU_6502::AND_zp_x, MN_AND_ZP_X, 2);
 
     // 36: ROL zp,x - rotate value in zero page memory offset by x one bit to the left - 6, 2
-    SetupOpCode(0x36, &CPU_6502::ROL_zp_x, MN_ROL_ZP_X, 2);
+    SetupOpCode(0x36, &CPU_6502::ROL_zp_x<false>, &CPU_6502::ROL_zp_x<true>, MN_ROL_ZP_X, 2);
 
     // 38: set carry - 2, 1
     SetupOpCode(0x38, &CPU_6502::SEC, MN_SEC, 1);
@@ -2291,7 +2488,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x3D, &CPU_6502::AND_a_x, MN_AND_ABS_X, 3);
 
     // 3E: ROL a,x - rotate value in absolute memory offset by x one bit to the left - 7, 3
-    SetupOpCode(0x3E, &CPU_6502::ROL_a_x, MN_ROL_ABS_X, 3);
+    SetupOpCode(0x3E, &CPU_6502::ROL_a_x<false>, &CPU_6502::ROL_a_x<true>, MN_ROL_ABS_X, 3);
 
     // 40: RTI - return from interrupt - 6, 1
     SetupOpCode(0x40, &CPU_6502::RTI, MN_RTI, 1);
@@ -2303,10 +2500,10 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x45, &CPU_6502::EOR_zp, MN_EOR_ZP, 2);
 
     // 46: LSR zp - read a byte from zp, shift it one bit to the right and put it back - 5, 2
-    SetupOpCode(0x46, &CPU_6502::LSR_zp, MN_LSR_ZP, 2);
+    SetupOpCode(0x46, &CPU_6502::LSR_zp<false>, &CPU_6502::LSR_zp<true>, MN_LSR_ZP, 2);
     
     // 48: PHA s - push a to stack - 3, 1
-    SetupOpCode(0x48, &CPU_6502::PHA, MN_PHA, 1);
+    SetupOpCode(0x48, &CPU_6502::PHA<false>, &CPU_6502::PHA<true>, MN_PHA, 1);
 
     // 49: EOR # - Perform EOR between a and an immediate value - 2, 2
     SetupOpCode(0x49, &CPU_6502::EOR_imm, MN_EOR_IMM, 2);
@@ -2321,7 +2518,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x4D, &CPU_6502::EOR_a, MN_EOR_ABS, 3);
 
     // 4E: LSR a - read a byte from abs memory, shift it one bit to the right and put it back - 6, 3
-    SetupOpCode(0x4E, &CPU_6502::LSR_a, MN_LSR_ABS, 3);
+    SetupOpCode(0x4E, &CPU_6502::LSR_a<false>, &CPU_6502::LSR_a<true>, MN_LSR_ABS, 3);
 
     // 50: BVC r - branch relative if overflow flag is clear - 2, 2
     SetupOpCode(0x50, &CPU_6502::BVC_r, MN_BVC, 2);
@@ -2333,7 +2530,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x55, &CPU_6502::EOR_zp_x, MN_EOR_ZP_X, 2);
 
     // 56: LSR zp,x - read a byte from zp offset by x, shift it one bit to the right and put it back - 6, 2
-    SetupOpCode(0x56, &CPU_6502::LSR_zp_x, MN_LSR_ZP_X, 2);
+    SetupOpCode(0x56, &CPU_6502::LSR_zp_x<false>, &CPU_6502::LSR_zp_x<true>, MN_LSR_ZP_X, 2);
     
     // 58: CLI i - clear interrupt disable flag - 2, 1
     SetupOpCode(0x58, &CPU_6502::CLI, MN_CLI, 1);
@@ -2345,7 +2542,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x5D, &CPU_6502::EOR_a_x, MN_EOR_ABS_X, 3);
 
     // 5E: LSR a,x - read a byte from memory offset by x, shift it one bit to the right and put it back - 7, 3
-    SetupOpCode(0x5E, &CPU_6502::LSR_a_x, MN_LSR_ABS_X, 3);
+    SetupOpCode(0x5E, &CPU_6502::LSR_a_x<false>, &CPU_6502::LSR_a_x<true>, MN_LSR_ABS_X, 3);
 
     // 60: RTS pop an adress of the stack, add one, and jump there - 6, 1
     SetupOpCode(0x60, &CPU_6502::RTS, MN_RTS, 1);
@@ -2357,7 +2554,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x65, &CPU_6502::ADC_zp, MN_ADC_ZP, 2);
 
     // 66: ROR zp - Move value stored in zp one bit to the right - 5, 2
-    SetupOpCode(0x66, &CPU_6502::ROR_zp, MN_ROR_ZP, 2);
+    SetupOpCode(0x66, &CPU_6502::ROR_zp<false>, &CPU_6502::ROR_zp<true>, MN_ROR_ZP, 2);
 
     // 68: PLA s - pull off of stack and into a - 4, 1
     SetupOpCode(0x68, &CPU_6502::PLA, MN_PLA, 1);
@@ -2375,7 +2572,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x6D, &CPU_6502::ADC_a, MN_ADC_ABS, 3);
 
     // 6E: ROR a - Move value stored in absolute memory one bit to the right - 6, 3
-    SetupOpCode(0x6E, &CPU_6502::ROR_a, MN_ROR_a, 3);
+    SetupOpCode(0x6E, &CPU_6502::ROR_a<false>, &CPU_6502::ROR_a<true>, MN_ROR_a, 3);
 
     // 70: BVS r - Branch relative if overflow flag is set - 2, 2
     SetupOpCode(0x70, &CPU_6502::BVS_r, MN_BVS, 2);
@@ -2387,7 +2584,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x75, &CPU_6502::ADC_zp_x, MN_ADC_ZP_X, 2);
 
     // 76: ROR zp,x - Move value stored in zero page of memory offset by x one bit to the right - 5, 2
-    SetupOpCode(0x76, &CPU_6502::ROR_zp_x, MN_ROR_ZP_X, 2);
+    SetupOpCode(0x76, &CPU_6502::ROR_zp_x<false>, &CPU_6502::ROR_zp_x<true>, MN_ROR_ZP_X, 2);
 
     // 78: SEI i - set interrupt disable flag - 2, 1
     SetupOpCode(0x78, &CPU_6502::SEI, MN_SEI, 1);
@@ -2399,19 +2596,19 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x7D, &CPU_6502::ADC_a_x, MN_ADC_ABS_X, 3);
 
     // 7E: ROR a,x - Move value stored in absolute memory offset by x one bit to the right - 7, 3
-    SetupOpCode(0x7E, &CPU_6502::ROR_a_x, MN_ROR_ABS_X, 3);
+    SetupOpCode(0x7E, &CPU_6502::ROR_a_x<false>, &CPU_6502::ROR_a_x<true>, MN_ROR_ABS_X, 3);
 
     // 81: STA (zp, x) - store a into a zp indexed indirect address - 6, 2
-    SetupOpCode(0x81, &CPU_6502::STA_zp_x_ind, MN_STA_ZP_X_IND, 2);
+    SetupOpCode(0x81, &CPU_6502::STA_zp_x_ind<false>, &CPU_6502::STA_zp_x_ind<true>, MN_STA_ZP_X_IND, 2);
 
     // 84: STY zp - store y to a value in zp memory - 3, 2
-    SetupOpCode(0x84, &CPU_6502::STY_zp, MN_STY_ZP, 2);
+    SetupOpCode(0x84, &CPU_6502::STY_zp<false>, &CPU_6502::STY_zp<true>, MN_STY_ZP, 2);
 
     // 85: STA zp (store a to zero page address) - 3, 2
-    SetupOpCode(0x85, &CPU_6502::STA_zp, MN_STA_ZP, 2);
+    SetupOpCode(0x85, &CPU_6502::STA_zp<false>, &CPU_6502::STA_zp<true>, MN_STA_ZP, 2);
 
     // 86: STX zp - store x in a zp memory location - 3, 2
-    SetupOpCode(0x86, &CPU_6502::STX_zp, MN_STX_ZP, 2);
+    SetupOpCode(0x86, &CPU_6502::STX_zp<false>, &CPU_6502::STX_zp<true>, MN_STX_ZP, 2);
 
     // 88: DEY i = decrement y register - 2, 1
     SetupOpCode(0x88, &CPU_6502::DEY, MN_DEY, 1);
@@ -2420,40 +2617,40 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0x8A, &CPU_6502::TXA, MN_TXA, 1);
 
     // 8C: STY a (store y to absolute memory address) - 4, 3
-    SetupOpCode(0x8C, &CPU_6502::STY_a, MN_STY_ABS, 3);
+    SetupOpCode(0x8C, &CPU_6502::STY_a<false>, &CPU_6502::STY_a<true>, MN_STY_ABS, 3);
 
     // 8D: STA a (store a to absolute memory address)
-    SetupOpCode(0x8D, &CPU_6502::STA_a, STA_ABS, 3);
+    SetupOpCode(0x8D, &CPU_6502::STA_a<false>, &CPU_6502::STA_a<true>, STA_ABS, 3);
 
     // 8E: STX a (store x to absolute memory address) - 4, 3
-    SetupOpCode(0x8E, &CPU_6502::STX_a, MN_STX_ABS, 3);
+    SetupOpCode(0x8E, &CPU_6502::STX_a<false>, &CPU_6502::STX_a<true>, MN_STX_ABS, 3);
 
     // 90: BCC r - branch relative if carry flag is clear - 2, 2
     SetupOpCode(0x90, &CPU_6502::BCC_r, MN_BCC, 2);
 
     // 91: STA(zp), y - store a to indirectly indexed memory - 6, 2
-    SetupOpCode(0x91, &CPU_6502::STA_zp_ind_y, MN_STA_ZP_IND_Y, 2);
+    SetupOpCode(0x91, &CPU_6502::STA_zp_ind_y<false>, &CPU_6502::STA_zp_ind_y<true>, MN_STA_ZP_IND_Y, 2);
 
     // 94: STY zp,x - store y to a value in zp memory offset by x - 4, 2
-    SetupOpCode(0x94, &CPU_6502::STY_zp_x, MN_STY_ZP_X, 2);
+    SetupOpCode(0x94, &CPU_6502::STY_zp_x<false>, &CPU_6502::STY_zp_x<true>, MN_STY_ZP_X, 2);
 
     // 95: STA zp,x (store a to zp memory offset by x) - 4, 2
-    SetupOpCode(0x95, &CPU_6502::STA_zp_x, MN_STA_ZP_X, 2);
+    SetupOpCode(0x95, &CPU_6502::STA_zp_x<false>, &CPU_6502::STA_zp_x<true>, MN_STA_ZP_X, 2);
 
     // 96: STX zp,y - store x in a zp address offset by y - 4, 2
-    SetupOpCode(0x96, &CPU_6502::STX_zp_y, MN_STX_ZP_Y, 2);
+    SetupOpCode(0x96, &CPU_6502::STX_zp_y<false>, &CPU_6502::STX_zp_y<true>, MN_STX_ZP_Y, 2);
 
     // 98: TYA i - transfer y to a - 2, 1
     SetupOpCode(0x98, &CPU_6502::TYA, MN_TYA, 1);
 
     // 99: STA a,y - Store a to absolute address + y offset - 5, 3
-    SetupOpCode(0x99, &CPU_6502::STA_a_y, MN_STA_ABS_Y, 3);
+    SetupOpCode(0x99, &CPU_6502::STA_a_y<false>, &CPU_6502::STA_a_y<true>, MN_STA_ABS_Y, 3);
 
     // 9A: TXS - transfer x to SP register - 2, 1
     SetupOpCode(0x9A, &CPU_6502::TXS, MN_TXS, 1);
 
     // 9D: STA a,x - store a to an address offset by x - 5, 3
-    SetupOpCode(0x9D, &CPU_6502::STA_a_x, MN_STA_ABS_X, 3);
+    SetupOpCode(0x9D, &CPU_6502::STA_a_x<false>, &CPU_6502::STA_a_x<true>, MN_STA_ABS_X, 3);
 
     // A0: LDY # (load immediate value to Y) - 2, 2
     SetupOpCode(0xA0, &CPU_6502::LDY_imm, MN_LDY_IMM, 2);
@@ -2539,7 +2736,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xC5, &CPU_6502::CMP_zp, MN_CMP_ZP, 2);
 
     // C6: DEC zp - decrement a value in zp memory - 5, 2
-    SetupOpCode(0xC6, &CPU_6502::DEC_zp, MN_DEC_ZP, 2);
+    SetupOpCode(0xC6, &CPU_6502::DEC_zp<false>, &CPU_6502::DEC_zp<true>, MN_DEC_ZP, 2);
 
     // C8: INY i - increment y - 2, 1
     SetupOpCode(0xC8, &CPU_6502::INY, MN_INY, 1);
@@ -2557,7 +2754,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xCD, &CPU_6502::CMP_a, MN_CMP_ABS, 3);
     
     // CE: DEC a - decrement a value in memory - 6, 3
-    SetupOpCode(0xCE, &CPU_6502::DEC_a, MN_DEC_ABS, 3);
+    SetupOpCode(0xCE, &CPU_6502::DEC_a<false>, &CPU_6502::DEC_a<true>, MN_DEC_ABS, 3);
 
     // D0 - BRNE r (Branch relative if z flag is cleared) - 2, 2
     SetupOpCode(0xD0, &CPU_6502::BRNE_r, MN_BRNE_r, 2);
@@ -2569,7 +2766,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xD5, &CPU_6502::CMP_zp_x, MN_CMP_ZP_X, 2);
 
     // D6: DEC zp, x - decrement a value in zp memory offset by x - 6, 2
-    SetupOpCode(0xD6, &CPU_6502::DEC_zp_x, MN_DEC_ZP_X, 2);
+    SetupOpCode(0xD6, &CPU_6502::DEC_zp_x<false>, &CPU_6502::DEC_zp_x<true>, MN_DEC_ZP_X, 2);
 
     // D8 - CLD i - clear decimal flag - 2, 1
     SetupOpCode(0xD8, &CPU_6502::CLD, MN_CLD, 1);
@@ -2581,7 +2778,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xDD, &CPU_6502::CMP_a_x, MN_CMP_ABS_X, 3);
 
     // DE: DEC a, x - decrement a value in abs memory offset by x - 7, 3
-    SetupOpCode(0xDE, &CPU_6502::DEC_a_x, MN_DEC_ABS_X, 3);
+    SetupOpCode(0xDE, &CPU_6502::DEC_a_x<false>, &CPU_6502::DEC_a_x<true>, MN_DEC_ABS_X, 3);
 
     // E0 - compare x with immediate value - 2, 2
     SetupOpCode(0xE0, &CPU_6502::CPX_imm, MN_CPX_IMM, 2);
@@ -2596,7 +2793,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xE5, &CPU_6502::SBC_zp, MN_SBC_ZP, 2);
 
     // E6: INC zp - increment a value in zp memory - 5, 2
-    SetupOpCode(0xE6, &CPU_6502::INC_zp, MN_INC_ZP, 2);
+    SetupOpCode(0xE6, &CPU_6502::INC_zp<false>, &CPU_6502::INC_zp<true>, MN_INC_ZP, 2);
 
     // E8: INX - Inc X - 2, 1
     SetupOpCode(0xE8, &CPU_6502::INX, MN_INX, 1);
@@ -2614,7 +2811,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xED, &CPU_6502::SBC_a, MN_SBC_ABS, 3);
 
     // EE: INC a - increment a value in abs memory - 6, 3
-    SetupOpCode(0xEE, &CPU_6502::INC_a, MN_INC_ABS, 3);
+    SetupOpCode(0xEE, &CPU_6502::INC_a<false>, &CPU_6502::INC_a<true>, MN_INC_ABS, 3);
 
     // F0: BEQ r - branch if equal - 2, 2
     SetupOpCode(0xF0, &CPU_6502::BEQ_r, MN_BEQ, 2);
@@ -2626,7 +2823,7 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xF5, &CPU_6502::SBC_zp_x, MN_SBC_ZP_X, 2);
 
     // F6: INC zp,x - increment a value in zp memory offset by x - 6, 2
-    SetupOpCode(0xF6, &CPU_6502::INC_zp_x, MN_INC_ZP_X, 2);
+    SetupOpCode(0xF6, &CPU_6502::INC_zp_x<false>, &CPU_6502::INC_zp_x<true>, MN_INC_ZP_X, 2);
 
     // F8: SED i - set decimal flag - 2, 1
     SetupOpCode(0xF8, &CPU_6502::SED, MN_SED, 1);
@@ -2638,12 +2835,18 @@ void CPU_6502::SetupOpcodes()
     SetupOpCode(0xFD, &CPU_6502::SBC_a_x, MN_SBC_ABS_X, 3);
     
     // FE: INC a,x - increment a value in memory offset by x - 7, 3
-    SetupOpCode(0xFE, &CPU_6502::INC_a_x, MN_INC_ABS_X, 3);
+    SetupOpCode(0xFE, &CPU_6502::INC_a_x<false>, &CPU_6502::INC_a_x<true>, MN_INC_ABS_X, 3);
 }
 
 void CPU_6502::SetupOpCode(uint8_t op, opcodeFuncPtr ptr, const char *mnemonic, uint8_t bytes)
+{
+    SetupOpCode(op, ptr, ptr, mnemonic, bytes);
+}
+
+void CPU_6502::SetupOpCode(uint8_t op, opcodeFuncPtr ptr, opcodeFuncPtr tracedPtr, const char *mnemonic, uint8_t bytes)
 {
     opcodes[op] = ptr;
+    tracedOpcodes[op] = tracedPtr;
     mnemonics[op] = mnemonic;
     opcodeBytes[op] = bytes;
 
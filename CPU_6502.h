@@ -26,6 +26,47 @@ typedef union FLAGS
     char allFlags;
 }FLAGS;
 
+// Which implementation of the instruction set Run() uses
+enum CPU_CORE
+{
+    CPU_CORE_LEGACY,        // opcode function pointers, see CPU_6502.cpp
+    CPU_CORE_INTERPRETER,   // switch-dispatched templated kernels, see CPU_6502_Interpreter.cpp
+    CPU_CORE_BLOCKS         // interpreter kernels run from translated blocks, see CPU_6502_Interpreter.cpp
+};
+
+// Everything that can hold the IRQ line low, one bit each in CPU_6502::irqSources
+#define IRQ_MAPPER              0x01
+#define IRQ_DMC                 0x02
+
+#define MAX_BLOCK_INSTRUCTIONS  16
+#define BLOCK_CACHE_SIZE        1024    /* must be a power of 2 */
+
+// A straight-line run of instructions translated by CPU_CORE_BLOCKS
+typedef struct TRANSLATED_BLOCK
+{
+    uint16_t startPC;
+    uint16_t lastPC;            // address of the last byte of the block
+    uint8_t instructionCount;   // 0 if this entry is empty
+    uint8_t cycles;             // base cycles of every instruction in the block
+    uint16_t syncMask;          // instructions that could access a peripheral, which need CPU_6502::clocks up to date
+    uint16_t writeMask;         // instructions that write memory, which could be the block's own code
+    uint8_t cyclesBefore[MAX_BLOCK_INSTRUCTIONS];   // base cycles of the instructions ahead of each one
+    uint32_t firstPageVersion;  // CPU_6502::codePageVersions of the pages the block was translated from
+    uint32_t lastPageVersion;
+    DECODED_INSTRUCTION instructions[MAX_BLOCK_INSTRUCTIONS];
+}TRANSLATED_BLOCK;
+
+#define MAX_IDLE_LOOP_BYTES     16
+
+// The most recent loop checked for being idle
+typedef struct IDLE_LOOP
+{
+    uint16_t start;
+    uint16_t end;           // address after the branch or jump that goes back to start
+    uint32_t pageVersion;   // CPU_6502::codePageVersions of the page start is on
+    int cycles;             // cycles per iteration, 0 if the loop isn't idle
+}IDLE_LOOP;
+
 class CPU_6502;
 typedef void (CPU_6502::*opcodeFuncPtr)(void);
 typedef void (*opcodeFuncPtrThis)(void);
@@ -45,6 +86,9 @@ public:
 
     void TriggerNMI();
 
+    // IRQ line, held while any source's bit is set. Each source clears only its own bit when the game acknowledges it.
+    uint8_t irqSources;
+
     // registers
     uint8_t a;
     uint8_t x;
@@ -56,7 +100,22 @@ public:
     // Stack pointer
     uint8_t SP;
 
-    uint32_t clocks;
+    // CPU cycles since power on, 64 bits so it doesn't wrap in long sessions. Cycles are added when an instruction
+    // finishes, so during one this is the cycle it started on.
+    uint64_t clocks;
+
+    // The cycle of the current instruction its write happens on, counted from 0, for peripherals that care about the
+    // exact cycle (OAM DMA). Set by the instructions that can write to a register.
+    uint8_t writeCycle;
+
+    // Cycles the CPU is halted for before its next instruction (OAM DMA, DMC fetches). Run() counts them off like
+    // instructions, stopping at the deadline, so events that come due while the CPU is halted still happen on time.
+    int stallCycles;
+    void Stall(int cycles) { stallCycles += cycles; }
+    void RunStall(int busClocks);
+
+    // The master clock everything is scheduled by, in bus clocks (PPU dots). There are 3 per CPU cycle.
+    uint64_t BusClock() { return clocks * 3; }
 
     FLAGS flags;
     bool running;
@@ -65,8 +124,47 @@ public:
     int busClocksAvailable;
     bool Run(int busClocks);
 
+    // The bus clock RunUntil() is running to. Events scheduled while the CPU runs can bring it forward.
+    uint64_t runDeadline;
+    bool deadlineMoved;
+    void BringDeadlineForward(uint64_t time)
+    {
+        if (time < runDeadline)
+        {
+            runDeadline = time;
+            deadlineMoved = true;
+        }
+    }
+
+    // Runs until BusClock() reaches deadline, overshooting by at most one instruction
+    bool RunUntil(uint64_t deadline);
+
+    CPU_CORE core;
+
+    // Instructions decoded by the interpreter core, indexed by address
+    DECODED_INSTRUCTION *decodeCache;
+    void InvalidateDecodeCache();
+
+    // Blocks translated by the block core, indexed by the low bits of their start address
+    TRANSLATED_BLOCK *blockCache;
+
+    // Incremented every time a page of memory is written, so blocks know when they're stale
+    uint32_t codePageVersions[256];
+
+    // Idle loops are skipped to the end of the Run() batch by the interpreter cores
+    bool skipIdleLoops;
+    IDLE_LOOP lastLoop;
+
 protected:
-    // operations
+    bool RunInterpreter(int busClocks);
+
+    // Step() and Run() pick one of these depending on debugOutput
+    template<bool trace>
+    bool Step();
+    template<bool trace>
+    bool RunLegacy(int busClocks);
+
+    // operations, the ones that write memory are templated on trace output like Step()
     void UnhandledOpcode();
     void ADC_Generic(uint8_t value);
     void EOR_Generic(uint8_t value);
@@ -75,92 +173,92 @@ protected:
     void BRK();             // 00
     void ORA_zp_x_ind();    // 01 test
     void ORA_zp();          // 05 test
-    void ASL_zp();          // 06 test
-    void PHP();             // 08 test
+    template<bool trace> void ASL_zp();         // 06 test
+    template<bool trace> void PHP();            // 08 test
     void ORA_imm();         // 09 test
     void ASL();             // 0A test
     void ORA_a();           // 0D test
-    void ASL_a();           // 0E test
+    template<bool trace> void ASL_a();          // 0E test
     void BPL_r();           // 10 test
     void ORA_zp_ind_y();    // 11 test
     void ORA_zp_x();        // 15 test
-    void ASL_zp_x();        // 16 test
+    template<bool trace> void ASL_zp_x();       // 16 test
     void CLC();             // 18 test
     void ORA_a_y();         // 19 test
     void ORA_a_x();         // 1D test
-    void ASL_a_x();         // 1E test
-    void JSR();             // 20
+    template<bool trace> void ASL_a_x();        // 1E test
+    template<bool trace> void JSR();            // 20
     void AND_zp_x_ind();    // 21
     void BIT_zp();          // 24 test
     void AND_zp();          // 25 test
-    void ROL_zp();          // 26 test
+    template<bool trace> void ROL_zp();         // 26 test
     void PLP();             // 28 test
     void AND_imm();         // 29 test
     void ROL_A();           // 2A test
     void BIT_a();           // 2C test
     void AND_a();           // 2D test
-    void ROL_a();           // 2E test
+    template<bool trace> void ROL_a();          // 2E test
     void BMI_r();           // 30 test
     void AND_zp_ind_y();    // 31 test
     void AND_zp_x();        // 35 test
-    void ROL_zp_x();        // 36 test
+    template<bool trace> void ROL_zp_x();       // 36 test
     void SEC();             // 38
     void AND_a_y();         // 39 test
     void AND_a_x();         // 3D test
-    void ROL_a_x();         // 3E test
+    template<bool trace> void ROL_a_x();        // 3E test
     void RTI();             // 40 test
     void EOR_zp_x_ind();    // 41 test
     void EOR_zp();          // 45 test
-    void LSR_zp();          // 46 test
-    void PHA();             // 48
+    template<bool trace> void LSR_zp();         // 46 test
+    template<bool trace> void PHA();            // 48
     void EOR_imm();         // 49
     void LSR();             // 4A test
     void JMP_a();           // 4C
     void EOR_a();           // 4D
-    void LSR_a();           // 4E test
+    template<bool trace> void LSR_a();          // 4E test
     void BVC_r();           // 50 test
     void EOR_zp_ind_y();    // 51 test
     void EOR_zp_x();        // 55
-    void LSR_zp_x();        // 56
+    template<bool trace> void LSR_zp_x();       // 56
     void CLI();             // 58
     void EOR_a_y();         // 59
     void EOR_a_x();         // 5D
-    void LSR_a_x();         // 5E
+    template<bool trace> void LSR_a_x();        // 5E
     void RTS();             // 60
     void ADC_zp_x_ind();    // 61
     void ADC_zp();          // 65
-    void ROR_zp();          // 66
+    template<bool trace> void ROR_zp();         // 66
     void PLA();             // 68
     void ADC_imm();         // 69
     void ROR_A();           // 6A
     void JMP_ind();         // 6C
     void ADC_a();           // 6D
-    void ROR_a();           // 6E
+    template<bool trace> void ROR_a();          // 6E
     void BVS_r();           // 70 test
     void ADC_zp_ind_y();    // 71 test
     void ADC_zp_x();        // 75 test
-    void ROR_zp_x();        // 76 test
+    template<bool trace> void ROR_zp_x();       // 76 test
     void SEI();             // 78
     void ADC_a_y();         // 79 test
     void ADC_a_x();         // 7D test
-    void ROR_a_x();         // 7E test
-    void STA_zp_x_ind();    // 81 test
-    void STY_zp();          // 84
-    void STA_zp();          // 85
-    void STX_zp();          // 86 test
+    template<bool trace> void ROR_a_x();        // 7E test
+    template<bool trace> void STA_zp_x_ind();   // 81 test
+    template<bool trace> void STY_zp();         // 84
+    template<bool trace> void STA_zp();         // 85
+    template<bool trace> void STX_zp();         // 86 test
     void DEY();             // 88
     void TYA();             // 89
     void TXA();             // 8A
-    void STY_a();           // 8C
-    void STA_a();           // 8D
-    void STX_a();           // 8E
+    template<bool trace> void STY_a();          // 8C
+    template<bool trace> void STA_a();          // 8D
+    template<bool trace> void STX_a();          // 8E
     void BCC_r();           // 90
-    void STA_zp_ind_y();    // 91
-    void STY_zp_x();        // 94
-    void STA_zp_x();        // 95
-    void STX_zp_y();        // 96 test
-    void STA_a_y();         // 99
-    void STA_a_x();         // 9D test
+    template<bool trace> void STA_zp_ind_y();   // 91
+    template<bool trace> void STY_zp_x();       // 94
+    template<bool trace> void STA_zp_x();       // 95
+    template<bool trace> void STX_zp_y();       // 96 test
+    template<bool trace> void STA_a_y();        // 99
+    template<bool trace> void STA_a_x();        // 9D test
     void TXS();             // 9A test
     void LDY_imm();         // A0
     void LDA_zp_x_ind();    // A1
@@ -189,49 +287,53 @@ protected:
     void CPY_zp();          // C4 test
     void CMP_zp_x_ind();    // C1 test
     void CMP_zp();          // C5 test
-    void DEC_zp();          // C6 test
+    template<bool trace> void DEC_zp();         // C6 test
     void INY();             // C8
     void CMP_imm();         // C9
     void DEX();             // CA
     void CPY_a();           // CC test
     void CMP_a();           // CD test
-    void DEC_a();           // CE test
+    template<bool trace> void DEC_a();          // CE test
     void BRNE_r();          // D0
     void CMP_zp_ind_y();    // D1 test
     void CMP_zp_x();        // D5 test
-    void DEC_zp_x();        // D6 test
+    template<bool trace> void DEC_zp_x();       // D6 test
     void CMP_a_y();         // D9 test
     void CLD();             // D8 test
     void CMP_a_x();         // DD test
-    void DEC_a_x();         // DE test
+    template<bool trace> void DEC_a_x();        // DE test
     void CPX_imm();         // E0
     void SBC_zp_x_ind();    // E1 test
     void CPX_zp();          // E4 test
     void SBC_zp();          // E5 test
-    void INC_zp();          // E6 test
+    template<bool trace> void INC_zp();         // E6 test
     void INX();             // E8
     void SBC_imm();         // E9 test more
     void NOP();             // EA
     void CPX_a();           // EC test
     void SBC_a();           // ED test
-    void INC_a();           // EE test
+    template<bool trace> void INC_a();          // EE test
     void BEQ_r();           // F0 test
     void SBC_zp_ind_y();    // F1 test
     void SBC_zp_x();        // F5 test
-    void INC_zp_x();        // F6 test
+    template<bool trace> void INC_zp_x();       // F6 test
     void SED();             // F8 test
     void SBC_a_y();         // F9 test
     void SBC_a_x();         // FD test
-    void INC_a_x();         // FE test
+    template<bool trace> void INC_a_x();        // FE test
     // end of operations
 
     void SetupOpcodes();
     void SetupOpCode(uint8_t op, opcodeFuncPtr ptr, const char *mnemonic, uint8_t bytes);
 
+    // Handlers that write memory are templated on trace output like Step(), opcodes[] has the untraced versions
+    void SetupOpCode(uint8_t op, opcodeFuncPtr ptr, opcodeFuncPtr tracedPtr, const char *mnemonic, uint8_t bytes);
+
     uint16_t operand;   // operand for the current instruction
     uint8_t opcode;     // opcode of the current instruction
 
     opcodeFuncPtr opcodes[256];
+    opcodeFuncPtr tracedOpcodes[256];
     opcodeFuncPtrThis ops[256];
     uint8_t opcodeBytes[256];
     const char *mnemonics[256];
@@ -0,0 +1,1179 @@
+#include "CPU_6502.h"
+#include "System.h"
+#include <stdio.h>
+
+/*
+A second implementation of the 6502 instruction set, selected with CPU_6502::core.
+
+The original core calls a member function pointer for every instruction, looks up the operand size in
+opcodeBytes[] and compares mnemonics[] against UNHANDLED after every instruction. This core instead copies
+the registers into a local register file for an entire Run() batch and dispatches every opcode through one
+switch statement. Each case of the switch is built from a templated addressing mode and a templated
+operation, so the compiler generates a specialized kernel for every opcode with no indirect calls.
+(MSVC doesn't support computed goto, so a switch it is.)
+
+Every official opcode is one line in CPU_OPCODE_TABLE:
+OP(opcode, kernel, operation, addressing mode, base cycles, idle safe)
+Idle safe opcodes give the same result every time they're repeated with the same memory, and only access addresses
+known ahead of time, so they can be part of an idle loop. Branches are checked when the loop is analyzed.
+
+Instructions are only fetched from the bus the first time they're executed. After that the opcode, operand and
+length come from CPU_6502::decodeCache. Each entry remembers the version of its page in CPU_6502::codePageVersions,
+which Bus::write() and bank switches bump, so code in RAM, self-modifying code and bank switched code still work.
+
+The interpreter evaluates N, Z and V lazily (see GetFlags()), the registers and flags are written back to the CPU
+when a Run() batch ends.
+
+CPU_CORE_BLOCKS goes a step further and translates straight-line runs of instructions into blocks kept in
+CPU_6502::blockCache. A block ends at any branch, jump, RTS, RTI or BRK, at any absolute access of a PPU or APU
+register and at any absolute or absolute indexed write to a mapper register. Other indexed and indirect accesses of
+registers and writes to mapper registers end it early at run time. The base cycles of a block are summed when it's
+translated, and only added to clocks ahead of an instruction that could access a peripheral, so peripherals still see
+the cycle each access starts on. busClocksAvailable, nmi and irqSources are only checked between blocks, and a block
+that would run past busClocksAvailable runs an instruction at a time instead. Bus::write() bumps a version number for
+the page it writes if code has been decoded from it, and blocks are re-translated when a page they came from has
+changed. A block that writes one of its own pages stops right after the write.
+
+Unlike the original core, page-crossing penalties, the NMI sequence and the flags of ASL / LSR on memory
+follow the datasheet, so traces of the two cores will differ in those places.
+*/
+
+// Addressing modes
+enum ADDRESSING_MODE
+{
+    AM_IMPLIED,     // i, s
+    AM_ACCUMULATOR, // A
+    AM_IMMEDIATE,   // #
+    AM_ZP,          // zp
+    AM_ZP_X,        // zp,x
+    AM_ZP_Y,        // zp,y
+    AM_ABS,         // a
+    AM_ABS_X,       // a,x
+    AM_ABS_Y,       // a,y
+    AM_INDIRECT,    // (a)
+    AM_ZP_X_IND,    // (zp,x)
+    AM_ZP_IND_Y,    // (zp),y
+    AM_RELATIVE     // r
+};
+
+#define CPU_OPCODE_TABLE(OP)                        \
+    OP(0x00, Implied, BRK, AM_IMPLIED,      7, 0)   \
+    OP(0x01, Read,    ORA, AM_ZP_X_IND,     6, 0)   \
+    OP(0x05, Read,    ORA, AM_ZP,           3, 1)   \
+    OP(0x06, Modify,  ASL, AM_ZP,           5, 0)   \
+    OP(0x08, Implied, PHP, AM_IMPLIED,      3, 0)   \
+    OP(0x09, Read,    ORA, AM_IMMEDIATE,    2, 1)   \
+    OP(0x0A, Modify,  ASL, AM_ACCUMULATOR,  2, 0)   \
+    OP(0x0D, Read,    ORA, AM_ABS,          4, 1)   \
+    OP(0x0E, Modify,  ASL, AM_ABS,          6, 0)   \
+    OP(0x10, Branch,  BPL, AM_RELATIVE,     2, 1)   \
+    OP(0x11, Read,    ORA, AM_ZP_IND_Y,     5, 0)   \
+    OP(0x15, Read,    ORA, AM_ZP_X,         4, 0)   \
+    OP(0x16, Modify,  ASL, AM_ZP_X,         6, 0)   \
+    OP(0x18, Implied, CLC, AM_IMPLIED,      2, 0)   \
+    OP(0x19, Read,    ORA, AM_ABS_Y,        4, 0)   \
+    OP(0x1D, Read,    ORA, AM_ABS_X,        4, 0)   \
+    OP(0x1E, Modify,  ASL, AM_ABS_X,        7, 0)   \
+    OP(0x20, Jump,    JSR, AM_ABS,          6, 0)   \
+    OP(0x21, Read,    AND, AM_ZP_X_IND,     6, 0)   \
+    OP(0x24, Read,    BIT, AM_ZP,           3, 1)   \
+    OP(0x25, Read,    AND, AM_ZP,           3, 1)   \
+    OP(0x26, Modify,  ROL, AM_ZP,           5, 0)   \
+    OP(0x28, Implied, PLP, AM_IMPLIED,      4, 0)   \
+    OP(0x29, Read,    AND, AM_IMMEDIATE,    2, 1)   \
+    OP(0x2A, Modify,  ROL, AM_ACCUMULATOR,  2, 0)   \
+    OP(0x2C, Read,    BIT, AM_ABS,          4, 1)   \
+    OP(0x2D, Read,    AND, AM_ABS,          4, 1)   \
+    OP(0x2E, Modify,  ROL, AM_ABS,          6, 0)   \
+    OP(0x30, Branch,  BMI, AM_RELATIVE,     2, 1)   \
+    OP(0x31, Read,    AND, AM_ZP_IND_Y,     5, 0)   \
+    OP(0x35, Read,    AND, AM_ZP_X,         4, 0)   \
+    OP(0x36, Modify,  ROL, AM_ZP_X,         6, 0)   \
+    OP(0x38, Implied, SEC, AM_IMPLIED,      2, 0)   \
+    OP(0x39, Read,    AND, AM_ABS_Y,        4, 0)   \
+    OP(0x3D, Read,    AND, AM_ABS_X,        4, 0)   \
+    OP(0x3E, Modify,  ROL, AM_ABS_X,        7, 0)   \
+    OP(0x40, Implied, RTI, AM_IMPLIED,      6, 0)   \
+    OP(0x41, Read,    EOR, AM_ZP_X_IND,     6, 0)   \
+    OP(0x45, Read,    EOR, AM_ZP,           3, 0)   \
+    OP(0x46, Modify,  LSR, AM_ZP,           5, 0)   \
+    OP(0x48, Implied, PHA, AM_IMPLIED,      3, 0)   \
+    OP(0x49, Read,    EOR, AM_IMMEDIATE,    2, 0)   \
+    OP(0x4A, Modify,  LSR, AM_ACCUMULATOR,  2, 0)   \
+    OP(0x4C, Jump,    JMP, AM_ABS,          3, 0)   \
+    OP(0x4D, Read,    EOR, AM_ABS,          4, 0)   \
+    OP(0x4E, Modify,  LSR, AM_ABS,          6, 0)   \
+    OP(0x50, Branch,  BVC, AM_RELATIVE,     2, 1)   \
+    OP(0x51, Read,    EOR, AM_ZP_IND_Y,     5, 0)   \
+    OP(0x55, Read,    EOR, AM_ZP_X,         4, 0)   \
+    OP(0x56, Modify,  LSR, AM_ZP_X,         6, 0)   \
+    OP(0x58, Implied, CLI, AM_IMPLIED,      2, 0)   \
+    OP(0x59, Read,    EOR, AM_ABS_Y,        4, 0)   \
+    OP(0x5D, Read,    EOR, AM_ABS_X,        4, 0)   \
+    OP(0x5E, Modify,  LSR, AM_ABS_X,        7, 0)   \
+    OP(0x60, Implied, RTS, AM_IMPLIED,      6, 0)   \
+    OP(0x61, Read,    ADC, AM_ZP_X_IND,     6, 0)   \
+    OP(0x65, Read,    ADC, AM_ZP,           3, 0)   \
+    OP(0x66, Modify,  ROR, AM_ZP,           5, 0)   \
+    OP(0x68, Implied, PLA, AM_IMPLIED,      4, 0)   \
+    OP(0x69, Read,    ADC, AM_IMMEDIATE,    2, 0)   \
+    OP(0x6A, Modify,  ROR, AM_ACCUMULATOR,  2, 0)   \
+    OP(0x6C, Jump,    JMP, AM_INDIRECT,     5, 0)   \
+    OP(0x6D, Read,    ADC, AM_ABS,          4, 0)   \
+    OP(0x6E, Modify,  ROR, AM_ABS,          6, 0)   \
+    OP(0x70, Branch,  BVS, AM_RELATIVE,     2, 1)   \
+    OP(0x71, Read,    ADC, AM_ZP_IND_Y,     5, 0)   \
+    OP(0x75, Read,    ADC, AM_ZP_X,         4, 0)   \
+    OP(0x76, Modify,  ROR, AM_ZP_X,         6, 0)   \
+    OP(0x78, Implied, SEI, AM_IMPLIED,      2, 0)   \
+    OP(0x79, Read,    ADC, AM_ABS_Y,        4, 0)   \
+    OP(0x7D, Read,    ADC, AM_ABS_X,        4, 0)   \
+    OP(0x7E, Modify,  ROR, AM_ABS_X,        7, 0)   \
+    OP(0x81, Store,   STA, AM_ZP_X_IND,     6, 0)   \
+    OP(0x84, Store,   STY, AM_ZP,           3, 0)   \
+    OP(0x85, Store,   STA, AM_ZP,           3, 0)   \
+    OP(0x86, Store,   STX, AM_ZP,           3, 0)   \
+    OP(0x88, Implied, DEY, AM_IMPLIED,      2, 0)   \
+    OP(0x8A, Implied, TXA, AM_IMPLIED,      2, 0)   \
+    OP(0x8C, Store,   STY, AM_ABS,          4, 0)   \
+    OP(0x8D, Store,   STA, AM_ABS,          4, 0)   \
+    OP(0x8E, Store,   STX, AM_ABS,          4, 0)   \
+    OP(0x90, Branch,  BCC, AM_RELATIVE,     2, 1)   \
+    OP(0x91, Store,   STA, AM_ZP_IND_Y,     6, 0)   \
+    OP(0x94, Store,   STY, AM_ZP_X,         4, 0)   \
+    OP(0x95, Store,   STA, AM_ZP_X,         4, 0)   \
+    OP(0x96, Store,   STX, AM_ZP_Y,         4, 0)   \
+    OP(0x98, Implied, TYA, AM_IMPLIED,      2, 0)   \
+    OP(0x99, Store,   STA, AM_ABS_Y,        5, 0)   \
+    OP(0x9A, Implied, TXS, AM_IMPLIED,      2, 0)   \
+    OP(0x9D, Store,   STA, AM_ABS_X,        5, 0)   \
+    OP(0xA0, Read,    LDY, AM_IMMEDIATE,    2, 1)   \
+    OP(0xA1, Read,    LDA, AM_ZP_X_IND,     6, 0)   \
+    OP(0xA2, Read,    LDX, AM_IMMEDIATE,    2, 1)   \
+    OP(0xA4, Read,    LDY, AM_ZP,           3, 1)   \
+    OP(0xA5, Read,    LDA, AM_ZP,           3, 1)   \
+    OP(0xA6, Read,    LDX, AM_ZP,           3, 1)   \
+    OP(0xA8, Implied, TAY, AM_IMPLIED,      2, 0)   \
+    OP(0xA9, Read,    LDA, AM_IMMEDIATE,    2, 1)   \
+    OP(0xAA, Implied, TAX, AM_IMPLIED,      2, 0)   \
+    OP(0xAC, Read,    LDY, AM_ABS,          4, 1)   \
+    OP(0xAD, Read,    LDA, AM_ABS,          4, 1)   \
+    OP(0xAE, Read,    LDX, AM_ABS,          4, 1)   \
+    OP(0xB0, Branch,  BCS, AM_RELATIVE,     2, 1)   \
+    OP(0xB1, Read,    LDA, AM_ZP_IND_Y,     5, 0)   \
+    OP(0xB4, Read,    LDY, AM_ZP_X,         4, 0)   \
+    OP(0xB5, Read,    LDA, AM_ZP_X,         4, 0)   \
+    OP(0xB6, Read,    LDX, AM_ZP_Y,         4, 0)   \
+    OP(0xB8, Implied, CLV, AM_IMPLIED,      2, 0)   \
+    OP(0xB9, Read,    LDA, AM_ABS_Y,        4, 0)   \
+    OP(0xBA, Implied, TSX, AM_IMPLIED,      2, 0)   \
+    OP(0xBC, Read,    LDY, AM_ABS_X,        4, 0)   \
+    OP(0xBD, Read,    LDA, AM_ABS_X,        4, 0)   \
+    OP(0xBE, Read,    LDX, AM_ABS_Y,        4, 0)   \
+    OP(0xC0, Read,    CPY, AM_IMMEDIATE,    2, 1)   \
+    OP(0xC1, Read,    CMP, AM_ZP_X_IND,     6, 0)   \
+    OP(0xC4, Read,    CPY, AM_ZP,           3, 1)   \
+    OP(0xC5, Read,    CMP, AM_ZP,           3, 1)   \
+    OP(0xC6, Modify,  DEC, AM_ZP,           5, 0)   \
+    OP(0xC8, Implied, INY, AM_IMPLIED,      2, 0)   \
+    OP(0xC9, Read,    CMP, AM_IMMEDIATE,    2, 1)   \
+    OP(0xCA, Implied, DEX, AM_IMPLIED,      2, 0)   \
+    OP(0xCC, Read,    CPY, AM_ABS,          4, 1)   \
+    OP(0xCD, Read,    CMP, AM_ABS,          4, 1)   \
+    OP(0xCE, Modify,  DEC, AM_ABS,          6, 0)   \
+    OP(0xD0, Branch,  BNE, AM_RELATIVE,     2, 1)   \
+    OP(0xD1, Read,    CMP, AM_ZP_IND_Y,     5, 0)   \
+    OP(0xD5, Read,    CMP, AM_ZP_X,         4, 0)   \
+    OP(0xD6, Modify,  DEC, AM_ZP_X,         6, 0)   \
+    OP(0xD8, Implied, CLD, AM_IMPLIED,      2, 0)   \
+    OP(0xD9, Read,    CMP, AM_ABS_Y,        4, 0)   \
+    OP(0xDD, Read,    CMP, AM_ABS_X,        4, 0)   \
+    OP(0xDE, Modify,  DEC, AM_ABS_X,        7, 0)   \
+    OP(0xE0, Read,    CPX, AM_IMMEDIATE,    2, 1)   \
+    OP(0xE1, Read,    SBC, AM_ZP_X_IND,     6, 0)   \
+    OP(0xE4, Read,    CPX, AM_ZP,           3, 1)   \
+    OP(0xE5, Read,    SBC, AM_ZP,           3, 0)   \
+    OP(0xE6, Modify,  INC, AM_ZP,           5, 0)   \
+    OP(0xE8, Implied, INX, AM_IMPLIED,      2, 0)   \
+    OP(0xE9, Read,    SBC, AM_IMMEDIATE,    2, 0)   \
+    OP(0xEA, Implied, NOP, AM_IMPLIED,      2, 1)   \
+    OP(0xEC, Read,    CPX, AM_ABS,          4, 1)   \
+    OP(0xED, Read,    SBC, AM_ABS,          4, 0)   \
+    OP(0xEE, Modify,  INC, AM_ABS,          6, 0)   \
+    OP(0xF0, Branch,  BEQ, AM_RELATIVE,     2, 1)   \
+    OP(0xF1, Read,    SBC, AM_ZP_IND_Y,     5, 0)   \
+    OP(0xF5, Read,    SBC, AM_ZP_X,         4, 0)   \
+    OP(0xF6, Modify,  INC, AM_ZP_X,         6, 0)   \
+    OP(0xF8, Implied, SED, AM_IMPLIED,      2, 0)   \
+    OP(0xF9, Read,    SBC, AM_ABS_Y,        4, 0)   \
+    OP(0xFD, Read,    SBC, AM_ABS_X,        4, 0)   \
+    OP(0xFE, Modify,  INC, AM_ABS_X,        7, 0)
+
+namespace
+{
+
+// Size of an instruction in bytes, including the opcode
+int InstructionLength(int mode)
+{
+    switch (mode)
+    {
+        case AM_IMPLIED:
+        case AM_ACCUMULATOR:
+            return 1;
+
+        case AM_ABS:
+        case AM_ABS_X:
+        case AM_ABS_Y:
+        case AM_INDIRECT:
+            return 3;
+
+        default:
+            return 2;
+    }
+}
+
+// What the interpreter needs to know about an opcode without executing it
+typedef struct INSTRUCTION_INFO
+{
+    uint8_t length;     // size in bytes, including the opcode
+    uint8_t cycles;     // base cycles, not counting page crossings or taken branches
+    uint8_t mode;       // ADDRESSING_MODE
+    bool handled;
+    bool endsBlock;     // control flow can leave the straight line after this instruction
+    bool writesMemory;  // a store, read-modify-write of memory or push
+    bool idleSafe;      // repeating the instruction gives the same result, so it can be part of an idle loop
+}INSTRUCTION_INFO;
+
+// The kernel column of CPU_OPCODE_TABLE, for telling kinds of instructions apart without executing them
+enum KERNEL_TYPE
+{
+    KERNEL_Implied,
+    KERNEL_Read,
+    KERNEL_Store,
+    KERNEL_Modify,
+    KERNEL_Branch,
+    KERNEL_Jump
+};
+
+// Info for every opcode, unhandled opcodes are treated as one byte and two cycles
+struct INSTRUCTION_TABLE
+{
+    INSTRUCTION_TABLE()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            info[i].length = 1;
+            info[i].cycles = 2;
+            info[i].mode = AM_IMPLIED;
+            info[i].handled = false;
+            info[i].endsBlock = true;
+            info[i].writesMemory = false;
+            info[i].idleSafe = false;
+        }
+
+#define INFO(op, kernel, operation, addressingMode, baseCycles, idle)                           \
+        info[op].length = InstructionLength(addressingMode);                                    \
+        info[op].cycles = baseCycles;                                                           \
+        info[op].mode = addressingMode;                                                         \
+        info[op].handled = true;                                                                \
+        info[op].endsBlock = (addressingMode == AM_RELATIVE || op == 0x00 || op == 0x20             \
+                              || op == 0x40 || op == 0x4C || op == 0x60 || op == 0x6C);   /* BRK, JSR, RTI, JMP, RTS, JMP */ \
+        info[op].writesMemory = ((KERNEL_##kernel == KERNEL_Store || KERNEL_##kernel == KERNEL_Modify)     \
+                                 && addressingMode != AM_ACCUMULATOR) || op == 0x08 || op == 0x48;   /* PHP, PHA */ \
+        info[op].idleSafe = idle;
+        CPU_OPCODE_TABLE(INFO)
+#undef INFO
+    }
+
+    INSTRUCTION_INFO info[256];
+};
+
+const INSTRUCTION_TABLE instructionTable;
+
+// Returns true if instructions at address can be cached. Registers can't be cached since reading them has side effects.
+// Neither can the mirrors of the work RAM, since Bus::write() only invalidates the first copy.
+inline bool IsCacheable(uint16_t address)
+{
+#ifdef SYSTEM_NES
+    return address < 0x800 || address > 0x401F;
+#else
+    return true;
+#endif
+}
+
+// Returns true if address is a PPU or APU register
+inline bool IsIO_Address(uint16_t address)
+{
+#ifdef SYSTEM_NES
+    return address >= 0x2000 && address <= 0x401F;
+#else
+    return false;
+#endif
+}
+
+// Returns true if writing address can switch banks of cartridge memory
+inline bool IsMapperRegister(uint16_t address)
+{
+#ifdef SYSTEM_NES
+    return address >= 0x8000;
+#else
+    return false;
+#endif
+}
+
+// Returns the cycle a store writes on, counted from 0. It's always the last one.
+inline int StoreWriteCycle(int mode)
+{
+    switch (mode)
+    {
+        case AM_ZP:
+            return 2;
+        case AM_ZP_X:
+        case AM_ZP_Y:
+        case AM_ABS:
+            return 3;
+        case AM_ABS_X:
+        case AM_ABS_Y:
+            return 4;
+        default:    // (zp,x) and (zp),y
+            return 5;
+    }
+}
+
+// Returns true if reading address more than once gives the same result as reading it once
+inline bool IsRepeatableRead(uint16_t address)
+{
+#ifdef SYSTEM_NES
+    // Reading PPUSTATUS clears vblank, but that only matters the first time
+    if (address >= 0x2000 && address <= 0x3FFF)
+        return (address & 0x7) == 2;
+
+    // The controllers shift out a new bit on every read, and APU status reads back length counters and the DMC
+    // running down, which the scheduler doesn't know when to stop for
+    if (address >= 0x4000 && address <= 0x401F)
+        return false;
+
+    return true;
+#else
+    // 0xfe is a random byte
+    return address != 0xFE;
+#endif
+}
+
+// Register file and instruction kernels for one Run() batch.
+// It only lives on the stack of CPU_6502::RunInterpreter(), so the compiler is free to keep the registers in host registers.
+// With trace false, none of the tracing code is compiled in.
+template<bool trace>
+struct CPU_Interpreter
+{
+    CPU_Interpreter(CPU_6502 &cpu, const char * const *mnemonics)
+        : cpu(cpu), bus(cpu.bus), mnemonics(mnemonics)
+    {
+        a = cpu.a;
+        x = cpu.x;
+        y = cpu.y;
+        PC = cpu.PC;
+        SP = cpu.SP;
+        SetFlags(cpu.flags.allFlags);
+
+        ioAccessed = false;
+        idleLoopCycles = 0;
+    }
+
+    // Copy the local registers back to the CPU
+    void WriteBack()
+    {
+        cpu.a = a;
+        cpu.x = x;
+        cpu.y = y;
+        cpu.PC = PC;
+        cpu.SP = SP;
+        cpu.flags.allFlags = GetFlags();
+    }
+
+    CPU_6502 &cpu;
+    Bus &bus;
+    const char * const *mnemonics;
+
+    // registers
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint16_t PC;
+    uint8_t SP;
+
+    // Flags are evaluated lazily. Instead of setting bits of a FLAGS union, instructions store the values the
+    // flags come from, and N, Z and V are only worked out when something reads them.
+    uint8_t negativeResult; // N is bit 7
+    uint8_t zeroResult;     // Z is set if this is 0
+    uint8_t overflowResult; // V is bit 7
+    bool carry;
+    FLAGS flags;            // I, D, B and the ignored bit, the other flags in here are stale
+
+    uint16_t operand;   // operand for the current instruction
+    uint32_t cycles;    // cycles taken by the current instruction
+
+    bool ioAccessed;    // set when an indexed or indirect access touches a register or writes a mapper register
+    int idleLoopCycles; // cycles per iteration of an idle loop the CPU just went around, 0 if there isn't one
+
+    // Runs instructions until busClocksAvailable is used up, returns false if an unhandled opcode was encountered.
+    // With useBlocks, busClocksAvailable, nmi and irqSources are only checked between translated blocks.
+    template<bool useBlocks>
+    bool Run(int &busClocksAvailable)
+    {
+        bool retVal = true;
+
+        while (cpu.running && busClocksAvailable > 0)
+        {
+            cycles = 0;
+            uint64_t startClocks = cpu.clocks;
+
+            if (cpu.stallCycles)
+                cpu.RunStall(busClocksAvailable);
+            else if (cpu.nmi)
+            {
+                if (trace)
+                    printf("Handling NMI\n");
+
+                cpu.nmi = false;
+                Interrupt(0xFFFA);
+            }
+            else if (cpu.irqSources && !flags.irqDisable)
+            {
+                if (trace)
+                    printf("Handling IRQ\n");
+
+                Interrupt(0xFFFE);
+            }
+            else if (useBlocks)
+                retVal &= ExecuteBlock(busClocksAvailable);
+            else
+                retVal &= Execute();
+
+            // Halts are added to clocks directly by RunStall()
+            cpu.clocks += cycles;
+            busClocksAvailable -= 3 * (int)(cpu.clocks - startClocks);
+
+            // Something scheduled an event before the deadline
+            if (cpu.deadlineMoved)
+            {
+                cpu.deadlineMoved = false;
+                busClocksAvailable = (int)((int64_t)cpu.runDeadline - (int64_t)cpu.BusClock());
+            }
+
+            if (idleLoopCycles)
+                SkipIdleLoop(busClocksAvailable);
+        }
+
+        return retVal;
+    }
+
+    // Idle loops
+
+    /*
+    Games spend a lot of time in loops that wait for something to change, like "LDA $2002 / BPL" waiting for vblank,
+    or a "JMP" to itself waiting for the NMI handler. An idle loop only reads memory, and always gives the same
+    result when it runs again with the same memory. Once it has made a full pass, nothing it reads can change until
+    the next event. Vblank, NMI, sprite 0 hit, mapper IRQs and DMC fetches are all Scheduler events, and
+    CPU_6502::RunUntil() only runs the CPU up to the earliest one, so the end of the batch is the next event. The CPU
+    can skip ahead to it in whole iterations of the loop. An event scheduled while the loop runs shortens the batch
+    first (see CPU_6502::BringDeadlineForward()).
+    */
+
+    // Called when a branch or jump at the end of [loopStart, loopEnd) goes back to loopStart
+    void LoopedBack(uint16_t loopStart, uint16_t loopEnd)
+    {
+        if (!cpu.skipIdleLoops || (uint16_t)(loopEnd - loopStart) > MAX_IDLE_LOOP_BYTES)
+            return;
+
+        // Loops run many times in a row, so remember the result of the last analysis
+        IDLE_LOOP &loop = cpu.lastLoop;
+        if (loop.start != loopStart || loop.end != loopEnd || loop.pageVersion != cpu.codePageVersions[loopStart >> 8])
+        {
+            loop.start = loopStart;
+            loop.end = loopEnd;
+            loop.pageVersion = cpu.codePageVersions[loopStart >> 8];
+            loop.cycles = AnalyzeLoop(loopStart, loopEnd);
+        }
+
+        idleLoopCycles = loop.cycles;
+    }
+
+    // Returns the cycles taken by one iteration if the loop is idle, or 0 if it isn't
+    int AnalyzeLoop(uint16_t loopStart, uint16_t loopEnd)
+    {
+        uint16_t address = loopStart;
+        int loopCycles = 0;
+
+        while (address != loopEnd)
+        {
+            // Guard against instructions that overlap loopEnd
+            if ((uint16_t)(loopEnd - address) > MAX_IDLE_LOOP_BYTES || !IsCacheable(address))
+                return 0;
+
+            DECODED_INSTRUCTION *pInstruction = &cpu.decodeCache[address];
+            if (!IsDecoded(pInstruction, address))
+                Decode(pInstruction, address);
+
+            const INSTRUCTION_INFO &info = instructionTable.info[pInstruction->opcode];
+            if (!info.handled)
+                return 0;
+
+            uint16_t next = address + pInstruction->length;
+            loopCycles += info.cycles;
+
+            if (next == loopEnd)
+            {
+                // This is the branch or jump that goes back, branches always take the extra cycle(s)
+                if (info.mode == AM_RELATIVE)
+                    loopCycles += ((next & 0xFF00) != (loopStart & 0xFF00)) ? 2 : 1;
+            }
+            else if (!IsIdleSafe(pInstruction, info, next, loopStart, loopEnd))
+                return 0;
+
+            address = next;
+        }
+
+        return loopCycles;
+    }
+
+    bool IsIdleSafe(DECODED_INSTRUCTION *pInstruction, const INSTRUCTION_INFO &info, uint16_t next, uint16_t loopStart, uint16_t loopEnd)
+    {
+        if (!info.idleSafe)
+            return false;
+
+        // A branch out of the loop is fine, but one inside it would make iterations take different amounts of time
+        if (info.mode == AM_RELATIVE)
+        {
+            uint16_t target = next + (int8_t)pInstruction->operand;
+            return (uint16_t)(target - loopStart) >= (uint16_t)(loopEnd - loopStart);
+        }
+
+        if (info.mode == AM_ZP || info.mode == AM_ABS)
+            return IsRepeatableRead(pInstruction->operand);
+
+        return true;
+    }
+
+    // Runs the rest of the batch as whole iterations of the idle loop, without executing them
+    void SkipIdleLoop(int &busClocksAvailable)
+    {
+        int loopCycles = idleLoopCycles;
+        idleLoopCycles = 0;
+
+        if (cpu.nmi || (cpu.irqSources && !flags.irqDisable) || busClocksAvailable <= 0)
+            return;
+
+        int busClocksPerIteration = 3 * loopCycles;
+        int iterations = (busClocksAvailable + busClocksPerIteration - 1) / busClocksPerIteration;
+
+        cpu.clocks += iterations * loopCycles;
+        busClocksAvailable -= iterations * busClocksPerIteration;
+    }
+
+    // Executes the instruction at PC
+    bool Execute()
+    {
+        DECODED_INSTRUCTION uncached;
+        DECODED_INSTRUCTION *pDecoded = &cpu.decodeCache[PC];
+
+        if (!IsDecoded(pDecoded, PC))
+        {
+            if (!IsCacheable(PC))
+                pDecoded = &uncached;
+
+            Decode(pDecoded, PC);
+        }
+
+        operand = pDecoded->operand;
+        PC += pDecoded->length;
+        cycles += instructionTable.info[pDecoded->opcode].cycles;
+
+        return Dispatch(pDecoded->opcode);
+    }
+
+    // Executes the translated block starting at PC, translating it first if needed. Base cycles are added to clocks
+    // up front, just before an instruction that could access a peripheral, so the peripheral sees the cycle the
+    // instruction starts on like it would in Execute().
+    bool ExecuteBlock(int busClocksAvailable)
+    {
+        TRANSLATED_BLOCK *pBlock = &cpu.blockCache[PC & (BLOCK_CACHE_SIZE - 1)];
+
+        if (!IsValid(pBlock))
+        {
+            Translate(pBlock);
+
+            // Nothing at PC could be translated, so run it the slow way
+            if (!pBlock->instructionCount)
+                return Execute();
+        }
+
+        // Close to the deadline, go one instruction at a time so it isn't overshot by a whole block
+        if (3 * pBlock->cycles > busClocksAvailable)
+            return Execute();
+
+        DECODED_INSTRUCTION *pInstruction = pBlock->instructions;
+        DECODED_INSTRUCTION *pEnd = pInstruction + pBlock->instructionCount;
+        ioAccessed = false;
+
+        int index = 0;
+        uint32_t charged = 0;   // cycles of this block already added to clocks
+
+        while (pInstruction != pEnd)
+        {
+            if (pBlock->syncMask & (1 << index))
+            {
+                uint32_t due = pBlock->cyclesBefore[index] + cycles;
+                cpu.clocks += due - charged;
+                charged = due;
+            }
+
+            operand = pInstruction->operand;
+            PC += pInstruction->length;
+            bool writes = (pBlock->writeMask >> index) & 1;
+
+            // Blocks never contain unhandled opcodes
+            Dispatch(pInstruction->opcode);
+            ++pInstruction;
+            ++index;
+
+            // Stop after a register access so the rest of the system can see it happen at the right time, and after a
+            // write to the pages the block came from, since it could have changed the instructions that are left
+            if (pInstruction != pEnd && (ioAccessed || (writes && !IsCurrent(pBlock))))
+            {
+                cycles += pBlock->cyclesBefore[index] - charged;
+                return true;
+            }
+        }
+
+        cycles += pBlock->cycles - charged;
+        return true;
+    }
+
+    // A block is valid if it starts at PC and the memory it was translated from hasn't been written since
+    bool IsValid(TRANSLATED_BLOCK *pBlock)
+    {
+        return pBlock->instructionCount && pBlock->startPC == PC && IsCurrent(pBlock);
+    }
+
+    // Returns true if the pages the block was translated from haven't been written or had another bank mapped in
+    bool IsCurrent(TRANSLATED_BLOCK *pBlock)
+    {
+        return pBlock->firstPageVersion == cpu.codePageVersions[pBlock->startPC >> 8]
+            && pBlock->lastPageVersion == cpu.codePageVersions[pBlock->lastPC >> 8];
+    }
+
+    // Decode instructions starting at PC until one that can change the flow of control or accesses a register
+    void Translate(TRANSLATED_BLOCK *pBlock)
+    {
+        uint16_t address = PC;
+        int count = 0;
+        int blockCycles = 0;
+        pBlock->syncMask = 0;
+        pBlock->writeMask = 0;
+
+        while (count < MAX_BLOCK_INSTRUCTIONS && IsCacheable(address))
+        {
+            DECODED_INSTRUCTION *pInstruction = &pBlock->instructions[count];
+            Decode(pInstruction, address);
+
+            const INSTRUCTION_INFO &info = instructionTable.info[pInstruction->opcode];
+            if (!info.handled)
+                break;
+
+            // Indexed and indirect accesses could turn out to be registers
+            pBlock->cyclesBefore[count] = blockCycles;
+            if (info.mode == AM_ABS_X || info.mode == AM_ABS_Y || info.mode == AM_ZP_X_IND || info.mode == AM_ZP_IND_Y)
+                pBlock->syncMask |= 1 << count;
+            if (info.writesMemory)
+                pBlock->writeMask |= 1 << count;
+
+            ++count;
+            blockCycles += info.cycles;
+            address += pInstruction->length;
+
+            if (info.endsBlock)
+                break;
+
+            // Absolute accesses of registers are known ahead of time (indexed ones are caught by ioAccessed)
+            if ((info.mode == AM_ABS || info.mode == AM_ABS_X || info.mode == AM_ABS_Y)
+                && IsIO_Address(pInstruction->operand))
+                break;
+
+            // A bank switch can change the code the rest of the block came from. Indexed writes from below $8000 that
+            // end up there are caught by ioAccessed.
+            if (info.writesMemory && (info.mode == AM_ABS || info.mode == AM_ABS_X || info.mode == AM_ABS_Y)
+                && IsMapperRegister(pInstruction->operand))
+                break;
+        }
+
+        // Absolute accesses of registers and mappers end the block, so they're always last
+        if (count)
+            pBlock->syncMask |= 1 << (count - 1);
+
+        pBlock->startPC = PC;
+        pBlock->lastPC = address - 1;
+        pBlock->instructionCount = count;
+        pBlock->cycles = blockCycles;
+        pBlock->firstPageVersion = cpu.codePageVersions[pBlock->startPC >> 8];
+        pBlock->lastPageVersion = cpu.codePageVersions[pBlock->lastPC >> 8];
+    }
+
+    // Runs the kernel for opcode, with operand and PC already set up
+    bool Dispatch(uint8_t opcode)
+    {
+        switch (opcode)
+        {
+#define DISPATCH(op, kernel, operation, mode, baseCycles, idle)             \
+            case op:                                                        \
+                if (trace)                                                  \
+                    Trace<mode>(opcode);                                    \
+                kernel<mode, &CPU_Interpreter::operation>();                \
+                return true;
+
+            CPU_OPCODE_TABLE(DISPATCH)
+#undef DISPATCH
+
+            default:
+                printf("Opcode 0x%X is unhandled!\n", opcode);
+                return false;
+        }
+    }
+
+    // A cached instruction is good until its page is written or has another bank mapped in
+    bool IsDecoded(const DECODED_INSTRUCTION *pDecoded, uint16_t address)
+    {
+        return pDecoded->length && pDecoded->pageVersion == cpu.codePageVersions[address >> 8];
+    }
+
+    // Read the opcode at address and the 0 - 2 bytes of operand that follow it
+    void Decode(DECODED_INSTRUCTION *pDecoded, uint16_t address)
+    {
+        pDecoded->pageVersion = cpu.codePageVersions[address >> 8];
+        pDecoded->opcode = bus.read(address);
+        pDecoded->length = instructionTable.info[pDecoded->opcode].length;
+        pDecoded->operand = 0;
+
+        if (pDecoded->length >= 2)
+            pDecoded->operand = bus.read(address + 1);
+
+        if (pDecoded->length == 3)
+            pDecoded->operand |= (uint16_t)bus.read(address + 2) << 8;
+
+        // Writes to pages nothing has been decoded from don't invalidate anything
+        bus.markCode(address);
+        bus.markCode(address + pDecoded->length - 1);
+    }
+
+    template<int mode>
+    void Trace(uint8_t opcode)
+    {
+        printf("opcode: 0x%X - %s ", opcode, mnemonics[opcode]);
+
+        if (mode == AM_IMPLIED || mode == AM_ACCUMULATOR)
+            printf("\n");
+        else
+            printf(" 0x%X\n", operand);
+    }
+
+    // Handles an NMI or IRQ in 7 cycles, vector is the address of the handler's address
+    void Interrupt(uint16_t vector)
+    {
+        Push(PC >> 8);
+        Push(PC & 0xFF);
+
+        // Set bit 5 but leave bit 4 clear (See https://wiki.nesdev.com/w/index.php/Status_flags#The_B_flag)
+        Push((GetFlags() & ~0x10) | 0x20);
+        flags.irqDisable = true;
+
+        PC = bus.read(vector);
+        PC |= (uint16_t)bus.read(vector + 1) << 8;
+
+        cycles += 7;
+    }
+
+    // Addressing modes
+
+    // Reads that index across a page boundary take an extra cycle
+    template<bool isRead>
+    uint16_t Indexed(uint16_t base, uint8_t index)
+    {
+        uint16_t address = base + index;
+
+        if (isRead && ((base ^ address) & 0xFF00))
+            ++cycles;
+
+        return address;
+    }
+
+    // Reads a 16-bit pointer from the zero page, wrapping around within the zero page
+    uint16_t ReadZeroPagePointer(uint8_t zpAddress)
+    {
+        uint16_t address = bus.read(zpAddress);
+        address |= (uint16_t)bus.read((uint8_t)(zpAddress + 1)) << 8;
+        return address;
+    }
+
+    template<int mode, bool isRead>
+    uint16_t Address()
+    {
+        uint16_t address = ComputeAddress<mode, isRead>();
+
+        // Indexed and indirect accesses might hit a register, or write a mapper register and switch out the rest of
+        // the block, either of which ends a translated block early
+        if (mode == AM_ABS_X || mode == AM_ABS_Y || mode == AM_ZP_X_IND || mode == AM_ZP_IND_Y)
+            ioAccessed |= IsIO_Address(address) || (!isRead && IsMapperRegister(address));
+
+        return address;
+    }
+
+    template<int mode, bool isRead>
+    uint16_t ComputeAddress()
+    {
+        uint16_t address;
+
+        switch (mode)
+        {
+            case AM_ZP_X:
+                return (uint8_t)(operand + x);
+
+            case AM_ZP_Y:
+                return (uint8_t)(operand + y);
+
+            case AM_ABS_X:
+                return Indexed<isRead>(operand, x);
+
+            case AM_ABS_Y:
+                return Indexed<isRead>(operand, y);
+
+            case AM_INDIRECT:
+                // The original 6502 has an error we need to emulate which occurs if operand is 0xXXff
+                // If so, it will read the high byte of the address from 0xXX00 instead of operand + 1
+                address = bus.read(operand);
+                address |= (uint16_t)bus.read((operand & 0xFF00) | ((operand + 1) & 0xFF)) << 8;
+                return address;
+
+            case AM_ZP_X_IND:
+                return ReadZeroPagePointer((uint8_t)(operand + x));
+
+            case AM_ZP_IND_Y:
+                return Indexed<isRead>(ReadZeroPagePointer((uint8_t)operand), y);
+
+            default:
+                // AM_ZP, AM_ABS
+                return operand;
+        }
+    }
+
+    // Kernels - one for each way an operation can use its addressing mode
+
+    // Operation reads a value
+    template<int mode, void (CPU_Interpreter::*operation)(uint8_t)>
+    void Read()
+    {
+        if (mode == AM_IMMEDIATE)
+            (this->*operation)((uint8_t)operand);
+        else
+            (this->*operation)(bus.read(Address<mode, true>()));
+    }
+
+    // Operation returns a value to be written
+    template<int mode, uint8_t (CPU_Interpreter::*operation)()>
+    void Store()
+    {
+        cpu.writeCycle = StoreWriteCycle(mode);
+        bus.write<trace>(Address<mode, false>(), (this->*operation)());
+    }
+
+    // Read-modify-write operations
+    template<int mode, uint8_t (CPU_Interpreter::*operation)(uint8_t)>
+    void Modify()
+    {
+        if (mode == AM_ACCUMULATOR)
+        {
+            a = (this->*operation)(a);
+            return;
+        }
+
+        // Read-modify-write takes two more cycles than a store, the write is still the last
+        uint16_t address = Address<mode, false>();
+        cpu.writeCycle = StoreWriteCycle(mode) + 2;
+        bus.write<trace>(address, (this->*operation)(bus.read(address)));
+    }
+
+    // Operation takes an address to jump to
+    template<int mode, void (CPU_Interpreter::*operation)(uint16_t)>
+    void Jump()
+    {
+        (this->*operation)(Address<mode, false>());
+    }
+
+    // Branches are taken if the condition is true - 2 cycles, +1 if taken, +1 more if the branch crosses a page
+    template<int mode, bool (CPU_Interpreter::*condition)()>
+    void Branch()
+    {
+        if (!(this->*condition)())
+            return;
+
+        uint16_t oldPC = PC;
+        PC += (int8_t)operand;
+
+        if ((oldPC & 0xFF00) != (PC & 0xFF00))
+            cycles += 2;
+        else
+            cycles += 1;
+
+        if ((int8_t)operand < 0)
+            LoopedBack(PC, oldPC);
+    }
+
+    template<int mode, void (CPU_Interpreter::*operation)()>
+    void Implied()
+    {
+        (this->*operation)();
+    }
+
+    // Helpers
+
+    // Works out the lazily evaluated flags and returns all of them as they'd be pushed
+    uint8_t GetFlags()
+    {
+        FLAGS result = flags;
+        result.negative = IS_NEGATIVE(negativeResult);
+        result.zero = (zeroResult == 0);
+        result.overflow = IS_NEGATIVE(overflowResult);
+        result.carry = carry;
+        return (uint8_t)result.allFlags;
+    }
+
+    void SetFlags(uint8_t value)
+    {
+        flags.allFlags = value;
+        negativeResult = value & 0x80;
+        zeroResult = flags.zero ? 0 : 1;
+        overflowResult = (value & 0x40) << 1;
+        carry = flags.carry;
+    }
+
+    void SetNZ(uint8_t value)
+    {
+        negativeResult = value;
+        zeroResult = value;
+    }
+
+    void Push(uint8_t value)
+    {
+        bus.write<trace>(0x100 + SP, value);
+        --SP;
+    }
+
+    uint8_t Pull()
+    {
+        ++SP;
+        return bus.read(0x100 + SP);
+    }
+
+    void Compare(uint8_t reg, uint8_t value)
+    {
+        carry = (reg >= value);
+        SetNZ((uint8_t)(reg - value));
+    }
+
+    // Operations that read a value
+    void ADC(uint8_t value)
+    {
+        uint16_t result = a + value;
+        if (carry)
+            ++result;
+
+        carry = (result > 0xFF);
+
+        // Overflow occurs if both operands have the same sign and the sign of the result is different
+        overflowResult = ~(a ^ value) & (a ^ result);
+
+        a = (uint8_t)result;
+        SetNZ(a);
+    }
+
+    // a = a - value - !c
+    void SBC(uint8_t value) { ADC((uint8_t)~value); }
+
+    void AND(uint8_t value) { a &= value; SetNZ(a); }
+    void EOR(uint8_t value) { a ^= value; SetNZ(a); }
+    void ORA(uint8_t value) { a |= value; SetNZ(a); }
+    void LDA(uint8_t value) { a = value; SetNZ(a); }
+    void LDX(uint8_t value) { x = value; SetNZ(x); }
+    void LDY(uint8_t value) { y = value; SetNZ(y); }
+    void CMP(uint8_t value) { Compare(a, value); }
+    void CPX(uint8_t value) { Compare(x, value); }
+    void CPY(uint8_t value) { Compare(y, value); }
+
+    void BIT(uint8_t value)
+    {
+        zeroResult = a & value;
+        negativeResult = value;
+        overflowResult = value << 1;
+    }
+
+    // Operations that produce a value to store
+    uint8_t STA() { return a; }
+    uint8_t STX() { return x; }
+    uint8_t STY() { return y; }
+
+    // Read-modify-write operations
+    uint8_t ASL(uint8_t value)
+    {
+        carry = IS_NEGATIVE(value);
+        value <<= 1;
+        SetNZ(value);
+        return value;
+    }
+
+    uint8_t LSR(uint8_t value)
+    {
+        carry = ((value & 1) == 1);
+        value >>= 1;
+        SetNZ(value);
+        return value;
+    }
+
+    uint8_t ROL(uint8_t value)
+    {
+        uint8_t newValue = value << 1;
+        if (carry)
+            newValue |= 1;
+
+        carry = IS_NEGATIVE(value);
+        SetNZ(newValue);
+        return newValue;
+    }
+
+    uint8_t ROR(uint8_t value)
+    {
+        uint8_t newValue = value >> 1;
+        if (carry)
+            newValue |= 0x80;
+
+        carry = ((value & 1) == 1);
+        SetNZ(newValue);
+        return newValue;
+    }
+
+    uint8_t INC(uint8_t value) { ++value; SetNZ(value); return value; }
+    uint8_t DEC(uint8_t value) { --value; SetNZ(value); return value; }
+
+    // Jumps
+    void JMP(uint16_t address)
+    {
+        uint16_t loopEnd = PC;
+        PC = address;
+
+        if (address < loopEnd)
+            LoopedBack(address, loopEnd);
+    }
+
+    // pushes PC - 1 then jumps to absolute address
+    void JSR(uint16_t address)
+    {
+        uint16_t returnAddress = PC - 1;
+        Push(returnAddress >> 8);
+        Push(returnAddress & 0xFF);
+        PC = address;
+    }
+
+    // Branch conditions
+    bool BPL() { return !IS_NEGATIVE(negativeResult); }
+    bool BMI() { return IS_NEGATIVE(negativeResult); }
+    bool BVC() { return !IS_NEGATIVE(overflowResult); }
+    bool BVS() { return IS_NEGATIVE(overflowResult); }
+    bool BCC() { return !carry; }
+    bool BCS() { return carry; }
+    bool BNE() { return zeroResult != 0; }
+    bool BEQ() { return zeroResult == 0; }
+
+    // Implied operations
+
+    // Like the original core, BRK stops the CPU (programs for the Simple system end with BRK)
+    void BRK()
+    {
+        printf("BRK encountered\n");
+        cpu.running = false;
+    }
+
+    // Set bits 4 and 5 (See https://wiki.nesdev.com/w/index.php/Status_flags#The_B_flag)
+    void PHP() { Push(GetFlags() | 0x30); }
+
+    // ignore bits 4 and 5 of pulled values (see PHP)
+    void PLP() { SetFlags((Pull() & 0xCF) | (flags.allFlags & 0x30)); }
+
+    void PHA() { Push(a); }
+    void PLA() { a = Pull(); SetNZ(a); }
+
+    void RTI()
+    {
+        PLP();
+        PC = Pull();
+        PC |= (uint16_t)Pull() << 8;
+    }
+
+    void RTS()
+    {
+        PC = Pull();
+        PC |= (uint16_t)Pull() << 8;
+        ++PC;
+    }
+
+    void CLC() { carry = false; }
+    void SEC() { carry = true; }
+    void CLI() { flags.irqDisable = false; }
+    void SEI() { flags.irqDisable = true; }
+    void CLD() { flags.decimal = false; }
+    void SED() { flags.decimal = true; }
+    void CLV() { overflowResult = 0; }
+
+    void DEX() { --x; SetNZ(x); }
+    void DEY() { --y; SetNZ(y); }
+    void INX() { ++x; SetNZ(x); }
+    void INY() { ++y; SetNZ(y); }
+
+    void TAX() { x = a; SetNZ(x); }
+    void TAY() { y = a; SetNZ(y); }
+    void TXA() { a = x; SetNZ(a); }
+    void TYA() { a = y; SetNZ(a); }
+    void TSX() { x = SP; SetNZ(x); }
+    void TXS() { SP = x; }
+
+    void NOP() {}
+};
+
+template<bool trace>
+bool RunBatch(CPU_6502 &cpu, const char * const *mnemonics, int &busClocksAvailable)
+{
+    CPU_Interpreter<trace> interpreter(cpu, mnemonics);
+    bool retVal;
+    if (cpu.core == CPU_CORE_BLOCKS)
+        retVal = interpreter.template Run<true>(busClocksAvailable);
+    else
+        retVal = interpreter.template Run<false>(busClocksAvailable);
+    interpreter.WriteBack();
+
+    return retVal;
+}
+
+} // namespace
+
+bool CPU_6502::RunInterpreter(int busClocks)
+{
+    int available = busClocksAvailable + busClocks;
+
+    // Trace output is picked once per batch, the untraced interpreter never looks at debugOutput
+    bool retVal;
+    if (debugOutput)
+        retVal = RunBatch<true>(*this, mnemonics, available);
+    else
+        retVal = RunBatch<false>(*this, mnemonics, available);
+
+    busClocksAvailable = available;
+
+    return retVal;
+}
@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <string.h>
+#include "Mapper.h"
+
+Mapper *Mapper::Create(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+{
+    // Four-screen boards add 2 KB of nametable RAM on the cartridge, the PPU only has its own 2 KB
+    if (pROM->header.flags6.fourScreenVRAM)
+    {
+        printf("Four-screen VRAM isn't supported!\n");
+        return NULL;
+    }
+
+    switch (pROM->mapperNumber)
+    {
+        case MAPPER_NROM:
+            return new Mapper_NROM(pCPU, pPPU, pROM);
+        case MAPPER_MMC1:
+            return new Mapper_MMC1(pCPU, pPPU, pROM);
+        case MAPPER_UxROM:
+            return new Mapper_UxROM(pCPU, pPPU, pROM);
+        case MAPPER_CNROM:
+            return new Mapper_CNROM(pCPU, pPPU, pROM);
+        case MAPPER_MMC3:
+            return new Mapper_MMC3(pCPU, pPPU, pROM);
+        default:
+            printf("Mapper %d isn't supported!\n", pROM->mapperNumber);
+            return NULL;
+    }
+}
+
+// PRG RAM and PRG ROM are mapped from 0x6000 - 0xFFFF on the CPU bus
+Mapper::Mapper(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+    : Peripheral(&pCPU->bus, 0x6000, 0xFFFF)
+{
+    this->pCPU = pCPU;
+    this->pPPU = pPPU;
+    countsScanlines = false;
+
+    // Map the pattern tables on the PPU bus
+    pPPU->PPU_Bus.attachPeripheral(0, 0x1FFF, this);
+    pPPU->pMapper = this;
+
+    pPRG = pROM->pPRGdata;
+    prgSize = pROM->prgSize;
+    memset(prgPages, 0, sizeof(prgPages));
+
+    if (pROM->chrRomSize)
+    {
+        pCHR = pROM->pCHRdata;
+        chrSize = pROM->chrRomSize;
+        pCHR_RAM = NULL;
+    }
+    else
+    {
+        chrSize = CHR_PAGES * CHR_PAGE_SIZE;
+        pCHR_RAM = new uint8_t[chrSize];
+        memset(pCHR_RAM, 0, chrSize);
+        pCHR = pCHR_RAM;
+    }
+
+    pTileCache = new TileCache(pCHR, chrSize);
+    pPPU->pTileCache = pTileCache;
+
+    memset(prgRAM, 0, sizeof(prgRAM));
+    pCPU->bus.mapPages(0x6000, 0x7FFF, prgRAM, prgRAM);
+
+    if (pROM->header.flags6.mirroring)
+        pPPU->SetMirroring(MIRROR_VERTICAL);
+    else
+        pPPU->SetMirroring(MIRROR_HORIZONTAL);
+
+    // Start with the first banks, mappers can switch them from there
+    MapPRG(0x8000, 32, 0);
+    MapCHR(0x0000, 8, 0);
+}
+
+Mapper::~Mapper()
+{
+    if (pPPU->pTileCache == pTileCache)
+        pPPU->pTileCache = NULL;
+    delete pTileCache;
+
+    delete[] pCHR_RAM;
+}
+
+// Reads normally go straight to memory through the bus page tables, this is only used when they can't
+uint8_t Mapper::read(uint16_t address)
+{
+    // PPU bus
+    if (address < 0x2000)
+        return *pPPU->GetPatternData(address);
+
+    if (address < 0x8000)
+        return prgRAM[address & (PRG_RAM_SIZE - 1)];
+
+    return prgPages[(address - 0x8000) / PRG_PAGE_SIZE][address & (PRG_PAGE_SIZE - 1)];
+}
+
+void Mapper::write(uint16_t address, uint8_t value)
+{
+    // PPU bus, CHR ROM can't be written
+    if (address < 0x2000)
+    {
+        if (pCHR_RAM)
+        {
+            uint32_t offset = pPPU->GetPatternData(address) - pCHR;
+            pCHR_RAM[offset] = value;
+            pTileCache->Invalidate(offset);
+        }
+        return;
+    }
+
+    if (address < 0x8000)
+    {
+        prgRAM[address & (PRG_RAM_SIZE - 1)] = value;
+        return;
+    }
+
+    WriteRegister(address, value);
+}
+
+bool Mapper::Save(FILE *pFile)
+{
+    // Banks are saved as page numbers, PRG in 8 KB pages and CHR in 1 KB pages
+    uint16_t prgBanks[PRG_PAGES];
+    for (int i = 0; i < PRG_PAGES; ++i)
+        prgBanks[i] = (uint16_t)((prgPages[i] - pPRG) / PRG_PAGE_SIZE);
+
+    uint16_t chrBanks[CHR_PAGES];
+    for (int i = 0; i < CHR_PAGES; ++i)
+        chrBanks[i] = (uint16_t)((pPPU->patternPages[i] - pCHR) / CHR_PAGE_SIZE);
+
+    uint8_t mirroring = (uint8_t)pPPU->mirroring;
+
+    return fwrite(prgRAM, sizeof(prgRAM), 1, pFile) == 1
+        && (!pCHR_RAM || fwrite(pCHR_RAM, chrSize, 1, pFile) == 1)
+        && fwrite(prgBanks, sizeof(prgBanks), 1, pFile) == 1
+        && fwrite(chrBanks, sizeof(chrBanks), 1, pFile) == 1
+        && fwrite(&mirroring, 1, 1, pFile) == 1
+        && SaveRegisters(pFile);
+}
+
+bool Mapper::Load(FILE *pFile)
+{
+    uint16_t prgBanks[PRG_PAGES];
+    uint16_t chrBanks[CHR_PAGES];
+    uint8_t mirroring;
+
+    if (fread(prgRAM, sizeof(prgRAM), 1, pFile) != 1
+        || (pCHR_RAM && fread(pCHR_RAM, chrSize, 1, pFile) != 1)
+        || fread(prgBanks, sizeof(prgBanks), 1, pFile) != 1
+        || fread(chrBanks, sizeof(chrBanks), 1, pFile) != 1
+        || fread(&mirroring, 1, 1, pFile) != 1
+        || !LoadRegisters(pFile))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < PRG_PAGES; ++i)
+        MapPRG(0x8000 + i * PRG_PAGE_SIZE, PRG_PAGE_SIZE / 1024, prgBanks[i]);
+
+    for (int i = 0; i < CHR_PAGES; ++i)
+        MapCHR(i * CHR_PAGE_SIZE, CHR_PAGE_SIZE / 1024, chrBanks[i]);
+
+    pPPU->SetMirroring((MIRRORING)mirroring);
+
+    // CHR RAM was replaced behind the tile cache's back
+    if (pCHR_RAM)
+    {
+        for (uint32_t offset = 0; offset < chrSize; offset += TILE_BYTES)
+            pTileCache->Invalidate(offset);
+    }
+
+    return true;
+}
+
+void Mapper::MapPRG(uint16_t address, int sizeKB, int bank)
+{
+    int pageCount = prgSize / PRG_PAGE_SIZE;
+    int pagesPerBank = sizeKB * 1024 / PRG_PAGE_SIZE;
+
+    for (int i = 0; i < pagesPerBank; ++i)
+    {
+        int slot = (address - 0x8000) / PRG_PAGE_SIZE + i;
+        const uint8_t *pPage = pPRG + ((bank * pagesPerBank + i) % pageCount) * PRG_PAGE_SIZE;
+
+        // Remapping throws out decoded code, so don't do it when the bank hasn't changed
+        if (prgPages[slot] == pPage)
+            continue;
+
+        prgPages[slot] = pPage;
+
+        // Writes go to the mapper's registers
+        uint16_t slotAddress = 0x8000 + slot * PRG_PAGE_SIZE;
+        pCPU->bus.mapPages(slotAddress, slotAddress + PRG_PAGE_SIZE - 1, pPage, NULL);
+    }
+}
+
+void Mapper::MapCHR(uint16_t address, int sizeKB, int bank)
+{
+    int pageCount = chrSize / CHR_PAGE_SIZE;
+    int pagesPerBank = sizeKB * 1024 / CHR_PAGE_SIZE;
+
+    for (int i = 0; i < pagesPerBank; ++i)
+    {
+        int slot = address / CHR_PAGE_SIZE + i;
+        const uint8_t *pPage = pCHR + ((bank * pagesPerBank + i) % pageCount) * CHR_PAGE_SIZE;
+
+        if (pPPU->patternPages[slot] == pPage)
+            continue;
+
+        // Lines the CPU has already gone past are drawn with the old bank
+        pPPU->CatchUp();
+        pPPU->patternPages[slot] = pPage;
+        pPPU->patternTiles[slot] = (pPage - pCHR) / TILE_BYTES;
+
+        // Writes to CHR RAM come through write() so the tile cache sees them
+        uint16_t slotAddress = slot * CHR_PAGE_SIZE;
+        pPPU->PPU_Bus.mapPages(slotAddress, slotAddress + CHR_PAGE_SIZE - 1, pPage, NULL);
+    }
+}
+
+Mapper_NROM::Mapper_NROM(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+    : Mapper(pCPU, pPPU, pROM)
+{
+    // 16 KB ROMs are mirrored at $C000 by MapPRG() wrapping around
+}
+
+Mapper_MMC1::Mapper_MMC1(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+    : Mapper(pCPU, pPPU, pROM)
+{
+    shiftRegister = 0x10;
+    control = 0x0C;     // the last bank is fixed at $C000 on power up
+    chrBank0 = 0;
+    chrBank1 = 0;
+    prgBank = 0;
+
+    UpdateBanks();
+}
+
+void Mapper_MMC1::WriteRegister(uint16_t address, uint8_t value)
+{
+    // Writing a 1 to bit 7 resets the shift register
+    if (value & 0x80)
+    {
+        shiftRegister = 0x10;
+        control |= 0x0C;
+        UpdateBanks();
+        return;
+    }
+
+    bool fifthWrite = (shiftRegister & 1) == 1;
+    shiftRegister = (shiftRegister >> 1) | ((value & 1) << 4);
+
+    if (!fifthWrite)
+        return;
+
+    // The fifth write copies the shift register to the register picked by bits 13 and 14 of the address
+    switch ((address >> 13) & 3)
+    {
+        case 0:
+            control = shiftRegister;
+            break;
+        case 1:
+            chrBank0 = shiftRegister;
+            break;
+        case 2:
+            chrBank1 = shiftRegister;
+            break;
+        case 3:
+            prgBank = shiftRegister & 0x0F;
+            break;
+    }
+
+    shiftRegister = 0x10;
+    UpdateBanks();
+}
+
+bool Mapper_MMC1::SaveRegisters(FILE *pFile)
+{
+    return fwrite(&shiftRegister, 1, 1, pFile) == 1
+        && fwrite(&control, 1, 1, pFile) == 1
+        && fwrite(&chrBank0, 1, 1, pFile) == 1
+        && fwrite(&chrBank1, 1, 1, pFile) == 1
+        && fwrite(&prgBank, 1, 1, pFile) == 1;
+}
+
+bool Mapper_MMC1::LoadRegisters(FILE *pFile)
+{
+    return fread(&shiftRegister, 1, 1, pFile) == 1
+        && fread(&control, 1, 1, pFile) == 1
+        && fread(&chrBank0, 1, 1, pFile) == 1
+        && fread(&chrBank1, 1, 1, pFile) == 1
+        && fread(&prgBank, 1, 1, pFile) == 1;
+}
+
+void Mapper_MMC1::UpdateBanks()
+{
+    static const MIRRORING mirroring[4] = { MIRROR_SINGLE_LOWER, MIRROR_SINGLE_UPPER, MIRROR_VERTICAL, MIRROR_HORIZONTAL };
+    pPPU->SetMirroring(mirroring[control & 3]);
+
+    switch ((control >> 2) & 3)
+    {
+        case 0:
+        case 1:
+            // Switch 32 KB at $8000, ignoring the low bit of the bank number
+            MapPRG(0x8000, 32, prgBank >> 1);
+            break;
+        case 2:
+            // Fix the first bank at $8000 and switch 16 KB at $C000
+            MapPRG(0x8000, 16, 0);
+            MapPRG(0xC000, 16, prgBank);
+            break;
+        case 3:
+            // Switch 16 KB at $8000 and fix the last bank at $C000
+            MapPRG(0x8000, 16, prgBank);
+            MapPRG(0xC000, 16, PRG_Banks(16) - 1);
+            break;
+    }
+
+    if (control & 0x10)
+    {
+        // Two separate 4 KB banks
+        MapCHR(0x0000, 4, chrBank0);
+        MapCHR(0x1000, 4, chrBank1);
+    }
+    else
+    {
+        // One 8 KB bank, ignoring the low bit of the bank number
+        MapCHR(0x0000, 8, chrBank0 >> 1);
+    }
+}
+
+Mapper_UxROM::Mapper_UxROM(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+    : Mapper(pCPU, pPPU, pROM)
+{
+    MapPRG(0x8000, 16, 0);
+    MapPRG(0xC000, 16, PRG_Banks(16) - 1);
+}
+
+void Mapper_UxROM::WriteRegister(uint16_t, uint8_t value)
+{
+    MapPRG(0x8000, 16, value);
+}
+
+Mapper_CNROM::Mapper_CNROM(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+    : Mapper(pCPU, pPPU, pROM)
+{
+}
+
+void Mapper_CNROM::WriteRegister(uint16_t, uint8_t value)
+{
+    MapCHR(0x0000, 8, value);
+}
+
+Mapper_MMC3::Mapper_MMC3(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM)
+    : Mapper(pCPU, pPPU, pROM)
+{
+    bankSelect = 0;
+    memset(registers, 0, sizeof(registers));
+    registers[7] = 1;
+
+    irqLatch = 0;
+    irqCounter = 0;
+    irqReload = false;
+    irqEnabled = false;
+    countsScanlines = true;
+
+    UpdateBanks();
+}
+
+void Mapper_MMC3::WriteRegister(uint16_t address, uint8_t value)
+{
+    // Registers are picked by the range and whether the address is even or odd
+    switch (address & 0xE001)
+    {
+        case 0x8000:
+            bankSelect = value;
+            UpdateBanks();
+            break;
+        case 0x8001:
+            registers[bankSelect & 7] = value;
+            UpdateBanks();
+            break;
+        case 0xA000:
+            pPPU->SetMirroring((value & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+            break;
+        case 0xA001:
+            // PRG RAM protect, ignored
+            break;
+        case 0xC000:
+            irqLatch = value;
+            break;
+        case 0xC001:
+            irqCounter = 0;
+            irqReload = true;
+            break;
+        case 0xE000:
+            // Disabling IRQs also acknowledges a pending one
+            irqEnabled = false;
+            pCPU->irqSources &= ~IRQ_MAPPER;
+            break;
+        case 0xE001:
+            irqEnabled = true;
+            break;
+    }
+}
+
+bool Mapper_MMC3::SaveRegisters(FILE *pFile)
+{
+    return fwrite(&bankSelect, 1, 1, pFile) == 1
+        && fwrite(registers, sizeof(registers), 1, pFile) == 1
+        && fwrite(&irqLatch, 1, 1, pFile) == 1
+        && fwrite(&irqCounter, 1, 1, pFile) == 1
+        && fwrite(&irqReload, sizeof(bool), 1, pFile) == 1
+        && fwrite(&irqEnabled, sizeof(bool), 1, pFile) == 1;
+}
+
+bool Mapper_MMC3::LoadRegisters(FILE *pFile)
+{
+    return fread(&bankSelect, 1, 1, pFile) == 1
+        && fread(registers, sizeof(registers), 1, pFile) == 1
+        && fread(&irqLatch, 1, 1, pFile) == 1
+        && fread(&irqCounter, 1, 1, pFile) == 1
+        && fread(&irqReload, sizeof(bool), 1, pFile) == 1
+        && fread(&irqEnabled, sizeof(bool), 1, pFile) == 1;
+}
+
+// Banks that haven't changed are skipped by MapPRG() and MapCHR(), so updating all of them is cheap
+void Mapper_MMC3::UpdateBanks()
+{
+    int lastBank = PRG_Banks(8) - 1;
+
+    if (bankSelect & 0x40)
+    {
+        MapPRG(0x8000, 8, lastBank - 1);
+        MapPRG(0xC000, 8, registers[6]);
+    }
+    else
+    {
+        MapPRG(0x8000, 8, registers[6]);
+        MapPRG(0xC000, 8, lastBank - 1);
+    }
+    MapPRG(0xA000, 8, registers[7]);
+    MapPRG(0xE000, 8, lastBank);
+
+    // R0 and R1 are 2 KB banks, R2 - R5 are 1 KB banks. The two halves of the pattern table swap with bit 7.
+    uint16_t inversion = (bankSelect & 0x80) ? 0x1000 : 0;
+    MapCHR(0x0000 ^ inversion, 2, registers[0] >> 1);
+    MapCHR(0x0800 ^ inversion, 2, registers[1] >> 1);
+    MapCHR(0x1000 ^ inversion, 1, registers[2]);
+    MapCHR(0x1400 ^ inversion, 1, registers[3]);
+    MapCHR(0x1800 ^ inversion, 1, registers[4]);
+    MapCHR(0x1C00 ^ inversion, 1, registers[5]);
+}
+
+// The counter is really clocked by A12 rising while the PPU fetches sprites, which happens once per rendered scanline
+void Mapper_MMC3::Scanline()
+{
+    if (!pPPU->maskReg.showBackground && !pPPU->maskReg.showSprites)
+        return;
+
+    if (irqCounter == 0 || irqReload)
+    {
+        irqCounter = irqLatch;
+        irqReload = false;
+    }
+    else
+        --irqCounter;
+
+    if (irqCounter == 0 && irqEnabled)
+        pCPU->irqSources |= IRQ_MAPPER;
+}
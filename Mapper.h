@@ -0,0 +1,154 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include "peripheral.h"
+#include "Bus.h"
+#include "CPU_6502.h"
+#include "PPU.h"
+#include "iNES_File.h"
+#include "TileCache.h"
+
+// Mapper numbers from the iNES header
+#define MAPPER_NROM     0
+#define MAPPER_MMC1     1
+#define MAPPER_UxROM    2
+#define MAPPER_CNROM    3
+#define MAPPER_MMC3     4
+
+#define PRG_PAGE_SIZE   0x2000  /* PRG ROM is switched in 8 KB pages from $8000 - $FFFF */
+#define PRG_PAGES       4
+#define CHR_PAGE_SIZE   0x400   /* CHR is switched in 1 KB pages from $0000 - $1FFF on the PPU bus */
+#define CHR_PAGES       8
+#define PRG_RAM_SIZE    0x2000  /* 8 KB from $6000 - $7FFF */
+
+/*
+The cartridge. A mapper handles $6000 - $FFFF on the CPU bus and the pattern tables ($0000 - $1FFF) on the PPU bus.
+
+Nothing is ever copied out of the ROM. Switching a bank points pages of the CPU and PPU bus page tables (and
+PPU::patternPages) into the ROM image, so reads go straight to the ROM and only writes to the mapper's
+registers and to CHR RAM call write().
+*/
+class Mapper :
+    public Peripheral
+{
+public:
+    // Creates the mapper the ROM's header asks for, returns NULL if it or four-screen VRAM isn't supported
+    static Mapper *Create(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+
+    Mapper(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+    virtual ~Mapper();
+
+    uint8_t read(uint16_t address);
+    void write(uint16_t address, uint8_t value);
+
+    // Called after every scanline the PPU renders, if countsScanlines is set
+    virtual void Scanline() {}
+    bool countsScanlines;   // the Scheduler only stops the CPU every line for mappers that need it
+
+    uint8_t prgRAM[PRG_RAM_SIZE];
+
+    // Snapshots. Saves PRG RAM, CHR RAM, the banks that are mapped in and the mirroring, then the mapper's registers.
+    bool Save(FILE *pFile);
+    bool Load(FILE *pFile);
+
+protected:
+    // Saves and loads the registers of a particular mapper, banks are restored from what was mapped
+    virtual bool SaveRegisters(FILE *) { return true; }
+    virtual bool LoadRegisters(FILE *) { return true; }
+
+    // Handles a write to $8000 - $FFFF
+    virtual void WriteRegister(uint16_t, uint8_t) {}
+
+    // Maps bank (counted in sizeKB units) to address. Banks past the end of the ROM wrap around.
+    void MapPRG(uint16_t address, int sizeKB, int bank);
+    void MapCHR(uint16_t address, int sizeKB, int bank);
+
+    // Number of sizeKB banks in PRG ROM
+    int PRG_Banks(int sizeKB) { return prgSize / (sizeKB * 1024); }
+
+    CPU_6502 *pCPU;
+    PPU *pPPU;
+
+    const uint8_t *pPRG;
+    uint32_t prgSize;
+    const uint8_t *prgPages[PRG_PAGES];
+
+    const uint8_t *pCHR;
+    uint32_t chrSize;
+    uint8_t *pCHR_RAM;  // pCHR if the board has 8 KB of CHR RAM instead of CHR ROM, otherwise NULL
+    TileCache *pTileCache;
+};
+
+// Mapper 0, no bank switching
+class Mapper_NROM :
+    public Mapper
+{
+public:
+    Mapper_NROM(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+};
+
+// Mapper 1, switches 16 or 32 KB of PRG and 4 or 8 KB of CHR through a serial port
+class Mapper_MMC1 :
+    public Mapper
+{
+public:
+    Mapper_MMC1(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+
+protected:
+    void WriteRegister(uint16_t address, uint8_t value);
+    bool SaveRegisters(FILE *pFile);
+    bool LoadRegisters(FILE *pFile);
+    void UpdateBanks();
+
+    uint8_t shiftRegister;  // bits are shifted in from the top, the 1 that starts at bit 4 reaches bit 0 on the fifth write
+    uint8_t control;        // CPPMM: CHR mode, PRG mode, mirroring
+    uint8_t chrBank0;
+    uint8_t chrBank1;
+    uint8_t prgBank;
+};
+
+// Mapper 2, switches 16 KB of PRG at $8000, the last bank is fixed at $C000
+class Mapper_UxROM :
+    public Mapper
+{
+public:
+    Mapper_UxROM(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+
+protected:
+    void WriteRegister(uint16_t address, uint8_t value);
+};
+
+// Mapper 3, switches 8 KB of CHR
+class Mapper_CNROM :
+    public Mapper
+{
+public:
+    Mapper_CNROM(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+
+protected:
+    void WriteRegister(uint16_t address, uint8_t value);
+};
+
+// Mapper 4, switches 8 KB PRG and 1 / 2 KB CHR banks and counts scanlines to raise IRQs
+class Mapper_MMC3 :
+    public Mapper
+{
+public:
+    Mapper_MMC3(CPU_6502 *pCPU, PPU *pPPU, iNES_File *pROM);
+
+    void Scanline();
+
+protected:
+    void WriteRegister(uint16_t address, uint8_t value);
+    bool SaveRegisters(FILE *pFile);
+    bool LoadRegisters(FILE *pFile);
+    void UpdateBanks();
+
+    uint8_t bankSelect;     // CP...RRR: CHR A12 inversion, PRG mode, register written by $8001
+    uint8_t registers[8];   // R0 - R5 are CHR banks, R6 and R7 are PRG banks
+
+    uint8_t irqLatch;
+    uint8_t irqCounter;
+    bool irqReload;
+    bool irqEnabled;
+};
@@ -11,6 +11,9 @@
 #include "NES_Controller.h"
 #include "Snapshot.h"
 #include "APU.h"
+#include "Mapper.h"
+#include "Scheduler.h"
+#include "PixelKernels.h"
 
 bool debugOutput = false;
 
@@ -122,18 +125,23 @@ void SimpleMain()
 
 Snapshot *pSnapshot;
 
-void NES_Main(char *romName)
+void NES_Main(char *romName, char *paletteName)
 {
     CPU_6502 cpu;
     
     PPU ppu(&cpu);
     ppu.PPU_Bus.isCPU_Bus = false;
 
+    // Redraw the palette display with the loaded colors
+    if (paletteName && ppu.pPalette->LoadPalFile(paletteName))
+        ppu.SetupPaletteValues();
+
     NES_Controller nesController1(&(cpu.bus));
 
-    APU apu(&cpu.bus);
+    APU apu(&cpu);
 
-    RAM ram(&(cpu.bus), 0, 0xFFff);
+    // 2 KB of work RAM, mirrored up to $1FFF
+    RAM ram(&(cpu.bus), 0, 0x1FFF, 0x800);
 
     const char *ROM_Name = "Super Mario Bros. (World).nes";
     //const char *ROM_Name = "02-branch_wrap.nes";
@@ -146,19 +154,15 @@ void NES_Main(char *romName)
     // Patch SMB to always return 9 lives
     /*if (strcmp(ROM_Name, "Super Mario Bros. (World).nes") == 0)
     {
-        cpu.bus.patchRead = true;
-        cpu.bus.patchedAddress = 0x75A;
-        cpu.bus.patchedData = 8;
+        cpu.bus.patchRead(0x75A, 8);
     }*/
 
     // Patch donkey kong to always return 2 lives
     if (strcmp(ROM_Name, "DK.nes") == 0)
     {
-        cpu.bus.patchRead = true;
-        cpu.bus.patchedAddress = 0x55;
-        cpu.bus.patchedData = 2;
+        cpu.bus.patchRead(0x55, 2);
     }
-    
+
     //iNES_File ROM("01-basics.nes");
     //iNES_File ROM("05-zp_xy.nes");
     //iNES_File ROM("03-dummy_reads.nes");
@@ -172,31 +176,19 @@ void NES_Main(char *romName)
     //iNES_File ROM("Popeye.nes");
     //iNES_File ROM("Ice Climber (USA, Europe).nes");
 
-    // Create snapshot for this ROM
-    pSnapshot = new Snapshot(ROM_Name, &ram, &cpu, &ppu);
+    // The mapper maps PRG and CHR straight out of the ROM image
+    Mapper *pMapper = Mapper::Create(&cpu, &ppu, &ROM);
+    if (!pMapper)
+        return;
 
-    // TEMP:
-    // Insert the prg data into the RAM
-    switch (ROM.prgSize)
-    {
-        case (32 * 1024):
-            memcpy(&ram.mem[0x8000], ROM.pPRGdata, ROM.prgSize);
-            break;
-        case (16 * 1024):
-            memcpy(&ram.mem[0x8000], ROM.pPRGdata, ROM.prgSize);
-            memcpy(&ram.mem[0xC000], ROM.pPRGdata, ROM.prgSize);
-            break;
-        default:
-            printf("Don't know how to map this ROM!\n");
-            return;
-    }
+    // Create snapshot for this ROM
+    pSnapshot = new Snapshot(ROM_Name, &ram, &cpu, &ppu, pMapper);
 
-    // TEMP:
-    // Insert the CHR data into the PPU pattern table
-    memcpy(ppu.pPatternTable->mem, ROM.pCHRdata, ROM.chrRomSize);
+    // Runs the system from one timed event to the next
+    Scheduler scheduler(&cpu, &ppu, &apu);
 
     // Create the status monitor
-    StatusMonitor statusMonitor(&ram, &cpu, &ppu, &apu, &nesController1);
+    StatusMonitor statusMonitor(&ram, &cpu, &ppu, &apu, &nesController1, &scheduler);
 
     cpu.Reset();
 
@@ -204,19 +196,35 @@ void NES_Main(char *romName)
     {
 
     }
+
+    delete pMapper;
 }
 #endif
 
 int main(int argc, char* argv[])
 {
+    // My_NES -benchmark times the rendering kernels instead of running a ROM
+    if (argc > 1 && strcmp(argv[1], "-benchmark") == 0)
+    {
+        BenchmarkPixelKernels();
+        return 0;
+    }
+
+    SelectPixelKernels();
+
     char buffer[_MAX_PATH] = { 0 };
-    if (argc > 0)
+    if (argc > 1)
         strcpy(buffer, argv[1]);
 
+    // An optional .pal file can follow the ROM name
+    char *paletteName = NULL;
+    if (argc > 2)
+        paletteName = argv[2];
+
 #ifdef SYSTEM_SIMPLE
     SimpleMain();
 #else
-    NES_Main(buffer);
+    NES_Main(buffer, paletteName);
 #endif
 
     return 0;
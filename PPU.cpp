@@ -1,19 +1,40 @@
 #include "PPU.h"
 #include "StatusMonitor.h"
+#include "PixelKernels.h"
+#include "Scheduler.h"
+#include <string.h>
 
 
 // PPU is mapped from 0x2000 - 0x3FFF on the CPU bus
 PPU::PPU(CPU_6502 *pCPU)
     : Peripheral(&pCPU->bus, 0x2000, 0x3FFF)
 {
+    this->pCPU = pCPU;
+    pScheduler = NULL;
+
+    // Nothing is drawn until the Scheduler starts the first frame
+    frameStartClock = 0;
+    renderedLines = VISIBLE_SCANLINES;
+    memset(frameBuffer, 0, sizeof(frameBuffer));
+    memset(lineMask, 0, sizeof(lineMask));
+    memset(backgroundOpaque, 0, sizeof(backgroundOpaque));
+    evaluatedHeight = 0;
+    firstOverflowLine = VISIBLE_SCANLINES;
+    sprite0HitTime = NO_SPRITE0_HIT;
+    tilePalettesDirty[0] = tilePalettesDirty[1] = true;
+
     // Map OAMDMA register in the CPU bus
     pCPU->bus.attachPeripheral(OAMDMA, OAMDMA, this);
 
-    // 8 KB pattern table
-    pPatternTable = new RAM(&PPU_Bus, 0, 0x1FFF);
+    // The 8 KB pattern table is mapped by the cartridge
+    memset(patternPages, 0, sizeof(patternPages));
+    memset(patternTiles, 0, sizeof(patternTiles));
+    pTileCache = NULL;
+    pMapper = NULL;
  
-    // 2 KB name table
-    pNameTable = new RAM(&PPU_Bus, 0x2000, 0x27FF, 2048);
+    // 2 KB name table, mirrored up to $2FFF
+    pNameTable = new RAM(&PPU_Bus, 0x2000, 0x2FFF, 2048);
+    SetMirroring(MIRROR_VERTICAL);
 
     // 256 bytes of palette data
     pPalette = new Palette(&PPU_Bus);
@@ -66,10 +87,7 @@ PPU::PPU(CPU_6502 *pCPU)
                                              0x0000FF00,
                                              0x000000FF);
 
-    scanline = 0;
     paused = false;
-    lowByteActive = false;
-    this->pCPU = pCPU;
     statusReg.entireRegister = 0;
     controlReg.entireRegister = 0;
     maskReg.entireRegister = 0;
@@ -77,17 +95,8 @@ PPU::PPU(CPU_6502 *pCPU)
     uninitialized = 1;
     oddFrame = false;
 
-    for (int i = 0; i < SCANLINES; ++i)
-    {
-        scrollX_ForScanline[i] = 0;
-        controlReg_ForScanline[i] = 0;
-    }
-
-    lastValidScanlineForScroll = 0;
-    lastValidScanlineForControl = 0;
-
-    scrollY = 0;
-    writingToScrollY = false;
+    memset(&scroll, 0, sizeof(scroll));
+    SyncRenderState();
 
     // Setup vertical mirroring, horizontal scrolling
     verticalMirrorOffset = 0;
@@ -104,7 +113,90 @@ PPU::~PPU()
 
     delete pPalette;
     delete pNameTable;
-    delete pPatternTable;
+}
+
+// The line the CPU has reached, worked out from the master clock so nothing has to count lines as they go by
+int PPU::CurrentScanline()
+{
+    uint64_t now = pCPU->BusClock();
+    if (now < frameStartClock)
+        return 0;
+
+    uint64_t line = (now - frameStartClock) / BUS_CLOCKS_PER_SCANLINE;
+    if (line >= SCANLINES)
+        return SCANLINES - 1;
+
+    return (int)line;
+}
+
+void PPU::SetMirroring(MIRRORING mirroring)
+{
+    // Lines the CPU has already gone past are drawn with the old mirroring
+    CatchUp();
+    this->mirroring = mirroring;
+
+    // Which KB of nametable RAM each logical nametable uses
+    static const int physicalTables[4][4] = { { 0, 0, 1, 1 },     // MIRROR_HORIZONTAL
+                                              { 0, 1, 0, 1 },     // MIRROR_VERTICAL
+                                              { 0, 0, 0, 0 },     // MIRROR_SINGLE_LOWER
+                                              { 1, 1, 1, 1 } };   // MIRROR_SINGLE_UPPER
+
+    for (int i = 0; i < 4; ++i)
+    {
+        nametablePages[i] = &pNameTable->mem[physicalTables[mirroring][i] * 0x400];
+        nametablePalettes[i] = tilePalettes[physicalTables[mirroring][i]];
+
+        uint16_t address = 0x2000 + i * 0x400;
+        PPU_Bus.mapPages(address, address + 0x3FF, nametablePages[i], nametablePages[i]);
+    }
+}
+
+// Applies a register access to Loopy's scroll registers. The CPU's copy sees it straight away, the renderer's copy
+// when the write log is replayed.
+static void UpdateScrollRegisters(SCROLL_REGS &scroll, uint8_t reg, uint8_t value)
+{
+    switch (reg)
+    {
+        case PPUCTRL:
+            // Nametable select
+            scroll.t = (scroll.t & ~0x0C00) | ((value & 3) << 10);
+            break;
+
+        case PPUSTATUS:
+            // Reading PPUSTATUS resets the write toggle
+            scroll.writeToggle = false;
+            break;
+
+        case PPUSCROLL:
+            if (!scroll.writeToggle)
+            {
+                // Coarse X and fine X
+                scroll.t = (scroll.t & ~0x001F) | (value >> 3);
+                scroll.fineX = value & 7;
+            }
+            else
+            {
+                // Coarse Y and fine Y
+                scroll.t = (scroll.t & ~0x73E0) | ((value & 0xF8) << 2) | ((value & 7) << 12);
+            }
+            scroll.writeToggle = !scroll.writeToggle;
+            break;
+
+        case PPUADDR:
+            if (!scroll.writeToggle)
+            {
+                // High byte, bit 14 is cleared
+                scroll.t = (scroll.t & 0x00FF) | ((value & 0x3F) << 8);
+            }
+            else
+            {
+                // Low byte, and the whole address is copied to v
+                scroll.t = (scroll.t & 0xFF00) | value;
+                scroll.v = scroll.t;
+            }
+            scroll.writeToggle = !scroll.writeToggle;
+            break;
+    }
 }
 
 uint8_t PPU::read(uint16_t address)
@@ -120,6 +212,7 @@ uint8_t PPU::read(uint16_t address)
     address &= 0x7;
 
     uint8_t data = 0;
+    uint16_t VRAM_Address;
   
     switch (address)
     {
@@ -135,8 +228,13 @@ uint8_t PPU::read(uint16_t address)
             // VSO - ----vblank(V), sprite 0 hit(S), sprite overflow(O); read resets write pair for $2005 / $2006
             data = statusReg.entireRegister;
             statusReg.vBlank = false;
-            lowByteActive = false;
-            writingToScrollY = false;
+
+            // Games poll PPUSTATUS, so only log the reads that change anything
+            if (scroll.writeToggle)
+            {
+                UpdateScrollRegisters(scroll, PPUSTATUS, 0);
+                LogWrite(PPUSTATUS, 0);
+            }
             break;
 
         case OAMADDR:
@@ -159,14 +257,9 @@ uint8_t PPU::read(uint16_t address)
         case PPUDATA:
             // dddd dddd	PPU data read / write
             //paused = true;
+            VRAM_Address = GetVRAM_Address();
             //printf("PPUDATA read from 0x%X\n", VRAM_Address);
 
-            if (VRAM_Address >= 0x3000 && VRAM_Address <= 0x3EFF)
-            {
-                printf("Mirroring 0x%X - ", VRAM_Address);
-                VRAM_Address -= 0x1000;
-            }
-
             if (VRAM_Address >= 0x2000 && VRAM_Address <= 0x23FF)
             {
                 printf("W Nametable 0 - 0x%X\n", VRAM_Address);
@@ -193,12 +286,11 @@ uint8_t PPU::read(uint16_t address)
                 data = readBuffer;
 
             if (controlReg.VRAM_AddressIncBy32)
-                VRAM_Address += 32;
+                scroll.v += 32;
             else
-                ++VRAM_Address;
+                ++scroll.v;
 
-            // TODO: Mirroring
-            VRAM_Address &= 0x3FFF;
+            scroll.v &= 0x7FFF;
 
             break;
 
@@ -211,18 +303,52 @@ uint8_t PPU::read(uint16_t address)
 }
 
 void PPU::write(uint16_t address, uint8_t value)
+{
+    WriteRegister<false>(address, value);
+}
+
+void PPU::writeTraced(uint16_t address, uint8_t value)
+{
+    WriteRegister<true>(address, value);
+}
+
+// Instantiated with and without trace output, so the untraced version doesn't test debugOutput
+template<bool trace>
+void PPU::WriteRegister(uint16_t address, uint8_t value)
 {
     if (address == OAMDMA)
     {
+        // Sprites the CPU has already gone past are drawn from the old OAM
+        CatchUp();
+
         //printf("OAMDMA written: 0x%X\n", value);
         //paused = true;
-        uint8_t *dest = (uint8_t*)OAM_Memory;
-        dest += OAM_Address;
-        uint8_t *end = (uint8_t*)&OAM_Memory[64];
-
+        uint8_t *pOAM = (uint8_t *)OAM_Memory;
         uint16_t srcAddr = (uint16_t)value << 8;
-        for (int i = 0; i < 256 && dest < end; ++i, ++dest, ++srcAddr)
-            *dest = pCPU->bus.read(srcAddr);
+
+        // Plain RAM and ROM are copied straight from the page, I/O has to be read a byte at a time.
+        // Either way the bytes go through OAMDATA, so they wrap around from OAM_Address.
+        const uint8_t *pSource = pCPU->bus.readablePage(value);
+        if (pSource)
+        {
+            int firstPart = 256 - OAM_Address;
+            memcpy(pOAM + OAM_Address, pSource, firstPart);
+            memcpy(pOAM, pSource + firstPart, OAM_Address);
+        }
+        else
+        {
+            for (int i = 0; i < 256; ++i)
+                pOAM[(OAM_Address + i) & 0xFF] = pCPU->bus.read(srcAddr + i);
+        }
+
+        evaluatedHeight = 0;
+        if (pScheduler)
+            pScheduler->ScheduleSpriteEvents();
+
+        // The CPU is halted while the 256 bytes are read and written, plus a cycle to wait for the write, plus one more
+        // if it has to line up with a read cycle. That depends on the cycle after the write, not the instruction's start.
+        uint64_t haltClock = pCPU->clocks + pCPU->writeCycle + 1;
+        pCPU->Stall(OAM_DMA_CYCLES + (haltClock & 1));
 
         /*printf("OAM now:\n");
         for (int i = 0; i < 64; ++i)
@@ -243,11 +369,11 @@ void PPU::write(uint16_t address, uint8_t value)
     address &= 0x7;
 
     //printf("PPU reg %d - 0x%X\n", address, value);
-    uint8_t prevControlReg;
-    int i;
+    uint16_t VRAM_Address;
     switch (address)
     {
         case PPUCTRL:
+        {
             // 	VPHB SINN	NMI enable(V), PPU master / slave(P), sprite height(H), background tile select(B), sprite tile select(S), increment mode(I), nametable select(NN)
             
             // Program can generate multiple NMI's by toggling controlReg.generateNMI_OnVBlank and not reading PPUSTATUS during VBlank
@@ -259,23 +385,29 @@ void PPU::write(uint16_t address, uint8_t value)
                     pCPU->TriggerNMI();
             }
 
+            // Sprite 0 and overflow were looked ahead with the old sprite height
+            bool oldSpriteSize = controlReg.spriteSize;
+
             controlReg.entireRegister = value;
+            UpdateScrollRegisters(scroll, PPUCTRL, value);
+            LogWrite(PPUCTRL, value);
 
-            prevControlReg = controlReg_ForScanline[lastValidScanlineForControl];
-            for (i = lastValidScanlineForControl; i < scanline; ++i)
-                controlReg_ForScanline[i] = prevControlReg;
-            for (i = scanline; i < SCANLINES; ++i)
-                controlReg_ForScanline[i] = value;
-            lastValidScanlineForControl = scanline;
+            if (pScheduler && controlReg.spriteSize != oldSpriteSize)
+            {
+                CatchUp();
+                pScheduler->ScheduleSpriteEvents();
+            }
             
-            if(debugOutput)
+            if (trace)
                 printf("PPUCTRL: 0x%X\n", value);
 
             break;
+        }
 
         case PPUMASK:
             // 	BGRs bMmG	color emphasis(BGR), sprite enable(s), background enable(b), sprite left column enable(M), background left column enable(m), greyscale(G)
             maskReg.entireRegister = value;
+            LogWrite(PPUMASK, value);
             break;
 
         case  PPUSTATUS:
@@ -290,70 +422,30 @@ void PPU::write(uint16_t address, uint8_t value)
 
         case OAMDATA:
             // 	dddd dddd	OAM data read / write
-            printf("OAM Data written\n");
+            CatchUp();
+            ((uint8_t *)OAM_Memory)[OAM_Address] = value;
+            OAM_Address = (OAM_Address + 1) & 0xFF;
+            evaluatedHeight = 0;
+            if (pScheduler)
+                pScheduler->ScheduleSpriteEvents();
             break;
 
         case PPUSCROLL:
             // xxxx xxxx	fine scroll position(two writes : X scroll, Y scroll)
-            //printf("Scroll written on line %d 0x%X\n", scanline, value);
-            if (writingToScrollY)
-                scrollY = value;
-            else
-            {
-                uint8_t prevScrollX = scrollX_ForScanline[lastValidScanlineForScroll];
-                for (i = lastValidScanlineForScroll; i < scanline; ++i)
-                    scrollX_ForScanline[i] = prevScrollX;
-                for (i = scanline; i < SCANLINES; ++i)
-                    scrollX_ForScanline[i] = value;
-                lastValidScanlineForScroll = scanline;
-                //printf("Scanline: %d - Scroll: (%d, %d)\n", scanline, scrollX_ForScanline[scanline], scrollY);
-            }
-
-            writingToScrollY = !writingToScrollY;
-
+            UpdateScrollRegisters(scroll, PPUSCROLL, value);
+            LogWrite(PPUSCROLL, value);
             break;
 
         case PPUADDR:
             // aaaa aaaa	PPU read / write address(two writes : most significant byte, least significant byte)
-            if(debugOutput)
-                printf("0x%X - ", value);
-            
-            if (lowByteActive)
-            {
-                if(debugOutput)
-                    printf("low byte active\n");
-
-                VRAM_Address += value;
-                
-                
-                //printf("PPU Address: 0x%X ", VRAM_Address);
-
-                // Handle nametable mirroring
-                if (VRAM_Address >= 0x3000 && VRAM_Address <= 0x3EFF)
-                {
-                    VRAM_Address -= 0x1000;
-                    //printf("M 0x%X\n", VRAM_Address);
-                }
-                //else
-                  //  printf("\n");
-            }
-            else
-            {
-                if (debugOutput)
-                    printf("high byte active\n");
-                VRAM_Address = (uint16_t)value << 8;
-            }
+            if (trace)
+                printf("0x%X - %s byte\n", value, scroll.writeToggle ? "low" : "high");
 
-            lowByteActive = !lowByteActive;
+            UpdateScrollRegisters(scroll, PPUADDR, value);
+            LogWrite(PPUADDR, value);
 
-            if (debugOutput)
-                printf("PPUADDR 0x%X\n", VRAM_Address);
-
-            // Handle mirroring of VRAM_Address
-            //VRAM_Address &= 0x3FFF;
-            /*
-            if (VRAM_Address >= 0x3F00 && VRAM_Address <= 0x3EFF)
-                VRAM_Address -= 0x1000;*/
+            if (trace)
+                printf("PPUADDR 0x%X\n", scroll.v);
 
             //paused = true;
             break;
@@ -365,38 +457,22 @@ void PPU::write(uint16_t address, uint8_t value)
 
             printf("control reg: 0x%X\n", controlReg.entireRegister);*/
 
-            if (VRAM_Address >= 0x3000 && VRAM_Address <= 0x3EFF)
-            {
-                printf("Mirroring 0x%X - ", VRAM_Address);
-                VRAM_Address -= 0x1000;
-            }
+            // Lines the CPU has already gone past are drawn from the old VRAM
+            CatchUp();
 
-            /*if (VRAM_Address >= 0x2000 && VRAM_Address <= 0x23FF)
-            {
-                printf("W Nametable 0 - 0x%X\n", VRAM_Address);
-            }
-            else if (VRAM_Address >= 0x2400 && VRAM_Address <= 0x27FF)
-            {
-                printf("W Nametable 1 - 0x%X\n", VRAM_Address);
-            }
-            if (VRAM_Address >= 0x2800 && VRAM_Address <= 0x2BFF)
-            {
-                printf("W Nametable 2 - 0x%X\n", VRAM_Address);
-            }
-            else if (VRAM_Address >= 0x2C00 && VRAM_Address <= 0x2FFF)
-            {
-                printf("W Nametable 3 - 0x%X\n", VRAM_Address);
-            }
-            */
-            PPU_Bus.write(VRAM_Address, value);
+            VRAM_Address = GetVRAM_Address();
+            PPU_Bus.write<trace>(VRAM_Address, value);
+
+            // The renderer has to expand the attribute table again
+            if (VRAM_Address >= 0x2000 && VRAM_Address <= 0x2FFF && (VRAM_Address & 0x3FF) >= 0x3C0)
+                tilePalettesDirty[(GetNametableData(VRAM_Address) - pNameTable->mem) >> 10] = true;
             
             if (controlReg.VRAM_AddressIncBy32)
-                VRAM_Address += 32;
+                scroll.v += 32;
             else
-                ++VRAM_Address;
+                ++scroll.v;
 
-            if (VRAM_Address > 0x3FFF)
-                printf("\nVRAM Address incremented beyond 0x3FFF\n\n");
+            scroll.v &= 0x7FFF;
 
             break;
 
@@ -406,12 +482,65 @@ void PPU::write(uint16_t address, uint8_t value)
     }
 }
 
-void PPU::CopyTileToImage(uint8_t tileNumber, int tileX, int fineX, int tileY, uint32_t *pPixels, int pixelsPerRow, int paletteNumber)
+// $3000 - $3EFF mirrors the nametables
+uint16_t PPU::GetVRAM_Address()
+{
+    uint16_t address = scroll.v & 0x3FFF;
+    if (address >= 0x3000 && address <= 0x3EFF)
+        address -= 0x1000;
+
+    return address;
+}
+
+// O(1), the renderer replays the log when it catches up
+void PPU::LogWrite(uint8_t reg, uint8_t value)
 {
-    // Tiles are stored LSB of an entire tile followed by MSB of an entire tile
-    uint8_t tileLSB[8];
-    uint8_t tileMSB[8];
+    // Rather than lose a write, apply the oldest one early
+    if (logCount == PPU_WRITE_LOG_SIZE)
+    {
+        CatchUp();
+        if (logCount == PPU_WRITE_LOG_SIZE)
+            ReplayWrites(writeLog[logStart].time + 1);
+    }
+
+    PPU_REGISTER_WRITE &entry = writeLog[(logStart + logCount) & (PPU_WRITE_LOG_SIZE - 1)];
+    entry.time = pCPU->BusClock();
+    entry.reg = reg;
+    entry.value = value;
+    ++logCount;
+}
+
+// Applies the logged writes from before time to the renderer's registers
+void PPU::ReplayWrites(uint64_t time)
+{
+    while (logCount && writeLog[logStart].time < time)
+    {
+        PPU_REGISTER_WRITE &entry = writeLog[logStart];
+
+        if (entry.reg == PPUCTRL)
+            renderControl.entireRegister = entry.value;
+        else if (entry.reg == PPUMASK)
+            renderMask.entireRegister = entry.value;
+
+        UpdateScrollRegisters(renderScroll, entry.reg, entry.value);
 
+        logStart = (logStart + 1) & (PPU_WRITE_LOG_SIZE - 1);
+        --logCount;
+    }
+}
+
+// Snapshots and power on set the registers directly, the renderer starts from them with nothing logged
+void PPU::SyncRenderState()
+{
+    renderScroll = scroll;
+    renderControl = controlReg;
+    renderMask = maskReg;
+    logStart = 0;
+    logCount = 0;
+}
+
+void PPU::CopyTileToImage(uint8_t tileNumber, int tileX, int fineX, int tileY, uint32_t *pPixels, int pixelsPerRow, int paletteNumber)
+{
     uint32_t pixelOffset = tileY * pixelsPerRow * 8 + tileX * 8 - fineX;
     int tileWidth = 8;
     int startPixel = 0;
@@ -437,44 +566,25 @@ void PPU::CopyTileToImage(uint8_t tileNumber, int tileX, int fineX, int tileY, u
             pixelOffset += 8;
     }
 
-    uint32_t patternOffset = tileNumber * 16;
-
-    uint8_t *pPatternMemory = pPatternTable->mem;
+    uint16_t patternAddress = tileNumber * 16;
 
     if (controlReg.backgroundPatternTableSelect)
-        pPatternMemory += 0x1000;
+        patternAddress += 0x1000;
 
-    // Get palette data for the tile
-    uint32_t colors[4];
-    // TODO: mapping palette to RGBA values could happen when palette is written to, offering an optimization
-    colors[0] = paletteColorValues[pPalette->paletteMem.universalBackground];
-    colors[1] = paletteColorValues[pPalette->paletteMem.paletteTable[paletteNumber].colors[0]];
-    colors[2] = paletteColorValues[pPalette->paletteMem.paletteTable[paletteNumber].colors[1]];
-    colors[3] = paletteColorValues[pPalette->paletteMem.paletteTable[paletteNumber].colors[2]];
-
-    // Extract data for the tile, bitplane of low bits is stored before bitplane of high bits
-    SDL_memcpy(tileLSB, pPatternMemory + patternOffset, 8);
-    SDL_memcpy(tileMSB, pPatternMemory + patternOffset + 8, 8);
+    const uint8_t *pTile = GetTilePixels(patternAddress);
 
-    // Copy pixels
-    uint8_t pixels[8];
+    // Get palette data for the tile, entry 0 of every palette is the universal background
+    uint32_t colors[4];
+    colors[0] = pPalette->resolvedColors[0];
+    colors[1] = pPalette->resolvedColors[paletteNumber * 4 + 1];
+    colors[2] = pPalette->resolvedColors[paletteNumber * 4 + 2];
+    colors[3] = pPalette->resolvedColors[paletteNumber * 4 + 3];
 
     // for each row
     for (int y = 0; y < 8; ++y)
     {
-        uint8_t lowBytes = tileLSB[y];
-        uint8_t highBytes = tileMSB[y];
-
-        // Determine palette value of each of the 8 pixels in the tile row
-        pixels[7] = lowBytes & 1 | ((highBytes & 1) << 1);
-        pixels[6] = (lowBytes & 2) >> 1 | (highBytes & 2);
-        pixels[5] = (lowBytes & 4) >> 2 | ((highBytes & 4) >> 1);
-        pixels[4] = (lowBytes & 8) >> 3 | ((highBytes & 8) >> 2);
-        pixels[3] = (lowBytes & 0x10) >> 4 | ((highBytes & 0x10) >> 3);
-        pixels[2] = (lowBytes & 0x20) >> 5 | ((highBytes & 0x20) >> 4);
-        pixels[1] = (lowBytes & 0x40) >> 6 | ((highBytes & 0x40) >> 5);
-        pixels[0] = (lowBytes & 0x80) >> 7 | ((highBytes & 0x80) >> 6);
-        
+        const uint8_t *pixels = pTile + y * 8;
+
         // Plot pixels to the image buffer
         for (int pixX = startPixel; pixX < tileWidth; ++pixX)
             pPixels[pixelOffset++] = colors[pixels[pixX]];
@@ -487,109 +597,10 @@ void PPU::CopyTileToImage(uint8_t tileNumber, int tileX, int fineX, int tileY, u
     }
 }
 
-void PPU::DrawSprite(uint8_t tileNumber, int x, int y, uint32_t * pPixels, OAM_ATTRIBUTES_BYTE attributes)
-{
-    int paletteNumber = attributes.paletteNumber + 4;
-    bool flipHorizontal = attributes.flipHorizontally;
-    bool flipVertical = attributes.flipVertically;
-    bool drawBehindBackground = attributes.drawBehindBackground;
-
-    // Tiles are stored LSB of an entire tile followed by MSB of an entire tile
-    uint8_t tileLSB[8];
-    uint8_t tileMSB[8];
-
-    uint32_t pixelOffset = y * 256 + x;
-
-    // Don't let sprites go off the bottom of the screen
-    int tileHeight = 8;
-    if (y + tileHeight >= 240)
-        tileHeight = (240 - y);
-
-    // Don't let sprites go off the right edge of the screen
-    int tileWidth = 8;
-    if (x + tileWidth >= 256)
-        tileWidth = (256 - x);
-
-    uint32_t patternOffset = tileNumber * 16;
-
-    uint8_t *pPatternMemory = pPatternTable->mem;
-
-    if (controlReg.spritePatternTableSelect)
-        pPatternMemory += 0x1000;
-
-    // Get color data for the tile
-    uint32_t colors[4];
-    // TODO: mapping palette to RGBA values could happen when palette is written to, offering an optimization
-    colors[0] = 0;
-    colors[1] = paletteColorValues[pPalette->paletteMem.paletteTable[paletteNumber].colors[0]];
-    colors[2] = paletteColorValues[pPalette->paletteMem.paletteTable[paletteNumber].colors[1]];
-    colors[3] = paletteColorValues[pPalette->paletteMem.paletteTable[paletteNumber].colors[2]];
-
-    // Determine the color of empty background (only used by sprites drawn behind background objects)
-    uint32_t emptyBackgroundColor = paletteColorValues[pPalette->paletteMem.universalBackground];
-
-    // Extract data for the tile, bitplane of low bits is stored before bitplane of high bits
-    SDL_memcpy(tileLSB, pPatternMemory + patternOffset, 8);
-    SDL_memcpy(tileMSB, pPatternMemory + patternOffset + 8, 8);
-
-    // Determine how rows of pixels should be evaluated; top-down or bottom-up
-    int yChange = 1;
-    int yStart = 0;
-    int yDone = tileHeight;
-    if (flipVertical)
-    {
-        yChange = -1;
-        yStart = tileHeight - 1;
-        yDone = -1;
-    }
-    
-    // Copy each each row of pixels
-    for (int y = yStart; y != yDone; y += yChange)
-    {
-        uint8_t lowBytes = tileLSB[y];
-        uint8_t highBytes = tileMSB[y];
-        uint8_t pixels[8];
-
-        // Determine the color of each pixel
-        pixels[0] = lowBytes & 1 | ((highBytes & 1) << 1);
-        pixels[1] = (lowBytes & 2) >> 1 | (highBytes & 2);
-        pixels[2] = (lowBytes & 4) >> 2 | ((highBytes & 4) >> 1);
-        pixels[3] = (lowBytes & 8) >> 3 | ((highBytes & 8) >> 2);
-        pixels[4] = (lowBytes & 0x10) >> 4 | ((highBytes & 0x10) >> 3);
-        pixels[5] = (lowBytes & 0x20) >> 5 | ((highBytes & 0x20) >> 4);
-        pixels[6] = (lowBytes & 0x40) >> 6 | ((highBytes & 0x40) >> 5);
-        pixels[7] = (lowBytes & 0x80) >> 7 | ((highBytes & 0x80) >> 6);
-
-        if (drawBehindBackground)
-        {
-            // Check each sprite pixel against what's already on the screen
-            for (int i = 0; i < tileWidth; ++i)
-            {
-                // Make the sprite's pixel transparent if there's something on the background
-                if (pPixels[pixelOffset + i] != emptyBackgroundColor)
-                    flipHorizontal ? pixels[i] = 0 : pixels[7 - i] = 0;
-            }
-        }
-
-        // Copy the pixels that aren't transparent
-        if (flipHorizontal)
-        {
-            for(int i = 0; i < tileWidth; ++i)
-                pixels[i] ? pPixels[pixelOffset++] = colors[pixels[i]] : ++pixelOffset;
-        }
-        else
-        {
-            for (int i = 0; i < tileWidth; ++i)
-                pixels[7 - i] ? pPixels[pixelOffset++] = colors[pixels[7 - i]] : ++pixelOffset;
-        }
-
-        pixelOffset += 256 - tileWidth;
-    }
-}
-
 void PPU::DrawNametables()
 {
     SDL_LockSurface(pNametableSurface);
+    ExpandAttributes();
 
     uint32_t pixelOffset = 0;
 
@@ -624,10 +635,10 @@ void PPU::DrawNametables()
                 nametableOffset = 0;
             }
 
-            uint8_t tileID = pNameTable->mem[nametableBase + nametableOffset + (y + yOffset) * 32 + x + xOffset];
+            uint8_t tileID = *GetNametableData(nametableBase + nametableOffset + (y + yOffset) * 32 + x + xOffset);
 
             // Get palette number for the current tile (1-4)
-            int paletteNumber = GetPaletteNumberForTile(x + xOffset, (y + yOffset), nametableBase + nametableOffset);
+            int paletteNumber = GetTilePalette(nametableBase + nametableOffset + (y + yOffset) * 32 + x + xOffset);
 
             // Copy tile to image x, y
             CopyTileToImage(tileID, x, 8, y, pPixels, NAMETABLE_RES_X, paletteNumber);
@@ -637,194 +648,357 @@ void PPU::DrawNametables()
     SDL_UnlockSurface(pNametableSurface);
 }
 
-int PPU::GetPaletteNumberForTile(int x, int y, uint16_t nametableBase)
+void PPU::ExpandAttributes()
+{
+    for (int table = 0; table < 2; ++table)
+    {
+        if (!tilePalettesDirty[table])
+            continue;
+
+        // Each attribute byte covers 4x4 tiles, 2 bits for each 2x2 quadrant
+        const uint8_t *pAttributes = &pNameTable->mem[table * 0x400 + 0x3C0];
+        uint8_t *pPalettes = tilePalettes[table];
+        for (int y = 0; y < 32; ++y)
+        {
+            for (int x = 0; x < 32; ++x)
+            {
+                uint8_t attribute = pAttributes[(y >> 2) * 8 + (x >> 2)];
+                pPalettes[y * 32 + x] = (attribute >> (((y & 2) << 1) | (x & 2))) & 3;
+            }
+        }
+
+        tilePalettesDirty[table] = false;
+    }
+}
+
+void PPU::StartFrame(uint64_t frameStart)
 {
-    // The palette entry defines the palette for four 2x2 sets of tiles.
-    // determine which of the four quadrants the tile is occupying
-    int quadX = (x & 3) / 2;    // 0 for left quadrant, 1 for right
-    int quadY = (y & 3) / 2;    // 0 for top quadrant, 1 for bottom
+    frameStartClock = frameStart;
+    renderedLines = 0;
+    sprite0HitTime = NO_SPRITE0_HIT;
+}
 
-    // Get first entry into palette table
-    ATTRIBUTE_TABLE_ENTRY *pEntry = (ATTRIBUTE_TABLE_ENTRY *)(&pNameTable->mem[nametableBase + 0x3C0]);
+/*
+The PPU sits idle while the CPU runs. Writes to the registers that control rendering are logged with the time they
+happened, and the lines the CPU has gone past are only drawn when something that isn't logged is about to change (VRAM,
+OAM, a bank switch or a mirroring change), or when the Scheduler needs them (VBlank, sprite 0). Each line replays the
+log up to where the real PPU would pick up its scroll, so split scrolling and mid-frame pattern table switches work.
+*/
+void PPU::CatchUp()
+{
+    // Nothing left to draw until the next frame starts
+    if (renderedLines >= VISIBLE_SCANLINES || pCPU->BusClock() < frameStartClock)
+        return;
 
-    // Advance to palette number for this tile
-    x /= 4;
-    y /= 4;
-    pEntry += (y * 8) + (x);
+    int lastLine = CurrentScanline();
+    if (lastLine >= VISIBLE_SCANLINES)
+        lastLine = VISIBLE_SCANLINES - 1;
 
-    // return the palette entry for the proper quadrant
-    if ((quadX == 0) && (quadY == 0))
-        return pEntry->topLeftPaletteIndex;
+    if (lastLine < renderedLines)
+        return;
 
-    if ((quadX == 1) && (quadY == 0))
-        return pEntry->topRightPaletteIndex;
+    for (; renderedLines <= lastLine; ++renderedLines)
+    {
+        uint64_t lineStart = frameStartClock + renderedLines * BUS_CLOCKS_PER_SCANLINE;
 
-    if ((quadX == 0) && (quadY == 1))
-        return pEntry->bottomLeftPaletteIndex;
+        if (renderedLines == 0)
+        {
+            // The pre-render line reloads the horizontal scroll on dot 257 and the vertical scroll on dots 280 - 304
+            ReplayWrites(lineStart - (BUS_CLOCKS_PER_SCANLINE - 257));
+            if (renderMask.showBackground || renderMask.showSprites)
+                renderScroll.v = (renderScroll.v & ~0x041F) | (renderScroll.t & 0x041F);
+
+            ReplayWrites(lineStart - (BUS_CLOCKS_PER_SCANLINE - 304));
+            if (renderMask.showBackground || renderMask.showSprites)
+                renderScroll.v = (renderScroll.v & ~0x7BE0) | (renderScroll.t & 0x7BE0);
+        }
+        else
+        {
+            // The line before moved down on dot 256 and reloaded the horizontal scroll on dot 257
+            ReplayWrites(lineStart - (BUS_CLOCKS_PER_SCANLINE - 256));
+            if (renderMask.showBackground || renderMask.showSprites)
+                IncrementY(renderScroll.v);
+
+            ReplayWrites(lineStart - (BUS_CLOCKS_PER_SCANLINE - 257));
+            if (renderMask.showBackground || renderMask.showSprites)
+                renderScroll.v = (renderScroll.v & ~0x041F) | (renderScroll.t & 0x041F);
+        }
 
-    if ((quadX == 1) && (quadY == 1))
-        return pEntry->bottomRightPaletteIndex;
+        DrawScanline(renderedLines);
+        DrawSpriteLine(renderedLines);
+        lineMask[renderedLines] = renderMask.entireRegister;
+    }
 
-    printf("\nShouldn't reach here!\n");
-    return 0;
+    if (renderedLines == VISIBLE_SCANLINES)
+        ConvertFrame();
 }
 
-void PPU::UpdateImage()
+// Turns the finished frame into host pixels in pTV_Display, one table lookup per pixel
+void PPU::ConvertFrame()
 {
     SDL_LockSurface(pTV_Display);
 
-    uint32_t pixelOffset = 0;
+    for (int line = 0; line < VISIBLE_SCANLINES; ++line)
+    {
+        // Each line gets the colors for its greyscale and emphasis bits
+        uint32_t *pLine = (uint32_t *)((uint8_t *)pTV_Display->pixels + line * pTV_Display->pitch);
+        ConvertPixels(frameBuffer + line * 256, pPalette->GetColorValues(lineMask[line]), pLine, 256);
+    }
 
-    uint32_t *pPixels = (uint32_t *)pTV_Display->pixels;
-    
-    // Base nametable address controlReg.baseNametableAddress
-    // (0 = $2000; 1 = $2400; 2 = $2800; 3 = $2C00)
-    uint16_t nametableBase = 0x2000;
+    SDL_UnlockSurface(pTV_Display);
+}
 
-    // Copy background tiles from nametable
-    int yOffset = 0;
-    int xOffset = 0;
-    uint16_t nametableOffset = 0;
+// Moves v down one line, wrapping from the bottom of one nametable to the top of the one below it
+void PPU::IncrementY(uint16_t &v)
+{
+    if ((v & 0x7000) != 0x7000)
+    {
+        v += 0x1000;
+        return;
+    }
+
+    v &= ~0x7000;
+    int coarseY = (v & 0x03E0) >> 5;
+    if (coarseY == 29)
+    {
+        coarseY = 0;
+        v ^= 0x0800;
+    }
+    else if (coarseY == 31)
+    {
+        // Rows 30 and 31 are the attribute table, and wrap around without switching nametables
+        coarseY = 0;
+    }
+    else
+        ++coarseY;
+
+    v = (v & ~0x03E0) | (coarseY << 5);
+}
+
+// Draws one line of the background from the renderer's registers
+void PPU::DrawScanline(int line)
+{
+    uint8_t *pLine = frameBuffer + line * 256;
+    uint32_t *pOpaque = backgroundOpaque + line * 8;
+
+    if (!renderMask.showBackground)
+    {
+        memset(pLine, pPalette->paletteMem.universalBackground, 256);
+        memset(pOpaque, 0, 8 * sizeof(uint32_t));
+        return;
+    }
+
+    // v is yyy NN YYYYY XXXXX: fine Y, nametable, coarse Y, coarse X
+    uint16_t v = renderScroll.v;
+    int fineY = (v >> 12) & 7;
+
+    uint16_t patternBase = renderControl.backgroundPatternTableSelect ? 0x1000 : 0;
+    ExpandAttributes();
+
+    // The 4 background palettes, transparent pixels of every palette use color 0
+    uint8_t colors[16];
+    for (int palette = 0; palette < 4; ++palette)
+    {
+        colors[palette * 4] = pPalette->paletteMem.universalBackground;
+        colors[palette * 4 + 1] = pPalette->paletteMem.paletteTable[palette].colors[0];
+        colors[palette * 4 + 2] = pPalette->paletteMem.paletteTable[palette].colors[1];
+        colors[palette * 4 + 3] = pPalette->paletteMem.paletteTable[palette].colors[2];
+    }
 
-    for (int y = 0; y < 30; ++y)
+    // 33 tiles cover the line when it's scrolled part way into a tile, collected as indices into colors and a bit
+    // for each pixel that isn't transparent
+    uint8_t indices[33 * 8];
+    uint8_t opaqueBits[36] = { 0 };
+    for (int x = 0; x < 33; ++x)
     {
-        // Get the scroll x and control register values the CPU set when it was handling this set of scanlines
-        int tileX_Offset = scrollX_ForScanline[y * 8] / 8;
-        int fineX = scrollX_ForScanline[y * 8] & 0x7;
-        CONTROL_REG ctrl;
-        ctrl.entireRegister = controlReg_ForScanline[y * 8];
-        //printf("Control register: 0x%X for line %d\n", ctrl.baseNametableAddress, y * 8);
-
-        for (int x = tileX_Offset; x < 33 + tileX_Offset; ++x)
+        uint8_t tileID = *GetNametableData(0x2000 | (v & 0x0FFF));
+        int paletteNumber = GetTilePalette(v);
+
+        // Add the palette to all 8 pixels at once, skipping the transparent ones
+        uint64_t pixels;
+        memcpy(&pixels, GetTilePixels(patternBase + tileID * 16) + fineY * 8, 8);
+        uint64_t opaque = (pixels | (pixels >> 1)) & 0x0101010101010101ULL;
+        pixels |= opaque * (paletteNumber * 4);
+        memcpy(indices + x * 8, &pixels, 8);
+
+        // Gathers the low bit of each byte, leftmost pixel in bit 0
+        opaqueBits[x] = (uint8_t)((opaque * 0x0102040810204080ULL) >> 56);
+
+        // Move right one tile, wrapping into the nametable next to this one
+        if ((v & 0x001F) == 31)
         {
-            // Determine if we're drawing from nametable 0 or nametable 1
-            if (x >= 32)
-            {
-                xOffset = -32;
-                if (ctrl.baseNametableAddress == 1)
-                    nametableOffset = 0;
-                else
-                    nametableOffset = horizontalMirrorOffset;
-            }
-            else
-            {
-               xOffset = 0;
-               if (ctrl.baseNametableAddress == 1)
-                    nametableOffset = horizontalMirrorOffset;
-               else
-                    nametableOffset = 0;
-            }
+            v &= ~0x001F;
+            v ^= 0x0400;
+        }
+        else
+            ++v;
+    }
 
-            // Get the tileID from the name table
-            uint8_t tileID = pNameTable->mem[nametableBase + nametableOffset + y * 32 + x + xOffset];
+    pixelKernels.ExpandPixels(indices + renderScroll.fineX, colors, pLine, 256);
 
-            // Get palette number for the current tile (1-4)
-            int paletteNumber = GetPaletteNumberForTile(x + xOffset, y, nametableBase + nametableOffset);
+    // Line up the opaque bits with the screen too
+    for (int i = 0; i < 8; ++i)
+    {
+        const uint8_t *pBits = opaqueBits + i * 4;
+        uint64_t bits = pBits[0] | (pBits[1] << 8) | (pBits[2] << 16) | ((uint64_t)pBits[3] << 24) | ((uint64_t)pBits[4] << 32);
+        pOpaque[i] = (uint32_t)(bits >> renderScroll.fineX);
+    }
 
-            // Copy tile to image x, y
-            CopyTileToImage(tileID, x - tileX_Offset, fineX, y, pPixels, 256, paletteNumber);
+    // The leftmost 8 pixels can be hidden
+    if (!renderMask.showLeftmostBackground)
+    {
+        memset(pLine, pPalette->paletteMem.universalBackground, 8);
+        pOpaque[0] &= ~0xFF;
+    }
+}
+
+// Finds the sprites on each line, the first 8 in OAM order are drawn and any more set the overflow flag
+void PPU::EvaluateSprites(int height)
+{
+    memset(lineSpriteCount, 0, sizeof(lineSpriteCount));
+    firstOverflowLine = VISIBLE_SCANLINES;
+
+    for (int i = 0; i < 64; ++i)
+    {
+        // Sprites are drawn one line below their Y position, so line 0 never has any
+        int top = OAM_Memory[i].yPos + 1;
+        for (int line = top; line < top + height && line < VISIBLE_SCANLINES; ++line)
+        {
+            if (lineSpriteCount[line] == MAX_SPRITES_PER_LINE)
+            {
+                if (line < firstOverflowLine)
+                    firstOverflowLine = line;
+                continue;
+            }
+
+            lineSprites[line][lineSpriteCount[line]++] = i;
         }
     }
 
-    // Draw sprites
-    // Draw higher-index sprites first so lower-index sprites will overlap them
-    for (int i = 63; i >= 0; --i)
+    evaluatedHeight = height;
+}
+
+// For the Scheduler, which looks ahead from the CPU's registers
+int PPU::FirstOverflowLine()
+{
+    int height = controlReg.spriteSize ? 16 : 8;
+    if (evaluatedHeight != height)
+        EvaluateSprites(height);
+
+    return firstOverflowLine;
+}
+
+// Returns the hit time once it's been drawn, otherwise the start of the next line sprite 0 could hit on, or
+// NO_SPRITE0_HIT if there aren't any left this frame
+uint64_t PPU::NextSprite0Check()
+{
+    if (sprite0HitTime != NO_SPRITE0_HIT)
+        return sprite0HitTime;
+
+    int top = OAM_Memory[0].yPos + 1;
+    int height = controlReg.spriteSize ? 16 : 8;
+
+    int line = renderedLines > top ? renderedLines : top;
+    if (line >= top + height || line >= VISIBLE_SCANLINES)
+        return NO_SPRITE0_HIT;
+
+    return frameStartClock + line * BUS_CLOCKS_PER_SCANLINE;
+}
+
+// Draws the sprites on one line over the background
+void PPU::DrawSpriteLine(int line)
+{
+    if (!renderMask.showSprites)
+        return;
+
+    int height = renderControl.spriteSize ? 16 : 8;
+    if (evaluatedHeight != height)
+        EvaluateSprites(height);
+
+    int count = lineSpriteCount[line];
+    if (count == 0)
+        return;
+
+    // The line buffer, with a bit for each pixel that has a sprite and for each that has one behind the background
+    uint8_t colors[256];
+    uint32_t opaque[8] = { 0 };
+    uint32_t behind[8] = { 0 };
+
+    // Lower OAM indices are drawn last so they cover the others, even when they're behind the background
+    for (int n = count - 1; n >= 0; --n)
     {
-        // sprites off the screen arent drawn
-        if (OAM_Memory[i].yPos >= 0xEF)
-            continue;
+        int index = lineSprites[line][n];
+        OAM_ENTRY &sprite = OAM_Memory[index];
 
-        DrawSprite(OAM_Memory[i].tileIndex,
-                   OAM_Memory[i].xPos,
-                   OAM_Memory[i].yPos + 1,
-                   pPixels,
-                   OAM_Memory[i].attributes);
+        int row = line - (sprite.yPos + 1);
+        if (sprite.attributes.flipVertically)
+            row = height - 1 - row;
+
+        // 8x16 sprites pick their pattern table with bit 0 of the tile and use an even and odd tile
+        uint16_t patternAddress;
+        if (height == 16)
+            patternAddress = ((sprite.tileIndex & 1) ? 0x1000 : 0) + (sprite.tileIndex & 0xFE) * 16 + (row & 8) * 2;
+        else
+            patternAddress = (renderControl.spritePatternTableSelect ? 0x1000 : 0) + sprite.tileIndex * 16;
+
+        // The flipped copy of the tile is already mirrored left to right
+        const uint8_t *pixels = GetTilePixels(patternAddress, sprite.attributes.flipHorizontally) + (row & 7) * 8;
+
+        PALETTE_ENTRY &palette = pPalette->paletteMem.paletteTable[sprite.attributes.paletteNumber + 4];
+        uint32_t behindBit = sprite.attributes.drawBehindBackground ? 1 : 0;
+
+        for (int i = 0; i < 8; ++i)
+        {
+            int x = sprite.xPos + i;
+            if (x > 255)
+                break;
+
+            if (!pixels[i])
+                continue;
+
+            colors[x] = palette.colors[pixels[i] - 1];
+            opaque[x >> 5] |= 1 << (x & 31);
+            behind[x >> 5] = (behind[x >> 5] & ~(1 << (x & 31))) | (behindBit << (x & 31));
+
+            // Sprite 0 hits the first time one of its pixels covers the background, whatever its priority.
+            // Pixel x comes out on dot x + 1, and never hits on the last pixel or in a clipped left column.
+            if (index == 0 && sprite0HitTime == NO_SPRITE0_HIT && x != 255 && IsBackgroundOpaque(x, line)
+                && (x >= 8 || (renderMask.showLeftmostBackground && renderMask.showLeftmostSprites)))
+            {
+                sprite0HitTime = frameStartClock + line * BUS_CLOCKS_PER_SCANLINE + x + 1;
+            }
+        }
     }
 
-    SDL_UnlockSurface(pTV_Display);
+    if (!renderMask.showLeftmostSprites)
+        opaque[0] &= ~0xFF;
 
+    // Draw the sprite pixels the background doesn't cover
+    uint8_t *pLine = frameBuffer + line * 256;
+    uint32_t *pBackground = backgroundOpaque + line * 8;
+    for (int i = 0; i < 8; ++i)
+    {
+        uint32_t visible = opaque[i] & ~(behind[i] & pBackground[i]);
+        for (int x = i * 32; visible; ++x, visible >>= 1)
+        {
+            if (visible & 1)
+                pLine[x] = colors[x];
+        }
+    }
 }
 
+// Maps the colors to the display's pixel format, and draws the 64 of them to the palette display
 void PPU::SetupPaletteValues()
 {
-    int i = 0;
-    SDL_PixelFormat *pFormat = pPaletteSurface->format;
-
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 84,   84,  84 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    30, 116 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 8,    16, 144 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 48,   0,  136 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 68,   0,  100 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 92,   0,   48 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 84,   4,    0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 60,   24,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 32,   42,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 8,    58,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    64,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    60,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    50,  60 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 152, 150, 152 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 8,    76, 196 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 48,   50, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 92,   30, 228 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 136,  20, 176 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 160,  20, 100 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 152,  34,  32 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 120,  60,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 84,   90,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 40,   114,  0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 8,    124,  0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    118, 40 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    102,120 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0,    0,    0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-        
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236, 238, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat,  76, 154, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 120, 124, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 176,  98, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 228,  84, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236,  88, 180 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236, 106, 100 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 212, 136,  32 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 160, 170,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 116, 196,   0 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat,  76, 208,  32 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat,  56, 204, 108 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat,  56, 180, 204 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat,  60,  60,  60 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236, 238, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 168, 204, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 188, 188, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 212, 178, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236, 174, 236 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236, 174, 212 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 236, 180, 176 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 228, 196, 144 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 204, 210, 120 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 180, 222, 120 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 168, 226, 144 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 152, 226, 180 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 160, 214, 228 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 160, 162, 160 );
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    paletteColorValues[i++] = SDL_MapRGB(pFormat, 0, 0, 0);
-    
-    // Copy colors to palette image
+    pPalette->SetPixelFormat(pPaletteSurface->format);
+
     SDL_LockSurface(pPaletteSurface);
 
     uint32_t *pPixels = (uint32_t *)pPaletteSurface->pixels;
+    const uint32_t *pColors = pPalette->GetColorValues(0);
 
-    for (i = 0; i < 64; ++i)
-        pPixels[i] = paletteColorValues[i];
+    for (int i = 0; i < NES_COLORS; ++i)
+        pPixels[i] = pColors[i];
 
     SDL_UnlockSurface(pPaletteSurface);
 }
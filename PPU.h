@@ -6,9 +6,11 @@
 #include "RAM.h"
 #include "Palette.h"
 #include "CPU_6502.h"
+#include "TileCache.h"
 #include <SDL.h>
 
 #define BUS_CLOCKS_PER_SCANLINE 341
+#define VISIBLE_SCANLINES       240
 
 // PPU Registers:
 // 	VPHB SINN	NMI enable(V), PPU master / slave(P), sprite height(H), background tile select(B), sprite tile select(S), increment mode(I), nametable select(NN)
@@ -37,6 +39,7 @@
 
 // aaaa aaaa	OAM DMA high address
 #define OAMDMA	    0x4014
+#define OAM_DMA_CYCLES  513     // CPU cycles the CPU is halted for, 514 when the DMA starts on an odd cycle
 
 /* Control register
 7  bit  0
@@ -195,6 +198,40 @@ typedef union
 
 #define SCANLINES 262 /* Just for a hack. Could be wrong, who's counting? */
 
+#define MAX_SPRITES_PER_LINE    8
+#define NO_SPRITE0_HIT          0xFFFFFFFFFFFFFFFFULL
+
+// Loopy's scroll registers, shared by PPUCTRL, PPUSCROLL and PPUADDR
+typedef struct SCROLL_REGS
+{
+    uint16_t v;             // current VRAM address, yyy NN YYYYY XXXXX: fine Y, nametable, coarse Y, coarse X
+    uint16_t t;             // address of the top left tile on the screen, copied to v while rendering
+    uint8_t fineX;
+    bool writeToggle;       // set between the first and second write to PPUSCROLL or PPUADDR
+}SCROLL_REGS;
+
+#define PPU_WRITE_LOG_SIZE  1024    /* must be a power of 2 */
+
+// A write to a register that affects rendering, replayed by the renderer when it catches up
+typedef struct PPU_REGISTER_WRITE
+{
+    uint64_t time;          // bus clock of the write
+    uint8_t reg;            // PPUCTRL, PPUMASK, PPUSCROLL, PPUADDR, or PPUSTATUS for a read that reset the write toggle
+    uint8_t value;
+}PPU_REGISTER_WRITE;
+
+// How the four logical nametables map onto the 2 KB of nametable RAM
+enum MIRRORING
+{
+    MIRROR_HORIZONTAL,      // $2000 = $2400, $2800 = $2C00
+    MIRROR_VERTICAL,        // $2000 = $2800, $2400 = $2C00
+    MIRROR_SINGLE_LOWER,    // every nametable uses the first KB
+    MIRROR_SINGLE_UPPER     // every nametable uses the second KB
+};
+
+class Mapper;
+class Scheduler;
+
 class PPU :
     public Peripheral
 {
@@ -204,23 +241,66 @@ public:
 
     uint8_t read(uint16_t address);
     void write(uint16_t address, uint8_t value);
+    void writeTraced(uint16_t address, uint8_t value);
+
+    template<bool trace>
+    void WriteRegister(uint16_t address, uint8_t value);
 
     void CopyTileToImage(uint8_t tileNumber, int tileX, int fineX, int tileY, uint32_t *pPixels, int pixelsPerRow, int paletteNumber);
-    void DrawSprite(uint8_t tileNumber, int x, int y, uint32_t *pPixels, OAM_ATTRIBUTES_BYTE attributes);
     void DrawNametables();
-    int  GetPaletteNumberForTile(int x, int y, uint16_t nametableBase);
-    void UpdateImage();
+
+    // Catch-up rendering, see CatchUp()
+    void StartFrame(uint64_t frameStart);
+    void CatchUp();
+    void DrawScanline(int line);
+    void DrawSpriteLine(int line);
+    void ConvertFrame();
+    void IncrementY(uint16_t &v);
+
+    void LogWrite(uint8_t reg, uint8_t value);
+    void ReplayWrites(uint64_t time);
+    void SyncRenderState();
     void SetupPaletteValues();
 
     // PPU has its own bus in addition to the CPU bus
     Bus PPU_Bus;
 
-    // 8KB of pattern table from 0x0000 - 0x1FFF on the PPU bus
-    RAM *pPatternTable;
+    // 8KB of pattern table from 0x0000 - 0x1FFF on the PPU bus, in 1KB pages pointed into CHR ROM or RAM by the mapper
+    const uint8_t *patternPages[8];
+    Mapper *pMapper;
+
+    const uint8_t *GetPatternData(uint16_t address) { return patternPages[(address >> 10) & 7] + (address & 0x3FF); }
+
+    // The same pages as tile numbers in the mapper's TileCache, for drawing
+    uint32_t patternTiles[8];
+    TileCache *pTileCache;
+
+    const uint8_t *GetTilePixels(uint16_t address, bool flipped = false)
+    {
+        return pTileCache->GetTile(patternTiles[(address >> 10) & 7] + ((address & 0x3FF) / TILE_BYTES), flipped);
+    }
 
     // 2KB of name table from 0x2000 - 0x2FFF (mirrored once) on the PPU bus
     RAM *pNameTable;
 
+    // Where each of the logical nametables at $2000, $2400, $2800 and $2C00 is in pNameTable
+    uint8_t *nametablePages[4];
+    MIRRORING mirroring;
+    void SetMirroring(MIRRORING mirroring);
+
+    uint8_t *GetNametableData(uint16_t address) { return nametablePages[(address >> 10) & 3] + (address & 0x3FF); }
+
+    // The palette number of every tile in each KB of nametable RAM, expanded from its attribute table. 32 rows so
+    // coarse Y 30 and 31 pick up the attribute bytes the hardware would. Expanded again before drawing when an
+    // attribute byte has been written.
+    uint8_t tilePalettes[2][32 * 32];
+    bool tilePalettesDirty[2];
+    uint8_t *nametablePalettes[4];  // like nametablePages
+    void ExpandAttributes();
+
+    // Palette number of the tile at a nametable address, or at the nametable and coarse X and Y bits of v
+    int GetTilePalette(uint16_t address) { return nametablePalettes[(address >> 10) & 3][address & 0x3FF]; }
+
     // Palette data from 0x3F00 - 0x3FFF
     Palette *pPalette;
 
@@ -228,6 +308,27 @@ public:
     OAM_ENTRY OAM_Memory[64];
     uint16_t OAM_Address;
 
+    // Sprite evaluation, the sprites on each line in OAM order. Only redone when OAM or the sprite height changes.
+    void EvaluateSprites(int height);
+    int FirstOverflowLine();
+    uint8_t lineSprites[VISIBLE_SCANLINES][MAX_SPRITES_PER_LINE];
+    uint8_t lineSpriteCount[VISIBLE_SCANLINES];
+    int firstOverflowLine;      // first line with more than 8 sprites, or VISIBLE_SCANLINES if there isn't one
+    int evaluatedHeight;        // sprite height the lines were evaluated for, 0 when OAM has changed since
+
+    // The renderer finds the exact dot of the sprite 0 hit when it draws the line it happens on
+    uint64_t sprite0HitTime;    // bus clock of this frame's hit, or NO_SPRITE0_HIT if it hasn't been drawn
+    uint64_t NextSprite0Check();
+
+    // The picture as NES colors (0 - 63), converted to pTV_Display by ConvertFrame() once it's finished.
+    // Anything that wants the colors rather than host pixels can read it straight from here.
+    uint8_t frameBuffer[VISIBLE_SCANLINES * 256];
+    uint8_t lineMask[VISIBLE_SCANLINES];            // PPUMASK each line was drawn with, for greyscale and emphasis
+
+    // A bit for each pixel the background isn't transparent on, 8 words a line with the leftmost pixel in bit 0
+    uint32_t backgroundOpaque[VISIBLE_SCANLINES * 8];
+    bool IsBackgroundOpaque(int x, int y) { return (backgroundOpaque[y * 8 + (x >> 5)] >> (x & 31)) & 1; }
+
     // Surfaces to draw to
     SDL_Surface *pTV_Display;
     SDL_Surface *pPattern1;
@@ -241,24 +342,28 @@ public:
     MASK_REG    maskReg;
 
     CPU_6502 *pCPU;
+    Scheduler *pScheduler;  // set by the Scheduler, which reschedules the sprite events when OAM or the height changes
 
-    uint32_t paletteColorValues[64];
-
-    uint16_t VRAM_Address;  // Address on the PPU bus that the CPU will access
-    bool lowByteActive;     // True if the next access will modify the low byte, false if accessing the high byte
+    // The CPU's view of the scroll registers, v is the address on the PPU bus that PPUDATA accesses
+    SCROLL_REGS scroll;
+    uint16_t GetVRAM_Address();
     uint8_t readBuffer;     // Reads from VRAM (but not Palette memory) are delayed by one read
 
-    // scroll info
-    uint8_t scrollX_ForScanline[SCANLINES];    // HACKHACK - store scroll value for each scanline
-    int lastValidScanlineForScroll;
-    uint8_t controlReg_ForScanline[SCANLINES]; // HACKHACK - store control register value for each scanline
-    int lastValidScanlineForControl;
-    uint8_t scrollY;
-    bool writingToScrollY;
+    // The renderer's view of the registers, which is behind the CPU's until the write log is replayed
+    SCROLL_REGS renderScroll;
+    CONTROL_REG renderControl;
+    MASK_REG renderMask;
+    PPU_REGISTER_WRITE writeLog[PPU_WRITE_LOG_SIZE];
+    int logStart;
+    int logCount;
+
+    // For the nametable display
     uint16_t horizontalMirrorOffset;
     uint16_t verticalMirrorOffset;
 
-    int scanline;
+    uint64_t frameStartClock;   // bus clock line 0 started on, set by the Scheduler
+    int CurrentScanline();
+    int renderedLines;          // lines of the current frame drawn so far
     bool paused;
     int uninitialized;
     bool oddFrame;
@@ -1,10 +1,43 @@
+#include <string.h>
 #include "Palette.h"
 
+// The colors used until a .pal file is loaded
+static const uint8_t defaultColors[NES_COLORS][3] =
+{
+    // $00 - $0F
+    {  84,  84,  84 }, {   0,  30, 116 }, {   8,  16, 144 }, {  48,   0, 136 },
+    {  68,   0, 100 }, {  92,   0,  48 }, {  84,   4,   0 }, {  60,  24,   0 },
+    {  32,  42,   0 }, {   8,  58,   0 }, {   0,  64,   0 }, {   0,  60,   0 },
+    {   0,  50,  60 }, {   0,   0,   0 }, {   0,   0,   0 }, {   0,   0,   0 },
+    // $10 - $1F
+    { 152, 150, 152 }, {   8,  76, 196 }, {  48,  50, 236 }, {  92,  30, 228 },
+    { 136,  20, 176 }, { 160,  20, 100 }, { 152,  34,  32 }, { 120,  60,   0 },
+    {  84,  90,   0 }, {  40, 114,   0 }, {   8, 124,   0 }, {   0, 118,  40 },
+    {   0, 102, 120 }, {   0,   0,   0 }, {   0,   0,   0 }, {   0,   0,   0 },
+    // $20 - $2F
+    { 236, 238, 236 }, {  76, 154, 236 }, { 120, 124, 236 }, { 176,  98, 236 },
+    { 228,  84, 236 }, { 236,  88, 180 }, { 236, 106, 100 }, { 212, 136,  32 },
+    { 160, 170,   0 }, { 116, 196,   0 }, {  76, 208,  32 }, {  56, 204, 108 },
+    {  56, 180, 204 }, {  60,  60,  60 }, {   0,   0,   0 }, {   0,   0,   0 },
+    // $30 - $3F
+    { 236, 238, 236 }, { 168, 204, 236 }, { 188, 188, 236 }, { 212, 178, 236 },
+    { 236, 174, 236 }, { 236, 174, 212 }, { 236, 180, 176 }, { 228, 196, 144 },
+    { 204, 210, 120 }, { 180, 222, 120 }, { 168, 226, 144 }, { 152, 226, 180 },
+    { 160, 214, 228 }, { 160, 162, 160 }, {   0,   0,   0 }, {   0,   0,   0 },
+};
 
 // Attach palette data between 0x3F00 and 0x3FFF
 Palette::Palette(Bus *pPPU_Bus)
     : Peripheral(pPPU_Bus, 0x3F00, 0x3FFF)
 {
+    memset(&paletteMem, 0, sizeof(paletteMem));
+    memset(resolvedColors, 0, sizeof(resolvedColors));
+    memset(colorValues, 0, sizeof(colorValues));
+    memset(greyscaleValues, 0, sizeof(greyscaleValues));
+    pFormat = NULL;
+
+    memcpy(rgb, defaultColors, sizeof(defaultColors));
+    ApplyEmphasis();
 }
 
 
@@ -41,5 +74,102 @@ void Palette::write(uint16_t address, uint8_t value)
     if (address == 0x10 || address == 0x14 || address == 0x18 || address == 0x1C)
         address -= 0x10;
 
+    // Palette RAM is only 6 bits wide
+    value &= 0x3F;
     paletteMem.allMem[address] = value;
+    resolvedColors[address] = colorValues[value];
+}
+
+bool Palette::LoadPalFile(const char *fileName)
+{
+    FILE *pFile = fopen(fileName, "rb");
+    if (!pFile)
+    {
+        printf("Unable to open %s\n", fileName);
+        return false;
+    }
+
+    uint8_t data[PAL_FILE_SIZE_EMPHASIS];
+    size_t size = fread(data, 1, sizeof(data), pFile);
+
+    // Anything bigger than the biggest .pal file isn't one
+    bool tooBig = fgetc(pFile) != EOF;
+    fclose(pFile);
+
+    if (tooBig || (size != PAL_FILE_SIZE && size != PAL_FILE_SIZE_EMPHASIS))
+    {
+        printf("%s isn't a %d or %d byte .pal file!\n", fileName, PAL_FILE_SIZE, PAL_FILE_SIZE_EMPHASIS);
+        return false;
+    }
+
+    memcpy(rgb, data, size);
+
+    // Files without emphasis get the same approximation as the default colors
+    if (size == PAL_FILE_SIZE)
+        ApplyEmphasis();
+
+    if (pFormat)
+        MapColors();
+
+    printf("Loaded palette %s\n", fileName);
+    return true;
+}
+
+// Fills in the 7 emphasized copies of the first 64 colors
+void Palette::ApplyEmphasis()
+{
+    for (int emphasis = 1; emphasis < EMPHASIS_VARIANTS; ++emphasis)
+    {
+        for (int color = 0; color < NES_COLORS; ++color)
+        {
+            uint8_t *pOut = rgb[emphasis * NES_COLORS + color];
+
+            // Emphasis doesn't change the blacks in columns $xE and $xF
+            if ((color & 0x0E) == 0x0E)
+            {
+                memcpy(pOut, rgb[color], 3);
+                continue;
+            }
+
+            // Bit 0 emphasizes red, bit 1 green and bit 2 blue
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                double value = rgb[color][channel];
+                for (int bit = 0; bit < 3; ++bit)
+                {
+                    if ((emphasis & (1 << bit)) && bit != channel)
+                        value *= EMPHASIS_ATTENUATION;
+                }
+
+                pOut[channel] = (uint8_t)(value + 0.5);
+            }
+        }
+    }
+}
+
+void Palette::SetPixelFormat(SDL_PixelFormat *pFormat)
+{
+    this->pFormat = pFormat;
+    MapColors();
+}
+
+void Palette::MapColors()
+{
+    for (int i = 0; i < NES_COLORS * EMPHASIS_VARIANTS; ++i)
+        colorValues[i] = SDL_MapRGB(pFormat, rgb[i][0], rgb[i][1], rgb[i][2]);
+
+    // Greyscale keeps only the brightness of each color, from column $x0
+    for (int i = 0; i < NES_COLORS * EMPHASIS_VARIANTS; ++i)
+        greyscaleValues[i] = colorValues[i & ~0x0F];
+
+    ResolveColors();
+}
+
+void Palette::ResolveColors()
+{
+    for (int i = 0; i < 32; ++i)
+    {
+        paletteMem.allMem[i] &= 0x3F;
+        resolvedColors[i] = colorValues[paletteMem.allMem[i]];
+    }
 }
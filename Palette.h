@@ -2,6 +2,13 @@
 #include <stdio.h>
 #include "peripheral.h"
 #include "Bus.h"
+#include <SDL.h>
+
+#define NES_COLORS              64
+#define EMPHASIS_VARIANTS       8       /* every combination of PPUMASK's 3 emphasis bits */
+#define PAL_FILE_SIZE           (NES_COLORS * 3)                        /* RGB for each color */
+#define PAL_FILE_SIZE_EMPHASIS  (NES_COLORS * EMPHASIS_VARIANTS * 3)    /* RGB for each color with each emphasis */
+#define EMPHASIS_ATTENUATION    0.816   /* each emphasis bit dims the other two channels by this much */
 
 typedef struct PALETTE_ENTRY
 {
@@ -18,6 +25,10 @@ typedef union
     uint8_t allMem[0x21];   // (The last byte is inaccessible)
 }PALETTE_MEM;
 
+/*
+Palette RAM, and the RGB values of the 64 colors it picks from. Every color is mapped to a host pixel for all 8
+emphasis variants (and their greyscale versions) up front, so turning a color into a pixel is one lookup.
+*/
 class Palette :
     public Peripheral
 {
@@ -28,6 +39,33 @@ public:
     uint8_t read(uint16_t address);
     void write(uint16_t address, uint8_t value);
 
+    // Loads a 192 byte .pal file, or a 1536 byte one with the emphasis variants. Keeps the old colors on failure.
+    bool LoadPalFile(const char *fileName);
+
+    // Maps the colors to pixels of pFormat, nothing can be drawn before this is called
+    void SetPixelFormat(SDL_PixelFormat *pFormat);
+
+    // Brings resolvedColors up to date after paletteMem is changed without write(), like loading a snapshot
+    void ResolveColors();
+
+    // The host pixel of each of the 64 colors, for the greyscale and emphasis bits of a PPUMASK value
+    const uint32_t *GetColorValues(uint8_t mask)
+    {
+        return ((mask & 1) ? greyscaleValues : colorValues) + (mask >> 5) * NES_COLORS;
+    }
+
     PALETTE_MEM paletteMem;
-};
 
+    // The host pixel of each entry in paletteMem (without emphasis), kept up to date by write()
+    uint32_t resolvedColors[32];
+
+protected:
+    void ApplyEmphasis();
+    void MapColors();
+
+    uint8_t rgb[NES_COLORS * EMPHASIS_VARIANTS][3];   // emphasis * 64 + color
+
+    SDL_PixelFormat *pFormat;
+    uint32_t colorValues[NES_COLORS * EMPHASIS_VARIANTS];
+    uint32_t greyscaleValues[NES_COLORS * EMPHASIS_VARIANTS];
+};
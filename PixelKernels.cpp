@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+#include "PixelKernels.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PIXEL_KERNELS_X86   1
+#endif
+
+#ifdef PIXEL_KERNELS_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+// GCC and Clang only allow the intrinsics in functions built for the instruction set
+#define TARGET_SSSE3    __attribute__((target("ssse3")))
+#define TARGET_AVX2     __attribute__((target("avx2")))
+#endif
+#endif
+
+static void DecodeTileScalar(const uint8_t *pPlanes, uint8_t *pPixels, uint8_t *pFlipped)
+{
+    for (int y = 0; y < 8; ++y)
+    {
+        uint8_t lowBits = pPlanes[y];
+        uint8_t highBits = pPlanes[y + 8];
+
+        // Bit 7 is the leftmost pixel
+        for (int x = 0; x < 8; ++x)
+        {
+            int bit = 7 - x;
+            uint8_t pixel = ((lowBits >> bit) & 1) | (((highBits >> bit) & 1) << 1);
+
+            pPixels[y * 8 + x] = pixel;
+            pFlipped[y * 8 + bit] = pixel;
+        }
+    }
+}
+
+static void ExpandPixelsScalar(const uint8_t *pIndices, const uint8_t *pColors, uint8_t *pOut, int count)
+{
+    for (int i = 0; i < count; ++i)
+        pOut[i] = pColors[pIndices[i]];
+}
+
+#ifdef PIXEL_KERNELS_X86
+
+// Decodes two rows, low and high hold each row's byte of a bitplane 8 times over
+TARGET_SSSE3 static inline __m128i DecodeRowsSSE2(__m128i low, __m128i high, __m128i bits)
+{
+    // Each byte is all ones where its pixel's bit is set
+    __m128i lowSet = _mm_cmpeq_epi8(_mm_and_si128(low, bits), bits);
+    __m128i highSet = _mm_cmpeq_epi8(_mm_and_si128(high, bits), bits);
+
+    return _mm_or_si128(_mm_and_si128(lowSet, _mm_set1_epi8(1)), _mm_and_si128(highSet, _mm_set1_epi8(2)));
+}
+
+// Only uses SSE2, but is built with the SSSE3 kernels that call it
+TARGET_SSSE3 static void DecodeTileSSE2(const uint8_t *pPlanes, uint8_t *pPixels, uint8_t *pFlipped)
+{
+    // The bit for each pixel of two rows, leftmost pixel in the lowest byte
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i flippedBits = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+
+    // Repeat each row's byte 8 times, two rows to a register
+    __m128i low = _mm_loadl_epi64((const __m128i *)pPlanes);
+    __m128i high = _mm_loadl_epi64((const __m128i *)(pPlanes + 8));
+    low = _mm_unpacklo_epi8(low, low);
+    high = _mm_unpacklo_epi8(high, high);
+
+    __m128i lowRows[4], highRows[4];
+    __m128i lowHalf = _mm_unpacklo_epi16(low, low);
+    __m128i highHalf = _mm_unpacklo_epi16(high, high);
+    lowRows[0] = _mm_unpacklo_epi32(lowHalf, lowHalf);
+    lowRows[1] = _mm_unpackhi_epi32(lowHalf, lowHalf);
+    highRows[0] = _mm_unpacklo_epi32(highHalf, highHalf);
+    highRows[1] = _mm_unpackhi_epi32(highHalf, highHalf);
+
+    lowHalf = _mm_unpackhi_epi16(low, low);
+    highHalf = _mm_unpackhi_epi16(high, high);
+    lowRows[2] = _mm_unpacklo_epi32(lowHalf, lowHalf);
+    lowRows[3] = _mm_unpackhi_epi32(lowHalf, lowHalf);
+    highRows[2] = _mm_unpacklo_epi32(highHalf, highHalf);
+    highRows[3] = _mm_unpackhi_epi32(highHalf, highHalf);
+
+    for (int i = 0; i < 4; ++i)
+    {
+        _mm_storeu_si128((__m128i *)(pPixels + i * 16), DecodeRowsSSE2(lowRows[i], highRows[i], bits));
+        _mm_storeu_si128((__m128i *)(pFlipped + i * 16), DecodeRowsSSE2(lowRows[i], highRows[i], flippedBits));
+    }
+}
+
+// One byte shuffle looks up 16 pixels
+TARGET_SSSE3 static void ExpandPixelsSSSE3(const uint8_t *pIndices, const uint8_t *pColors, uint8_t *pOut, int count)
+{
+    __m128i table = _mm_loadu_si128((const __m128i *)pColors);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i indices = _mm_loadu_si128((const __m128i *)(pIndices + i));
+        _mm_storeu_si128((__m128i *)(pOut + i), _mm_shuffle_epi8(table, indices));
+    }
+
+    ExpandPixelsScalar(pIndices + i, pColors, pOut + i, count - i);
+}
+
+// The same lookup with 32 pixels at a time
+TARGET_AVX2 static void ExpandPixelsAVX2(const uint8_t *pIndices, const uint8_t *pColors, uint8_t *pOut, int count)
+{
+    // Shuffles only work within each 128 bit half, so both halves get the whole table
+    __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)pColors));
+
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i indices = _mm256_loadu_si256((const __m256i *)(pIndices + i));
+        _mm256_storeu_si256((__m256i *)(pOut + i), _mm256_shuffle_epi8(table, indices));
+    }
+
+    // Leaving the upper halves dirty slows down any SSE code that runs next
+    _mm256_zeroupper();
+
+    ExpandPixelsSSSE3(pIndices + i, pColors, pOut + i, count - i);
+}
+
+static void CPUID(int leaf, int regs[4])
+{
+#ifdef _MSC_VER
+    __cpuidex(regs, leaf, 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static bool HasSSSE3()
+{
+    int regs[4];
+    CPUID(1, regs);
+    return (regs[2] & (1 << 9)) != 0;
+}
+
+static bool HasAVX2()
+{
+    int regs[4];
+    CPUID(0, regs);
+    if (regs[0] < 7)
+        return false;
+
+    // The OS has to save the upper halves of the AVX registers too
+    CPUID(1, regs);
+    bool osSavesAVX = (regs[2] & (1 << 27)) != 0;
+    bool hasAVX = (regs[2] & (1 << 28)) != 0;
+    if (!osSavesAVX || !hasAVX)
+        return false;
+
+#ifdef _MSC_VER
+    uint64_t xcr0 = _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    uint64_t xcr0 = ((uint64_t)edx << 32) | eax;
+#endif
+    if ((xcr0 & 6) != 6)
+        return false;
+
+    CPUID(7, regs);
+    return (regs[1] & (1 << 5)) != 0;
+}
+
+#endif
+
+// Fastest last
+static const PIXEL_KERNELS kernelSets[] =
+{
+    { "scalar", DecodeTileScalar, ExpandPixelsScalar },
+#ifdef PIXEL_KERNELS_X86
+    // The tiles are only 16 bytes, too small for AVX2 to decode any faster
+    { "SSSE3", DecodeTileSSE2, ExpandPixelsSSSE3 },
+    { "AVX2", DecodeTileSSE2, ExpandPixelsAVX2 },
+#endif
+};
+
+#define KERNEL_SET_COUNT    (int)(sizeof(kernelSets) / sizeof(kernelSets[0]))
+
+PIXEL_KERNELS pixelKernels = kernelSets[0];
+
+static bool Supported(const PIXEL_KERNELS &kernels)
+{
+#ifdef PIXEL_KERNELS_X86
+    if (strcmp(kernels.name, "SSSE3") == 0)
+        return HasSSSE3();
+    if (strcmp(kernels.name, "AVX2") == 0)
+        return HasAVX2();
+#endif
+    return true;
+}
+
+void SelectPixelKernels()
+{
+    for (int i = 0; i < KERNEL_SET_COUNT; ++i)
+    {
+        if (Supported(kernelSets[i]))
+            pixelKernels = kernelSets[i];
+    }
+
+    printf("Using %s pixel kernels\n", pixelKernels.name);
+}
+
+void ConvertPixels(const uint8_t *pColors, const uint32_t *pLUT, uint32_t *pOut, int count)
+{
+    for (int i = 0; i < count; ++i)
+        pOut[i] = pLUT[pColors[i]];
+}
+
+// The tile loop from before the tile cache: pull each pixel out of the bitplanes and look it up in the palette
+static void CopyTileOld(const uint8_t *pPlanes, const uint32_t *colors, uint32_t *pPixels)
+{
+    uint8_t pixels[8];
+
+    for (int y = 0; y < 8; ++y)
+    {
+        uint8_t lowBytes = pPlanes[y];
+        uint8_t highBytes = pPlanes[y + 8];
+
+        pixels[7] = lowBytes & 1 | ((highBytes & 1) << 1);
+        pixels[6] = (lowBytes & 2) >> 1 | (highBytes & 2);
+        pixels[5] = (lowBytes & 4) >> 2 | ((highBytes & 4) >> 1);
+        pixels[4] = (lowBytes & 8) >> 3 | ((highBytes & 8) >> 2);
+        pixels[3] = (lowBytes & 0x10) >> 4 | ((highBytes & 0x10) >> 3);
+        pixels[2] = (lowBytes & 0x20) >> 5 | ((highBytes & 0x20) >> 4);
+        pixels[1] = (lowBytes & 0x40) >> 6 | ((highBytes & 0x40) >> 5);
+        pixels[0] = (lowBytes & 0x80) >> 7 | ((highBytes & 0x80) >> 6);
+
+        for (int x = 0; x < 8; ++x)
+            pPixels[x] = colors[pixels[x]];
+
+        pPixels += 256;
+    }
+}
+
+#define BENCHMARK_TILES     512     /* 8 KB of CHR */
+#define BENCHMARK_FRAMES    200
+
+static double Milliseconds(uint64_t start)
+{
+    return (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+void BenchmarkPixelKernels()
+{
+    static uint8_t chr[BENCHMARK_TILES * 16];
+    static uint8_t decoded[BENCHMARK_TILES * 64];
+    static uint8_t flipped[BENCHMARK_TILES * 64];
+    static uint8_t expectedDecoded[BENCHMARK_TILES * 64];
+    static uint8_t expectedFlipped[BENCHMARK_TILES * 64];
+    static uint8_t indices[256 * 240];
+    static uint8_t frameColors[256 * 240];
+    static uint32_t frame[256 * 240];
+    static uint32_t expectedFrame[256 * 240];
+
+    uint32_t seed = 1;
+    for (int i = 0; i < (int)sizeof(chr); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        chr[i] = (uint8_t)(seed >> 16);
+    }
+
+    // 16 NES colors for the 4 background palettes, and made up RGBA for the 64 NES colors
+    uint8_t colors[16];
+    for (int i = 0; i < 16; ++i)
+        colors[i] = (uint8_t)((i * 5 + 0x0F) & 0x3F);
+
+    uint32_t lut[64];
+    for (int i = 0; i < 64; ++i)
+        lut[i] = 0xFF000000 | (i * 0x030201);
+
+    // Every kernel is checked against the scalar one
+    for (int tile = 0; tile < BENCHMARK_TILES; ++tile)
+        DecodeTileScalar(chr + tile * 16, expectedDecoded + tile * 64, expectedFlipped + tile * 64);
+
+    // A frame of tiles, each using palette (tile & 3), the way DrawScanline() lays them out
+    for (int y = 0; y < 240; ++y)
+    {
+        for (int x = 0; x < 256; ++x)
+        {
+            int tile = (y / 8) * 32 + x / 8;
+            uint8_t pixel = expectedDecoded[(tile % BENCHMARK_TILES) * 64 + (y & 7) * 8 + (x & 7)];
+            indices[y * 256 + x] = pixel ? (tile & 3) * 4 + pixel : 0;
+        }
+    }
+    ExpandPixelsScalar(indices, colors, frameColors, 256 * 240);
+    ConvertPixels(frameColors, lut, expectedFrame, 256 * 240);
+
+    printf("%d tiles decoded %d times, %d frames drawn\n", BENCHMARK_TILES, BENCHMARK_FRAMES, BENCHMARK_FRAMES);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int n = 0; n < BENCHMARK_FRAMES; ++n)
+    {
+        for (int tile = 0; tile < 32 * 30; ++tile)
+        {
+            int palette = tile & 3;
+            uint32_t tileColors[4] = { lut[colors[0]], lut[colors[palette * 4 + 1]], lut[colors[palette * 4 + 2]], lut[colors[palette * 4 + 3]] };
+            CopyTileOld(chr + (tile % BENCHMARK_TILES) * 16, tileColors, frame + (tile / 32) * 256 * 8 + (tile % 32) * 8);
+        }
+    }
+    printf("%-8s                     draw %8.3f ms\n", "old loop", Milliseconds(start));
+    if (memcmp(frame, expectedFrame, sizeof(frame)) != 0)
+        printf("old loop doesn't match!\n");
+
+    for (int i = 0; i < KERNEL_SET_COUNT; ++i)
+    {
+        const PIXEL_KERNELS &kernels = kernelSets[i];
+        if (!Supported(kernels))
+        {
+            printf("%-8s not supported\n", kernels.name);
+            continue;
+        }
+
+        start = SDL_GetPerformanceCounter();
+        for (int n = 0; n < BENCHMARK_FRAMES; ++n)
+        {
+            for (int tile = 0; tile < BENCHMARK_TILES; ++tile)
+                kernels.DecodeTile(chr + tile * 16, decoded + tile * 64, flipped + tile * 64);
+        }
+        double decodeTime = Milliseconds(start);
+
+        // Drawing includes turning the NES colors into RGBA at the end of the frame, like PPU::ConvertFrame()
+        start = SDL_GetPerformanceCounter();
+        for (int n = 0; n < BENCHMARK_FRAMES; ++n)
+        {
+            for (int y = 0; y < 240; ++y)
+                kernels.ExpandPixels(indices + y * 256, colors, frameColors + y * 256, 256);
+
+            ConvertPixels(frameColors, lut, frame, 256 * 240);
+        }
+        double drawTime = Milliseconds(start);
+
+        printf("%-8s decode %8.3f ms   draw %8.3f ms\n", kernels.name, decodeTime, drawTime);
+
+        if (memcmp(decoded, expectedDecoded, sizeof(decoded)) != 0 || memcmp(flipped, expectedFlipped, sizeof(flipped)) != 0)
+            printf("%s decode doesn't match!\n", kernels.name);
+        if (memcmp(frame, expectedFrame, sizeof(frame)) != 0)
+            printf("%s draw doesn't match!\n", kernels.name);
+    }
+}
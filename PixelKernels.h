@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+
+/*
+The renderer's inner loops. SelectPixelKernels() picks the fastest versions the CPU supports (SSSE3 or AVX2 on x86)
+and falls back to plain C everywhere else. Every version produces exactly the same output as the scalar one.
+*/
+typedef struct PIXEL_KERNELS
+{
+    const char *name;
+
+    // Decodes a tile's two bitplanes (16 bytes) to 64 pixels of 0 - 3, row by row, and the same pixels flipped horizontally
+    void (*DecodeTile)(const uint8_t *pPlanes, uint8_t *pPixels, uint8_t *pFlipped);
+
+    // Looks each index up in the 16 entry pColors, turning the renderer's palette indices into NES colors
+    void (*ExpandPixels)(const uint8_t *pIndices, const uint8_t *pColors, uint8_t *pOut, int count);
+}PIXEL_KERNELS;
+
+// The kernels in use, plain C until SelectPixelKernels() is called
+extern PIXEL_KERNELS pixelKernels;
+
+void SelectPixelKernels();
+
+// Looks each NES color up in pLUT, a table of host pixels
+void ConvertPixels(const uint8_t *pColors, const uint32_t *pLUT, uint32_t *pOut, int count);
+
+// Times each kernel the CPU supports against the per-pixel loops they replaced, and checks their output
+void BenchmarkPixelKernels();
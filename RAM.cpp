@@ -1,25 +1,38 @@
 #include <string.h>
 #include <stdio.h>
 #include "RAM.h"
+#include "Bus.h"
 
 
 
 RAM::RAM(Bus * pBus, uint16_t addressStart, uint16_t addressEnd)
     : Peripheral(pBus, addressStart, addressEnd)
 {
-    actualSize = addressEnd - addressStart;
-    mirrorMask = actualSize - 1;
+    actualSize = (uint32_t)addressEnd - addressStart + 1;
+    Allocate(pBus);
 }
 
-RAM::RAM(Bus * pBus, uint16_t addressStart, uint16_t addressEnd, uint16_t actualSize)
+RAM::RAM(Bus * pBus, uint16_t addressStart, uint16_t addressEnd, uint32_t actualSize)
     : Peripheral(pBus, addressStart, addressEnd)
 {
     this->actualSize = actualSize;
-    mirrorMask = actualSize - 1;
+    Allocate(pBus);
 }
 
 RAM::~RAM()
 {
+    delete[] mem;
+}
+
+void RAM::Allocate(Bus *pBus)
+{
+    mirrorMask = (uint16_t)(actualSize - 1);
+
+    mem = new uint8_t[actualSize];
+    memset(mem, 0, actualSize);
+
+    // Reads and writes can go straight to mem without calling read() or write()
+    pBus->mapMemory(this, mem, mirrorMask);
 }
 
 void RAM::loadHexDump(char *hexDump)
@@ -42,7 +55,7 @@ void RAM::loadHexDump(char *hexDump)
         {
             uint8_t data;
             sscanf(hexString, "%hhX", &data);
-            mem[offset] = data;
+            mem[offset & mirrorMask] = data;
             printf("mem[0x%X] = 0x%X\n", offset, data);
             offset++;
         }
@@ -2,38 +2,42 @@
 #include "peripheral.h"
 #include <stdio.h>
 
-extern bool debugOutput;
-
 class RAM :
     public Peripheral
 {
 public:
     RAM(Bus *pBus, uint16_t addressStart, uint16_t addressEnd);
-    RAM(Bus *pBus, uint16_t addressStart, uint16_t addressEnd, uint16_t actualSize);
+    RAM(Bus *pBus, uint16_t addressStart, uint16_t addressEnd, uint32_t actualSize);
     ~RAM();
 
     uint8_t read(uint16_t addr) 
     {
-        // TODO: This isn't working right yet
-        //return mem[addr & mirrorMask];
-        return mem[addr];
+        return mem[addr & mirrorMask];
     }
     
     void write(uint16_t addr, uint8_t data)
     {
-        //mem[addr & mirrorMask] = data;
-        mem[addr] = data;
-        
-        if(debugOutput)
-            printf("mem[0x%X] = 0x%X\n", addr, data);
+        mem[addr & mirrorMask] = data;
+    }
+
+    void writeTraced(uint16_t addr, uint8_t data)
+    {
+        write(addr, data);
+
+        printf("mem[0x%X] = 0x%X\n", addr, data);
     }
 
     void loadHexDump(char *hexDump);
 
-    uint8_t mem[0x10000];
+    // actualSize bytes, indexed by address & mirrorMask
+    uint8_t *mem;
 
-    // Handle mirroring smaller memory amounts to larger address spaces
+    // Handle mirroring smaller memory amounts to larger address spaces.
+    // actualSize must be a power of 2 and addressStart must be a multiple of it.
     uint32_t actualSize;
-    uint32_t mirrorMask;
+    uint16_t mirrorMask;
+
+protected:
+    void Allocate(Bus *pBus);
 };
 
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include "Scheduler.h"
+#include "Mapper.h"
+
+Scheduler::Scheduler(CPU_6502 *pCPU, PPU *pPPU, APU *pAPU)
+{
+    this->pCPU = pCPU;
+    this->pPPU = pPPU;
+    this->pAPU = pAPU;
+    pAPU->pScheduler = this;
+    pPPU->pScheduler = this;
+    eventCount = 0;
+    frameStart = 0;
+    frameDone = false;
+}
+
+void Scheduler::Schedule(uint64_t time, EVENT_TYPE type, int param)
+{
+    if (eventCount == MAX_SCHEDULED_EVENTS)
+    {
+        printf("Too many scheduled events!\n");
+        return;
+    }
+
+    // Sift the new event up from the bottom of the heap
+    int i = eventCount++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (events[parent].time <= time)
+            break;
+
+        events[i] = events[parent];
+        i = parent;
+    }
+
+    events[i].time = time;
+    events[i].type = type;
+    events[i].param = param;
+
+    pCPU->BringDeadlineForward(time);
+}
+
+void Scheduler::Pop()
+{
+    // Sift the last event down from the top of the heap
+    SCHEDULED_EVENT last = events[--eventCount];
+    int i = 0;
+    for (;;)
+    {
+        int child = i * 2 + 1;
+        if (child >= eventCount)
+            break;
+        if (child + 1 < eventCount && events[child + 1].time < events[child].time)
+            ++child;
+        if (last.time <= events[child].time)
+            break;
+
+        events[i] = events[child];
+        i = child;
+    }
+
+    events[i] = last;
+}
+
+// Removes every event of a type, rebuilding the heap from the ones left
+void Scheduler::Cancel(EVENT_TYPE type)
+{
+    SCHEDULED_EVENT kept[MAX_SCHEDULED_EVENTS];
+    int keptCount = 0;
+    for (int i = 0; i < eventCount; ++i)
+    {
+        if (events[i].type != type)
+            kept[keptCount++] = events[i];
+    }
+
+    eventCount = 0;
+    for (int i = 0; i < keptCount; ++i)
+        Schedule(kept[i].time, kept[i].type, kept[i].param);
+}
+
+bool Scheduler::CountsScanlines()
+{
+    return pPPU->pMapper && pPPU->pMapper->countsScanlines;
+}
+
+// Schedules everything up to VBlank. Events that would already be in the past are skipped.
+void Scheduler::StartFrame(uint64_t frameStart)
+{
+    this->frameStart = frameStart;
+    pPPU->StartFrame(frameStart);
+
+    uint64_t now = Now();
+
+    if (CountsScanlines() && frameStart + BUS_CLOCKS_PER_SCANLINE >= now)
+        Schedule(frameStart + BUS_CLOCKS_PER_SCANLINE, EVENT_SCANLINE, 0);
+
+    ScheduleSpriteEvents();
+
+    Schedule(frameStart + VBLANK_SCANLINE * BUS_CLOCKS_PER_SCANLINE + 1, EVENT_VBLANK_SET);
+}
+
+// The PPU calls this after it's caught up to the CPU, so lines that have already been drawn aren't checked again
+void Scheduler::ScheduleSpriteEvents()
+{
+    uint64_t now = Now();
+
+    // Changes after the visible lines are picked up when the next frame starts
+    if (now >= frameStart + VISIBLE_SCANLINES * BUS_CLOCKS_PER_SCANLINE)
+        return;
+
+    Cancel(EVENT_SPRITE0_HIT);
+    Cancel(EVENT_SPRITE_OVERFLOW);
+
+    // Sprite 0 is checked at the start of each line it's on, until drawing one of them finds the hit.
+    // A hit that's already been drawn is set right away.
+    uint64_t sprite0_Time = pPPU->NextSprite0Check();
+    if (sprite0_Time != NO_SPRITE0_HIT)
+        Schedule(sprite0_Time >= now ? sprite0_Time : now, EVENT_SPRITE0_HIT);
+
+    // Overflow is found while evaluating the line before, set it by the end of evaluation
+    int overflowLine = pPPU->FirstOverflowLine();
+    uint64_t overflowTime = frameStart + (overflowLine - 1) * BUS_CLOCKS_PER_SCANLINE + 256;
+    if (overflowLine < VISIBLE_SCANLINES && overflowTime >= now)
+        Schedule(overflowTime, EVENT_SPRITE_OVERFLOW);
+}
+
+bool Scheduler::RunFrame()
+{
+    if (eventCount == 0)
+    {
+        if (pPPU->uninitialized)
+        {
+            // Let the game wait out the warm up, with the frame lined up so VBlank starts right after it
+            pPPU->uninitialized--;
+            StartFrame(Now() + WARM_UP_BUS_CLOCKS - (VBLANK_SCANLINE * BUS_CLOCKS_PER_SCANLINE + 1));
+        }
+        else
+            StartFrame(Now());
+    }
+
+    bool retVal = true;
+    frameDone = false;
+
+    while (!frameDone)
+    {
+        // Nothing can happen before the next event, so the CPU runs right up to it
+        retVal &= pCPU->RunUntil(events[0].time);
+        if (!pCPU->running)
+            break;
+
+        // The CPU may have scheduled something sooner while it ran
+        SCHEDULED_EVENT event = events[0];
+        Pop();
+        HandleEvent(event);
+    }
+
+    return retVal;
+}
+
+void Scheduler::HandleEvent(const SCHEDULED_EVENT &event)
+{
+    switch (event.type)
+    {
+        case EVENT_SCANLINE:
+            pPPU->pMapper->Scanline();
+
+            // The pre-render line is clocked at the end of the frame
+            if (event.param + 1 < VISIBLE_SCANLINES)
+                Schedule(event.time + BUS_CLOCKS_PER_SCANLINE, EVENT_SCANLINE, event.param + 1);
+            break;
+
+        case EVENT_SPRITE0_HIT:
+        {
+            // Drawing up to here tells whether it's hit yet, otherwise check again on the next line
+            pPPU->CatchUp();
+            uint64_t next = pPPU->NextSprite0Check();
+            if (next <= event.time)
+                pPPU->statusReg.sprite0_Hit = true;
+            else if (next != NO_SPRITE0_HIT)
+                Schedule(next, EVENT_SPRITE0_HIT);
+            break;
+        }
+
+        case EVENT_SPRITE_OVERFLOW:
+            pPPU->CatchUp();
+            if (pPPU->renderMask.showBackground || pPPU->renderMask.showSprites)
+                pPPU->statusReg.spriteOverflow = true;
+            break;
+
+        case EVENT_VBLANK_SET:
+            // Finishes drawing the frame
+            pPPU->CatchUp();
+            pPPU->statusReg.vBlank = true;
+            if (pPPU->controlReg.generateNMI_OnVBlank)
+                pCPU->TriggerNMI();
+
+            Schedule(frameStart + PRE_RENDER_SCANLINE * BUS_CLOCKS_PER_SCANLINE + 1, EVENT_VBLANK_CLEAR);
+            break;
+
+        case EVENT_VBLANK_CLEAR:
+        {
+            pPPU->statusReg.vBlank = false;
+            pPPU->statusReg.sprite0_Hit = false;
+            pPPU->statusReg.spriteOverflow = false;
+
+            // The pre-render line of odd frames is one dot shorter while rendering is on
+            uint64_t frameEnd = frameStart + BUS_CLOCKS_PER_FRAME;
+            if (pPPU->oddFrame && (pPPU->maskReg.showBackground || pPPU->maskReg.showSprites))
+                --frameEnd;
+
+            Schedule(frameEnd, EVENT_FRAME_END);
+            break;
+        }
+
+        case EVENT_FRAME_END:
+            if (CountsScanlines())
+                pPPU->pMapper->Scanline();
+
+            pPPU->oddFrame = !pPPU->oddFrame;
+            StartFrame(event.time);
+            frameDone = true;
+            break;
+
+        case EVENT_DMC_FETCH:
+            pAPU->HandleDMC_Event(event.time);
+            break;
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include "CPU_6502.h"
+#include "PPU.h"
+#include "APU.h"
+
+/*
+Frame timing, counted in bus clocks (PPU dots, 3 per CPU cycle) on the 64-bit master clock CPU_6502::BusClock().
+Lines 0 - 239 are visible, 240 is idle, VBlank starts on dot 1 of line 241 and ends on dot 1 of the pre-render line.
+*/
+#define SCANLINES_PER_FRAME     262
+#define VBLANK_SCANLINE         241
+#define PRE_RENDER_SCANLINE     261
+#define BUS_CLOCKS_PER_FRAME    (SCANLINES_PER_FRAME * BUS_CLOCKS_PER_SCANLINE)
+#define WARM_UP_BUS_CLOCKS      179040  /* roughly two frames before the PPU is usable (number from FCEU) */
+
+#define MAX_SCHEDULED_EVENTS    32
+
+/*
+The APU's frame counter doesn't need events. It doesn't raise IRQs, and the APU catches up to the CPU before every
+register access, so nothing outside the APU can see a step happen. DMA doesn't either, the CPU counts off the cycles
+it's halted for up to the next event (see CPU_6502::Stall()).
+*/
+enum EVENT_TYPE
+{
+    EVENT_SCANLINE,         // end of a rendered line, clocks the mapper's scanline counter
+    EVENT_SPRITE0_HIT,      // a line sprite 0 could hit on, or the hit itself once it's been drawn
+    EVENT_SPRITE_OVERFLOW,
+    EVENT_VBLANK_SET,       // also raises the NMI
+    EVENT_VBLANK_CLEAR,
+    EVENT_FRAME_END,        // end of the pre-render line
+    EVENT_DMC_FETCH         // the DMC's sample buffer empties, see APU::ScheduleDMC()
+};
+
+typedef struct SCHEDULED_EVENT
+{
+    uint64_t time;          // bus clock the event happens on
+    EVENT_TYPE type;
+    int param;              // depends on the type, the line number for EVENT_SCANLINE
+}SCHEDULED_EVENT;
+
+/*
+Runs the system from event to event. Events are kept in a min-heap ordered by time, and the CPU runs straight up to
+the earliest one, so nothing stops the CPU unless something is actually scheduled. A frame with no mapper that counts
+scanlines only stops the CPU four times.
+*/
+class Scheduler
+{
+public:
+    Scheduler(CPU_6502 *pCPU, PPU *pPPU, APU *pAPU);
+
+    // Can be called while the CPU runs, an event sooner than its deadline stops it there
+    void Schedule(uint64_t time, EVENT_TYPE type, int param = 0);
+
+    // Runs until the end of the frame, returns false if an unhandled opcode was encountered
+    bool RunFrame();
+
+    uint64_t Now() { return pCPU->BusClock(); }
+
+    // Replaces the sprite 0 and overflow events, for when OAM or the sprite height changes during the frame
+    void ScheduleSpriteEvents();
+
+protected:
+    void StartFrame(uint64_t frameStart);
+    void HandleEvent(const SCHEDULED_EVENT &event);
+
+    bool CountsScanlines();
+
+    // Min-heap, events[0] is the next to happen
+    void Pop();
+    void Cancel(EVENT_TYPE type);
+    SCHEDULED_EVENT events[MAX_SCHEDULED_EVENTS];
+    int eventCount;
+
+    CPU_6502 *pCPU;
+    PPU *pPPU;
+    APU *pAPU;
+
+    uint64_t frameStart;    // bus clock of dot 0 of line 0
+    bool frameDone;
+};
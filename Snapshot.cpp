@@ -1,7 +1,7 @@
 #include <stdio.h>
 #include "Snapshot.h"
 
-Snapshot::Snapshot(const char * ROMname, RAM *pSystemRAM, CPU_6502 *pCPU, PPU *pPPU)
+Snapshot::Snapshot(const char * ROMname, RAM *pSystemRAM, CPU_6502 *pCPU, PPU *pPPU, Mapper *pMapper)
 {
     strcpy(fileName, ROMname);
     strcat(fileName, ".snp");
@@ -9,6 +9,7 @@ Snapshot::Snapshot(const char * ROMname, RAM *pSystemRAM, CPU_6502 *pCPU, PPU *p
     this->pSystemRAM = pSystemRAM;
     this->pCPU = pCPU;
     this->pPPU = pPPU;
+    this->pMapper = pMapper;
 }
 
 Snapshot::~Snapshot()
@@ -24,8 +25,15 @@ void Snapshot::Save()
         return;
     }
 
+    uint32_t version = SNAPSHOT_VERSION;
+    if (fwrite(&version, sizeof(version), 1, pFile) != 1)
+    {
+        printf("Unable to save %s!\n", fileName);
+        return;
+    }
+
     // Save the RAM contents
-    if (fwrite(pSystemRAM->mem, 0xFFFF, 1, pFile) != 1)
+    if (fwrite(pSystemRAM->mem, pSystemRAM->actualSize, 1, pFile) != 1)
     {
         printf("Unable to save %s!\n", fileName);
         return;
@@ -38,36 +46,37 @@ void Snapshot::Save()
         || fwrite(&pCPU->SP, 1, 1, pFile) != 1
         || fwrite(&pCPU->x, 1, 1, pFile) != 1
         || fwrite(&pCPU->y, 1, 1, pFile) != 1
-        || fwrite(&pCPU->nmi, sizeof(bool), 1, pFile) != 1)
+        || fwrite(&pCPU->nmi, sizeof(bool), 1, pFile) != 1
+        || fwrite(&pCPU->irqSources, 1, 1, pFile) != 1)
     {
         printf("Unable to save CPU state!\n");
         return;
     }
 
     // Save the PPU state
-    if (fwrite(&pPPU->pNameTable->mem[0x2000], 0x2FFF, 1, pFile) != 1
-       || fwrite(pPPU->controlReg_ForScanline, SCANLINES, 1, pFile) != 1
+    if (fwrite(pPPU->pNameTable->mem, pPPU->pNameTable->actualSize, 1, pFile) != 1
        || fwrite(&pPPU->controlReg.entireRegister, 1, 1, pFile) != 1
        || fwrite(&pPPU->horizontalMirrorOffset, 2, 1, pFile) != 1
-       || fwrite(&pPPU->lastValidScanlineForControl, sizeof(int), 1, pFile) != 1
-       || fwrite(&pPPU->lastValidScanlineForScroll, sizeof(int), 1, pFile) != 1
-       || fwrite(&pPPU->lowByteActive, sizeof(bool), 1, pFile) != 1
        || fwrite(&pPPU->maskReg.entireRegister, 1, 1, pFile) != 1
        || fwrite(&pPPU->OAM_Address, 2, 1, pFile) != 1
        || fwrite(pPPU->OAM_Memory, sizeof(OAM_ENTRY), 64, pFile) != 64
        || fwrite(&pPPU->pPalette->paletteMem, sizeof(PALETTE_MEM), 1, pFile) != 1
        || fwrite(&pPPU->readBuffer, 1, 1, pFile) != 1
-       || fwrite(&pPPU->scanline, sizeof(int), 1, pFile) != 1
-       || fwrite(pPPU->scrollX_ForScanline, SCANLINES, 1, pFile) != 1
+       || fwrite(&pPPU->scroll, sizeof(SCROLL_REGS), 1, pFile) != 1
        || fwrite(&pPPU->statusReg.entireRegister, 1, 1, pFile) != 1
-       || fwrite(&pPPU->verticalMirrorOffset, 2, 1, pFile) != 1
-       || fwrite(&pPPU->VRAM_Address, 2, 1, pFile) != 1
-       || fwrite(&pPPU->writingToScrollY, sizeof(bool), 1, pFile) != 1)
+       || fwrite(&pPPU->verticalMirrorOffset, 2, 1, pFile) != 1)
     {
         printf("Unable to save PPU state!\n");
         return;
     }
 
+    // Save the cartridge state
+    if (!pMapper->Save(pFile))
+    {
+        printf("Unable to save mapper state!\n");
+        return;
+    }
+
     printf("%s saved\n", fileName);
 
     fclose(pFile);
@@ -83,8 +92,15 @@ void Snapshot::Load()
         return;
     }
 
+    uint32_t version;
+    if (fread(&version, sizeof(version), 1, pFile) != 1 || version != SNAPSHOT_VERSION)
+    {
+        printf("%s isn't a version %d snapshot!\n", fileName, SNAPSHOT_VERSION);
+        return;
+    }
+
     // Load the memory contents
-    if (fread(pSystemRAM->mem, 0xFFFF, 1, pFile) != 1)
+    if (fread(pSystemRAM->mem, pSystemRAM->actualSize, 1, pFile) != 1)
     {
         printf("Unable to read %s!\n", fileName);
         return;
@@ -97,37 +113,47 @@ void Snapshot::Load()
         || fread(&pCPU->SP, 1, 1, pFile) != 1
         || fread(&pCPU->x, 1, 1, pFile) != 1
         || fread(&pCPU->y, 1, 1, pFile) != 1
-        || fwrite(&pCPU->nmi, sizeof(bool), 1, pFile) != 1)
+        || fread(&pCPU->nmi, sizeof(bool), 1, pFile) != 1
+        || fread(&pCPU->irqSources, 1, 1, pFile) != 1)
     {
         printf("Unable to load CPU state!\n");
         return;
     }
 
     // Load the PPU state
-    if (fread(&pPPU->pNameTable->mem[0x2000], 0x2FFF, 1, pFile) != 1
-        || fread(pPPU->controlReg_ForScanline, SCANLINES, 1, pFile) != 1
+    if (fread(pPPU->pNameTable->mem, pPPU->pNameTable->actualSize, 1, pFile) != 1
         || fread(&pPPU->controlReg.entireRegister, 1, 1, pFile) != 1
         || fread(&pPPU->horizontalMirrorOffset, 2, 1, pFile) != 1
-        || fread(&pPPU->lastValidScanlineForControl, sizeof(int), 1, pFile) != 1
-        || fread(&pPPU->lastValidScanlineForScroll, sizeof(int), 1, pFile) != 1
-        || fread(&pPPU->lowByteActive, sizeof(bool), 1, pFile) != 1
         || fread(&pPPU->maskReg.entireRegister, 1, 1, pFile) != 1
         || fread(&pPPU->OAM_Address, 2, 1, pFile) != 1
         || fread(pPPU->OAM_Memory, sizeof(OAM_ENTRY), 64, pFile) != 64
         || fread(&pPPU->pPalette->paletteMem, sizeof(PALETTE_MEM), 1, pFile) != 1
         || fread(&pPPU->readBuffer, 1, 1, pFile) != 1
-        || fread(&pPPU->scanline, sizeof(int), 1, pFile) != 1
-        || fread(pPPU->scrollX_ForScanline, SCANLINES, 1, pFile) != 1
+        || fread(&pPPU->scroll, sizeof(SCROLL_REGS), 1, pFile) != 1
         || fread(&pPPU->statusReg.entireRegister, 1, 1, pFile) != 1
-        || fread(&pPPU->verticalMirrorOffset, 2, 1, pFile) != 1
-        || fread(&pPPU->VRAM_Address, 2, 1, pFile) != 1
-        || fread(&pPPU->writingToScrollY, sizeof(bool), 1, pFile) != 1)
+        || fread(&pPPU->verticalMirrorOffset, 2, 1, pFile) != 1)
     {
         //pPPU->statusReg.vBlank = false;
         printf("Unable to load PPU state!\n");
         return;
     }
 
+    // Load the cartridge state, which maps the saved banks back in
+    if (!pMapper->Load(pFile))
+    {
+        printf("Unable to load mapper state!\n");
+        return;
+    }
+
+    // Code in memory was replaced behind the CPU's back
+    pCPU->InvalidateDecodeCache();
+
+    // The renderer picks up from the loaded registers and palette
+    pPPU->SyncRenderState();
+    pPPU->pPalette->ResolveColors();
+    pPPU->evaluatedHeight = 0;
+    pPPU->tilePalettesDirty[0] = pPPU->tilePalettesDirty[1] = true;
+
     printf("Loaded %s\n", fileName);
 
     fclose(pFile);
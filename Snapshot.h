@@ -3,11 +3,15 @@
 #include "RAM.h"
 #include "PPU.h"
 #include "CPU_6502.h"
+#include "Mapper.h"
+
+// Written at the start of every snapshot, files from other versions aren't loaded
+#define SNAPSHOT_VERSION    2   /* 2 added the mapper's state */
 
 class Snapshot
 {
 public:
-    Snapshot(const char *ROMname, RAM *pSystemRAM, CPU_6502 *pCPU, PPU *pPPU);
+    Snapshot(const char *ROMname, RAM *pSystemRAM, CPU_6502 *pCPU, PPU *pPPU, Mapper *pMapper);
     ~Snapshot();
 
     void Save();
@@ -16,6 +20,7 @@ public:
     RAM *pSystemRAM;
     CPU_6502 *pCPU;
     PPU *pPPU;
+    Mapper *pMapper;
     char fileName[256];
 };
 
@@ -6,6 +6,7 @@
 #include "System.h"
 #include "Snapshot.h"
 #include "Audio.h"
+#include "Mapper.h"
 
 #define COLOR_FROM_SDL_COLOR(format, sdlColor) SDL_MapRGB(format, sdlColor.r, sdlColor.g, sdlColor.b)
 
@@ -222,11 +223,12 @@ bool StatusMonitor::EventLoop()
 #endif
 
 #ifdef SYSTEM_NES
-StatusMonitor::StatusMonitor(RAM *pRAM, CPU_6502 *pCPU, PPU *pPPU, APU *pAPU, NES_Controller *pController1)
+StatusMonitor::StatusMonitor(RAM *pRAM, CPU_6502 *pCPU, PPU *pPPU, APU *pAPU, NES_Controller *pController1, Scheduler *pScheduler)
 {
     this->pRAM = pRAM;
     this->pCPU = pCPU;
     this->pPPU = pPPU;
+    this->pScheduler = pScheduler;
     this->pAPU = pAPU;
     this->pController1 = pController1;
     cpuRunning = false;
@@ -268,78 +270,34 @@ StatusMonitor::StatusMonitor(RAM *pRAM, CPU_6502 *pCPU, PPU *pPPU, APU *pAPU, NE
     InitAudio();
 }
 
-inline void plotPixel(uint8_t pixel, SDL_PixelFormat *format, uint32_t *address)
-{
-    uint32_t white = SDL_MapRGB(format, 255, 255, 255);
-    uint32_t lightGray = SDL_MapRGB(format, 128, 128, 128);
-    uint32_t darkGray = SDL_MapRGB(format, 64, 64, 64);
-    uint32_t black = SDL_MapRGB(format, 0, 0, 0);
-
-    switch (pixel)
-    {
-        case 3:
-            *address = white;
-            break;
-        case 2:
-            *address = lightGray;
-            break;
-        case 1:
-            *address = darkGray;
-            break;
-        case 0:
-            *address = black;
-            break;
-        default:
-            printf("Invalid value\n");
-            break;
-    }
-}
-
-void StatusMonitor::CopyTileToPixels(SDL_PixelFormat *format, uint8_t *pTileLSB, uint8_t *pTileMSB, uint32_t *pPixels, uint32_t tileX, uint32_t tileY)
+void StatusMonitor::CopyTileToPixels(const uint32_t *colors, const uint8_t *pTile, uint32_t *pPixels, uint32_t tileX, uint32_t tileY)
 {
     uint32_t pixelOffset = (tileY * 128 * 8) + (tileX * 8);
 
     // for each row
     for (int y = 0; y < 8; ++y)
     {
-        uint8_t lowBytes = pTileLSB[y];
-        uint8_t highBytes = pTileMSB[y];
-
-        // plot each of the 8 pixels in the tile row
-        uint8_t pix1 = lowBytes & 1 | ((highBytes & 1) << 1);
-        uint8_t pix2 = (lowBytes & 2) >> 1 | (highBytes & 2);
-        uint8_t pix3 = (lowBytes & 4) >> 2 | ((highBytes & 4) >> 1);
-        uint8_t pix4 = (lowBytes & 8) >> 3 | ((highBytes & 8) >> 2);
-        uint8_t pix5 = (lowBytes & 0x10) >> 4 | ((highBytes & 0x10) >> 3);
-        uint8_t pix6 = (lowBytes & 0x20) >> 5 | ((highBytes & 0x20) >> 4);
-        uint8_t pix7 = (lowBytes & 0x40) >> 6 | ((highBytes & 0x40) >> 5);
-        uint8_t pix8 = (lowBytes & 0x80) >> 7 | ((highBytes & 0x80) >> 6);
-
-
-        plotPixel(pix8, format, &pPixels[pixelOffset++]);
-        plotPixel(pix7, format, &pPixels[pixelOffset++]);
-        plotPixel(pix6, format, &pPixels[pixelOffset++]);
-        plotPixel(pix5, format, &pPixels[pixelOffset++]);
-        plotPixel(pix4, format, &pPixels[pixelOffset++]);
-        plotPixel(pix3, format, &pPixels[pixelOffset++]);
-        plotPixel(pix2, format, &pPixels[pixelOffset++]);
-        plotPixel(pix1, format, &pPixels[pixelOffset++]);
+        for (int x = 0; x < 8; ++x)
+            pPixels[pixelOffset++] = colors[*pTile++];
 
         pixelOffset += 120;
     }
 }
 
 
-void StatusMonitor::DrawPattern(SDL_Surface *pSurface, uint8_t *pPatternMemory)
+void StatusMonitor::DrawPattern(SDL_Surface *pSurface, uint16_t patternAddress)
 {
     // Lock surface so we can access the pixels directly
     SDL_LockSurface(pSurface);
 
-    uint32_t offset = 0;
+    // Pattern tables are shown in shades of gray rather than any palette
+    uint32_t colors[4];
+    colors[0] = SDL_MapRGB(pSurface->format, 0, 0, 0);
+    colors[1] = SDL_MapRGB(pSurface->format, 64, 64, 64);
+    colors[2] = SDL_MapRGB(pSurface->format, 128, 128, 128);
+    colors[3] = SDL_MapRGB(pSurface->format, 255, 255, 255);
 
-    // Tiles are stored LSB of an entire tile followed by MSB of an entire tile
-    uint8_t tileLSB[8];
-    uint8_t tileMSB[8];
+    uint32_t offset = 0;
 
     // Draw 16 tiles top to bottom
     for (int y = 0; y < 16; ++y)
@@ -347,12 +305,7 @@ void StatusMonitor::DrawPattern(SDL_Surface *pSurface, uint8_t *pPatternMemory)
         // Draw 16 tiles across
         for (int x = 0; x < 16; ++x)
         {
-            // Extract data for the next tile
-            SDL_memcpy(tileLSB, pPatternMemory + offset, 8);
-            SDL_memcpy(tileMSB, pPatternMemory + offset + 8, 8);
-
-            // Copy tile to surface
-            CopyTileToPixels(pSurface->format, tileLSB, tileMSB, (uint32_t *)pSurface->pixels, x, y);
+            CopyTileToPixels(colors, pPPU->GetTilePixels(patternAddress + offset), (uint32_t *)pSurface->pixels, x, y);
 
             offset += 16;
         }
@@ -372,15 +325,13 @@ void StatusMonitor::DrawDisplay()
     
     SDL_FillRect(screenSurface, &border, colorWhite);
 
-    pPPU->UpdateImage();
-
-    // Draw the tv display
+    // Draw the tv display, the PPU finished drawing it while the last frame ran
     SDL_BlitScaled(pPPU->pTV_Display, NULL, screenSurface, &nesDisplayRect);
     
 
     // Draw the pattern tables
     // Draw pattern table 1
-    DrawPattern(pPPU->pPattern1, pPPU->pPatternTable->mem);
+    DrawPattern(pPPU->pPattern1, 0);
 
     // Draw a border
     border = { pattern1Rect.x - 1,
@@ -394,7 +345,7 @@ void StatusMonitor::DrawDisplay()
     // For some reason the app crashes if we use SDL_Blit() instead of SDL_BlitScale() with pattern1.
 
     // Draw pattern table 2
-    DrawPattern(pPPU->pPattern2, &pPPU->pPatternTable->mem[0x1000]);
+    DrawPattern(pPPU->pPattern2, 0x1000);
 
     // Draw a border
     border = { pattern2Rect.x - 1,
@@ -438,8 +389,10 @@ bool StatusMonitor::EventLoop()
                         pCPU->Step();
                         cpuRunning = false;
                         break;
+                    // switch between the traced and untraced CPU, RAM and PPU code, takes effect on the next Run() batch
                     case SDLK_d:
                         debugOutput = !debugOutput;
+                        printf("Trace output: %d\n", debugOutput);
                         break;
                     case SDLK_r:
                         pCPU->Reset();
@@ -449,6 +402,22 @@ bool StatusMonitor::EventLoop()
                         pCPU->running = true;
                         pPPU->paused = false;
                         break;
+                    // cycle through the CPU cores
+                    case SDLK_c:
+                        if (pCPU->core == CPU_CORE_BLOCKS)
+                            pCPU->core = CPU_CORE_LEGACY;
+                        else if (pCPU->core == CPU_CORE_LEGACY)
+                            pCPU->core = CPU_CORE_INTERPRETER;
+                        else
+                            pCPU->core = CPU_CORE_BLOCKS;
+                        printf("CPU core: %s\n", pCPU->core == CPU_CORE_BLOCKS ? "blocks"
+                                                : (pCPU->core == CPU_CORE_INTERPRETER ? "interpreter" : "legacy"));
+                        break;
+                    // toggle idle loop skipping
+                    case SDLK_i:
+                        pCPU->skipIdleLoops = !pCPU->skipIdleLoops;
+                        printf("Skip idle loops: %d\n", pCPU->skipIdleLoops);
+                        break;
 
                     // Check for controller input
                     case SDLK_END:
@@ -610,65 +579,21 @@ bool StatusMonitor::EventLoop()
         }
     }
 
-    double elapsedFrameTime = Draw();
+    Draw();
 
     if (cpuRunning && pCPU->running && !pPPU->paused)
     {
-        if (pPPU->uninitialized)
-        {
-            pCPU->Run(179040); // Run for roughly two frames of CPU cycles (number from FCEU)
-            pPPU->uninitialized--;
-        }
-        else
-        {
-            pPPU->statusReg.sprite0_Hit = false;
-            // Cycle through the 240 visible lines
-            for (int y = 0; y < 240; ++y)
-            {
-                // Run the CPU for the amount of time taken by one scanline
-                pCPU->Run(BUS_CLOCKS_PER_SCANLINE);
-                pPPU->scanline++;
-
-                // Put in a hack for sprite 0 hit detection
-                if (y == pPPU->OAM_Memory[0].yPos + 1)
-                {
-                    pPPU->statusReg.sprite0_Hit = true;
-                }
-            }
-            // Go through line 240 and the first tick of line 241 before setting VBlank
-            pCPU->Run(BUS_CLOCKS_PER_SCANLINE + 1);
-        }
-
-        pPPU->statusReg.vBlank = true;
-        if (pPPU->controlReg.generateNMI_OnVBlank)
-            pCPU->TriggerNMI();
-
-        // Run through the rest of line 241
-        pCPU->Run(BUS_CLOCKS_PER_SCANLINE - 1);
+        // The scheduler takes care of frame timing
+        pScheduler->RunFrame();
 
-        // Now go through lines 242-260
-        for (int y = 242; y <= 260; ++y)
-        {
-            pCPU->Run(BUS_CLOCKS_PER_SCANLINE);
-            pPPU->scanline++;
-        }
-
-        // Now do the last scanline (one clock less for odd frames)
-        if (pPPU->oddFrame)
-            pCPU->Run(BUS_CLOCKS_PER_SCANLINE - 1);
-        else
-            pCPU->Run(BUS_CLOCKS_PER_SCANLINE);
-        
-        pPPU->oddFrame = !pPPU->oddFrame;
-        pPPU->scanline = 0;
-
-        // Process audio for the frame
-        pAPU->ProcessAudio(elapsedFrameTime);
+        // Audio for the frame, from the cycles the CPU ran rather than how long the frame took to show
+        pAPU->EndFrame();
 
         if (debugOutput)
             printf("End of frame\n");
-        pPPU->statusReg.vBlank = false;
     }
+    else
+        PauseAudio();
 
     return true;
 }
@@ -793,6 +718,16 @@ double StatusMonitor::LimitFPS()
         printf("F");    // Print that we've detected a frame dip
     }*/
 
+    // The audio device plays at its own rate, so don't get further ahead of it than a bit past the target latency.
+    // GetAudioRateAdjustment() takes care of the rest of the difference. Without a device playing, nothing would ever
+    // bring the fill level down.
+    while (IsAudioPlaying() && GetAudioFillLevel() > AUDIO_TARGET_FILL * 3 / 2)
+    {
+        SDL_Delay(1);
+        nextFrameTime = SDL_GetTicks();
+        frameTicks = nextFrameTime - lastFrameTime;
+    }
+
     // Store this frame time to the list of frame times
     frameTimes[frameTimesIndex] = frameTicks;
     frameTimesIndex = (frameTimesIndex + 1) % FRAMES_FOR_FPS_CALC;
@@ -834,6 +769,15 @@ void StatusMonitor::DrawAPU_Status()
     DrawStatusReg("T", pAPU->status.triangleEnabled, x + (w * 2), y);
     DrawStatusReg("N", pAPU->status.noiseEnabled, x + (w * 3), y);
     DrawStatusReg("D", pAPU->status.dmcEnabled, x + (w * 4), y);
+
+    // How much audio is buffered, and how often it's run out
+    char str[48];
+    sprintf(str, "Audio: %d samples, %d underruns", GetAudioFillLevel(), GetAudioUnderruns());
+
+    SDL_Surface *pFont = FNT_Render(str, sdlColorWhite);
+    SDL_Rect destRect = { x, y + 16, pFont->w, pFont->h };
+    SDL_BlitSurface(pFont, NULL, screenSurface, &destRect);
+    SDL_FreeSurface(pFont);
 }
 
 void StatusMonitor::DrawCPU_Status()
@@ -6,6 +6,7 @@
 #include "PPU.h"
 #include "NES_Controller.h"
 #include "APU.h"
+#include "Scheduler.h"
 #include <SDL.h>
 #include <list>
 
@@ -49,7 +50,7 @@ class StatusMonitor
 {
 public:
     StatusMonitor(RAM *pRAM, CPU_6502 *pCPU);
-    StatusMonitor(RAM *pRAM, CPU_6502 *pCPU, PPU *pPPU, APU *pAPU, NES_Controller *pController1);
+    StatusMonitor(RAM *pRAM, CPU_6502 *pCPU, PPU *pPPU, APU *pAPU, NES_Controller *pController1, Scheduler *pScheduler);
     ~StatusMonitor();
 
     bool EventLoop();
@@ -119,10 +120,11 @@ public:
     PPU *pPPU;
     NES_Controller *pController1;
     APU *pAPU;
+    Scheduler *pScheduler;
 
 protected:
-    void StatusMonitor::CopyTileToPixels(SDL_PixelFormat *format, uint8_t *pTileLSB, uint8_t *pTileMSB, uint32_t *pPixels, uint32_t tileX, uint32_t tileY);
-    void DrawPattern(SDL_Surface *pSurface, uint8_t *pPatternMemory);
+    void CopyTileToPixels(const uint32_t *colors, const uint8_t *pTile, uint32_t *pPixels, uint32_t tileX, uint32_t tileY);
+    void DrawPattern(SDL_Surface *pSurface, uint16_t patternAddress);
     void DrawStatusReg(char *regName, bool set, int x, int y);
     void DrawReg(char *regName, uint16_t value, int x, int y, bool showDecimal = true);
 
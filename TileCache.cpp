@@ -0,0 +1,29 @@
+#include "TileCache.h"
+#include "PixelKernels.h"
+
+// The whole cache is decoded up front when the ROM is loaded
+TileCache::TileCache(const uint8_t *pCHR, uint32_t chrSize)
+{
+    this->pCHR = pCHR;
+    tileCount = chrSize / TILE_BYTES;
+
+    pDecoded = new uint8_t[tileCount * TILE_PIXELS];
+    pFlipped = new uint8_t[tileCount * TILE_PIXELS];
+    dirty = new bool[tileCount];
+
+    for (uint32_t tile = 0; tile < tileCount; ++tile)
+        Decode(tile);
+}
+
+TileCache::~TileCache()
+{
+    delete[] pDecoded;
+    delete[] pFlipped;
+    delete[] dirty;
+}
+
+void TileCache::Decode(uint32_t tile)
+{
+    pixelKernels.DecodeTile(pCHR + tile * TILE_BYTES, pDecoded + tile * TILE_PIXELS, pFlipped + tile * TILE_PIXELS);
+    dirty[tile] = false;
+}
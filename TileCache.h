@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+
+#define TILE_BYTES      16  /* 8 bytes of low bits followed by 8 bytes of high bits */
+#define TILE_PIXELS     64
+
+/*
+Every 8x8 tile in CHR ROM or RAM decoded from its two bitplanes to one byte per pixel (a palette index from 0 - 3),
+row by row, along with a copy flipped horizontally for sprites. Drawing a row of a tile is then just a lookup of each
+byte in the palette.
+
+Tiles are numbered by where they are in CHR memory rather than where they're mapped on the PPU bus, so switching
+banks doesn't touch the cache. Writes to CHR RAM mark the tile dirty and it's decoded again the next time it's drawn.
+*/
+class TileCache
+{
+public:
+    TileCache(const uint8_t *pCHR, uint32_t chrSize);
+    ~TileCache();
+
+    // Returns the 64 pixels of a tile
+    const uint8_t *GetTile(uint32_t tile, bool flipped = false)
+    {
+        if (dirty[tile])
+            Decode(tile);
+
+        return (flipped ? pFlipped : pDecoded) + tile * TILE_PIXELS;
+    }
+
+    // offset is the byte in CHR memory that changed
+    void Invalidate(uint32_t offset) { dirty[offset / TILE_BYTES] = true; }
+
+protected:
+    void Decode(uint32_t tile);
+
+    const uint8_t *pCHR;
+    uint32_t tileCount;
+
+    uint8_t *pDecoded;
+    uint8_t *pFlipped;
+    bool *dirty;
+};
@@ -4,40 +4,165 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 iNES_File::iNES_File(const char *fileName)
 {
+    pImage = NULL;
+    imageSize = 0;
+    mapped = false;
+
     OpenFile(fileName);
 }
 
 
 iNES_File::~iNES_File()
 {
-    free(pCHRdata);
-    free(pPRGdata);
+    Close();
 }
 
-bool iNES_File::OpenFile(const char * fileName)
+void iNES_File::Close()
 {
+    if (pImage)
+    {
+        if (mapped)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(pImage);
+#else
+            munmap(pImage, imageSize);
+#endif
+        }
+        else
+            free(pImage);
+    }
+
+    pImage = NULL;
+    imageSize = 0;
+    mapped = false;
     pPRGdata = NULL;
     pCHRdata = NULL;
+}
 
-    printf("Header: %d bytes\n", sizeof(I_NES_HEADER));
+// Maps the whole file read-only. The OS shares the pages with every other mapping of the file.
+bool iNES_File::MapFile(const char *fileName)
+{
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+
+    // The mapping keeps the file open and the view keeps the mapping, so neither handle is needed afterwards
+    HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (!hMapping)
+        return false;
+
+    void *pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if (!pView)
+        return false;
+
+    imageSize = (size_t)size.QuadPart;
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0 || fileInfo.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the file is closed
+    void *pView = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pView == MAP_FAILED)
+        return false;
+
+    imageSize = fileInfo.st_size;
+#endif
+
+    pImage = (uint8_t*)pView;
+    mapped = true;
+    return true;
+}
+
+// Fallback for when the file can't be mapped
+bool iNES_File::LoadFile(const char *fileName)
+{
     FILE *pFile;
     pFile = fopen(fileName, "rb");
     if (!pFile)
+        return false;
+
+    fseek(pFile, 0, SEEK_END);
+    long size = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+
+    if (size <= 0)
+    {
+        fclose(pFile);
+        return false;
+    }
+
+    pImage = (uint8_t*)malloc(size);
+    if (!pImage || fread(pImage, 1, size, pFile) != (size_t)size)
+    {
+        free(pImage);
+        pImage = NULL;
+        fclose(pFile);
+        return false;
+    }
+
+    fclose(pFile);
+
+    imageSize = size;
+    mapped = false;
+    return true;
+}
+
+bool iNES_File::OpenFile(const char * fileName)
+{
+    Close();
+    prgSize = 0;
+    chrRomSize = 0;
+    mapperNumber = -1;
+
+    printf("Header: %d bytes\n", sizeof(I_NES_HEADER));
+    if (!MapFile(fileName) && !LoadFile(fileName))
     {
         printf("Unable to open %s\n", fileName);
 
         return false;
     }
 
-    I_NES_HEADER header;
-    if (fread(&header, sizeof(I_NES_HEADER), 1, pFile) != 1)
+    if (imageSize < sizeof(I_NES_HEADER))
     {
         printf("Error reading header\n");
+        Close();
         return false;
     }
 
+    memcpy(&header, pImage, sizeof(I_NES_HEADER));
+
     // Make sure header starts with NES file type ID
     char fileType[5] = { 0 };
     strncpy(fileType, header.fileID, 4);
@@ -45,6 +170,7 @@ bool iNES_File::OpenFile(const char * fileName)
     if (strcmp(fileType, "NES\x1A") != 0)
     {
         printf("%s is not an iNES file!\n", fileName);
+        Close();
         return false;
     }
 
@@ -56,29 +182,35 @@ bool iNES_File::OpenFile(const char * fileName)
 
     printf("0x%X\n0x%X\n", header.flags6.flags, header.flags7.flags);
 
-    pPRGdata = (uint8_t*)malloc(prgSize);
-    pCHRdata = (uint8_t*)malloc(chrRomSize);
+    // The trainer isn't used
+    size_t offset = sizeof(I_NES_HEADER);
+    if (header.flags6.trainerPresent)
+        offset += I_NES_TRAINER_SIZE;
 
-    if (fread(pPRGdata, 1, prgSize, pFile) != prgSize)
+    if (prgSize == 0 || imageSize < offset + prgSize)
     {
         printf("Error reading PRG ROM!\n");
+        Close();
         return false;
     }
 
-    if (fread(pCHRdata, 1, chrRomSize, pFile) != chrRomSize)
+    if (imageSize < offset + prgSize + chrRomSize)
     {
         printf("Error reading CHR ROM!\n");
+        Close();
         return false;
     }
 
-    int mapperNumber = (header.flags7.mapperNumberUpper4bits << 4)
+    // Nothing is copied, the PRG and CHR ROM are used straight out of the image
+    pPRGdata = pImage + offset;
+    pCHRdata = chrRomSize ? pPRGdata + prgSize : NULL;
+
+    mapperNumber = (header.flags7.mapperNumberUpper4bits << 4)
         | header.flags6.mapperNumberLower4bits;
 
     printf("Mapper %d\n", mapperNumber);
 
-    printf("Successfully opened %s\n", fileName);
-
-    fclose(pFile);
+    printf("Successfully opened %s%s\n", fileName, mapped ? "" : " (not memory mapped)");
 
     return true;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
 
 /*
 76543210
@@ -42,6 +43,13 @@ typedef struct I_NES_HEADER
     uint8_t padding[8];
 }I_NES_HEADER;
 
+#define I_NES_TRAINER_SIZE  512
+
+/*
+The ROM image is mapped into memory read-only, and pPRGdata and pCHRdata point into the mapping. Every mapping of the
+same file shares the same physical pages, so any number of emulators running one cartridge only keep one copy of it
+in memory. If the file can't be mapped it's read into memory instead.
+*/
 class iNES_File
 {
 public:
@@ -49,12 +57,23 @@ public:
     ~iNES_File();
 
     bool OpenFile(const char *fileName);
+    void Close();
 
     I_NES_HEADER header;
     uint32_t prgSize;
     uint32_t chrRomSize;
+    int mapperNumber;       // -1 if the file couldn't be opened
+
+    // Views into the image, which is read-only
+    const uint8_t *pPRGdata;
+    const uint8_t *pCHRdata;
+
+protected:
+    bool MapFile(const char *fileName);
+    bool LoadFile(const char *fileName);
 
-    uint8_t *pPRGdata;
-    uint8_t *pCHRdata;
+    uint8_t *pImage;        // the entire file
+    size_t imageSize;
+    bool mapped;            // pImage is a mapping of the file, not a copy
 };
 
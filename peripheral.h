@@ -10,5 +10,9 @@ public:
 
     virtual uint8_t read(uint16_t addr) = 0;
     virtual void write(uint16_t addr, uint8_t data) = 0;
+
+    // Called instead of write() by Bus::write<true>() while trace output is on.
+    // Peripherals with something to trace override it, so their write() doesn't have to check debugOutput.
+    virtual void writeTraced(uint16_t addr, uint8_t data) { write(addr, data); }
 };
 